@@ -0,0 +1,243 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// Compares the blockstore I/O backends on the same workload: every thread
+// appends fixed-size records through its own append head, then every thread
+// reads back random records.  Reports throughput and latency percentiles.
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX
+#include <unistd.h>
+
+// STL
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tr1/functional>
+#include <tr1/memory>
+#include <tr1/random>
+
+// po6
+#include <po6/threads/thread.h>
+
+// e
+#include <e/popt.h>
+#include <e/slice.h>
+#include <e/time.h>
+
+// WTF
+#include "blockstore/device.h"
+#include "blockstore/disk.h"
+
+#define SEGMENT_SIZE (64ULL * 1024ULL * 1024ULL)
+
+static long _threads = 4;
+static long _number = 100000;
+static long _size = 4096;
+static long _log_size = 4096;
+static const char* _file = "wtf-blockstore-bench.log";
+static const char* _backends = "mmap,uring";
+
+static void
+worker(wtf::disk* d, size_t id, bool reading,
+       const std::vector<size_t>* written,
+       std::vector<size_t>* offsets,
+       std::vector<uint64_t>* latencies)
+{
+    std::vector<char> buf(_size, 'a' + id % 26);
+    std::tr1::mt19937 rng(id);
+
+    for (long i = 0; i < _number; ++i)
+    {
+        uint64_t start = e::time();
+
+        if (reading)
+        {
+            size_t off = (*written)[rng() % written->size()];
+
+            if (d->read(off, buf.size(), &buf[0]) < 0)
+            {
+                fprintf(stderr, "read failed\n");
+                abort();
+            }
+        }
+        else
+        {
+            size_t off;
+
+            if (d->write(e::slice(&buf[0], buf.size()), off, id) < 0)
+            {
+                fprintf(stderr, "write failed\n");
+                abort();
+            }
+
+            offsets->push_back(off);
+        }
+
+        latencies->push_back(e::time() - start);
+    }
+}
+
+static void
+report(const char* backend, const char* phase, uint64_t elapsed,
+       std::vector<uint64_t>* latencies)
+{
+    std::sort(latencies->begin(), latencies->end());
+    size_t n = latencies->size();
+    double secs = elapsed / 1e9;
+    printf("%-6s %-5s %10.0f ops/s %8.1f MB/s  p50 %7.1fus  p99 %7.1fus  p99.9 %7.1fus\n",
+           backend, phase, n / secs, n * _size / secs / 1e6,
+           (*latencies)[n * 50 / 100] / 1e3,
+           (*latencies)[n * 99 / 100] / 1e3,
+           (*latencies)[n * 999 / 1000] / 1e3);
+}
+
+static int
+run(const std::string& backend)
+{
+    size_t log_size = _log_size * 1024ULL * 1024ULL;
+    log_size -= log_size % SEGMENT_SIZE;
+    unlink(_file);
+    std::auto_ptr<wtf::device> dev(wtf::device::create(backend));
+
+    if (!dev.get() || !dev->open(_file, log_size, true))
+    {
+        fprintf(stderr, "could not set up the %s backend\n", backend.c_str());
+        return EXIT_FAILURE;
+    }
+
+    std::vector<wtf::device*> devs(1, dev.get());
+    std::vector<size_t> lengths(1, log_size);
+    wtf::disk d(devs, lengths, SEGMENT_SIZE, _threads);
+    std::vector<std::vector<size_t> > offsets(_threads);
+    std::vector<size_t> written;
+
+    for (int phase = 0; phase < 2; ++phase)
+    {
+        std::vector<std::vector<uint64_t> > latencies(_threads);
+        std::vector<std::tr1::shared_ptr<po6::threads::thread> > threads;
+        uint64_t start = e::time();
+
+        for (long i = 0; i < _threads; ++i)
+        {
+            latencies[i].reserve(_number);
+            std::tr1::shared_ptr<po6::threads::thread> t(new po6::threads::thread(
+                std::tr1::bind(worker, &d, i, phase == 1, &written,
+                               &offsets[i], &latencies[i])));
+            threads.push_back(t);
+            t->start();
+        }
+
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i]->join();
+        }
+
+        uint64_t elapsed = e::time() - start;
+        std::vector<uint64_t> all;
+
+        for (size_t i = 0; i < latencies.size(); ++i)
+        {
+            all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+        }
+
+        report(backend.c_str(), phase == 0 ? "write" : "read", elapsed, &all);
+
+        for (size_t i = 0; phase == 0 && i < offsets.size(); ++i)
+        {
+            written.insert(written.end(), offsets[i].begin(), offsets[i].end());
+        }
+    }
+
+    unlink(_file);
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, const char* argv[])
+{
+    e::argparser ap;
+    ap.autohelp();
+    ap.arg().name('b', "backends")
+        .description("comma separated backends to compare (default: mmap,uring)")
+        .metavar("B")
+        .as_string(&_backends);
+    ap.arg().name('f', "file")
+        .description("backing file to benchmark against (default: wtf-blockstore-bench.log)")
+        .metavar("f")
+        .as_string(&_file);
+    ap.arg().name('t', "threads")
+        .description("number of threads, each with its own append head (default: 4)")
+        .metavar("N")
+        .as_long(&_threads);
+    ap.arg().name('n', "number")
+        .description("operations per thread in each phase (default: 100000)")
+        .metavar("N")
+        .as_long(&_number);
+    ap.arg().name('s', "size")
+        .description("size of each record in bytes (default: 4096)")
+        .metavar("S")
+        .as_long(&_size);
+    ap.arg().name('l', "log-size")
+        .description("size of the backing file in MB (default: 4096)")
+        .metavar("MB")
+        .as_long(&_log_size);
+
+    if (!ap.parse(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (_threads <= 0 || _number <= 0 || _size <= 0)
+    {
+        fprintf(stderr, "threads, number and size must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    std::string backends(_backends);
+    size_t pos = 0;
+
+    while (pos <= backends.size())
+    {
+        size_t comma = backends.find(',', pos);
+        comma = comma == std::string::npos ? backends.size() : comma;
+
+        if (comma > pos && run(backends.substr(pos, comma - pos)) != EXIT_SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+
+        pos = comma + 1;
+    }
+
+    return EXIT_SUCCESS;
+}
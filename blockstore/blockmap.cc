@@ -1,16 +1,103 @@
+// STL
+#include <algorithm>
+
+#include <e/endian.h>
+#include <e/time.h>
+
 #include "common/macros.h"
 #include "blockstore/vblock.h"
 #include "blockstore/blockmap.h"
+#include "blockstore/codec.h"
+#include "blockstore/crc32c.h"
+#include "blockstore/murmur3.h"
 
 #define BACKING_SIZE 100000000000 
-#define ROUND_UP(X, Y) ((X + Y - 1) & (X))
+#define ROUND_UP(X, Y) (((X) + (Y) - 1) & ~((Y) - 1))
+#define SEGMENT_SIZE (256ULL * 1024ULL * 1024ULL)
+
+// Start cleaning once fewer than this many segments are free, and only clean
+// segments that are at most this percent live.
+#define CLEANER_FREE_SEGMENTS 16
+#define CLEANER_MAX_LIVE 50
+#define CLEANER_SEGMENTS_PER_PASS 4
+
+// Entries per WriteBatch when a store from before the segment index is
+// indexed at startup.
+#define SEGMENT_INDEX_BATCH 4096
+
+// The decoded offset map cache is bounded by the number of slices it holds.
+#define VBLOCK_CACHE_SHARDS 16
+#define VBLOCK_CACHE_SLICES (1024ULL * 1024ULL)
+
+// Blocks updated into at least this many slices are rewritten contiguously in
+// the background, a bounded number per pass.
+#define DEFRAG_MIN_SLICES 16
+#define DEFRAG_QUEUE_MAX 4096
+#define DEFRAG_PER_PASS 64
+
+// Writes smaller than this are never compressed, and a compressed record is
+// only kept if it saves at least an eighth of the raw bytes.
+#define COMPRESS_MIN_SIZE 512
+
+// Writes smaller than this are never deduplicated; the index lookup would
+// cost more than the write it saves.
+#define DEDUP_MIN_SIZE 4096
+#define FINGERPRINT_SEED 0x77746621
+
+// readv reads across gaps of up to this many bytes between the ranges it needs
+// rather than issue another I/O.
+#define READV_MERGE_GAP 4096
+
+// Upper bound on the number of released bids deleted in one WriteBatch.
+#define SWEEP_BATCH 256
+
+// Each shard reserves this many bids at a time in the checkpointed state, so
+// that bids are never reused after a crash.
+#define BID_LEASE 65536
+
+// Version of the "state" record.  Version 1 had a single backing file.
+#define STATE_VERSION 2
 
 using wtf::blockmap;
 using wtf::vblock;
+using wtf::crc32c;
 
 blockmap::blockmap() : m_db()
-                     , m_backing_size(ROUND_UP(BACKING_SIZE, getpagesize()))
-                     , m_block_id(0)
+                     , m_backing_size(ROUND_UP(BACKING_SIZE, SEGMENT_SIZE))
+                     , m_disk(NULL)
+                     , m_devices()
+                     , m_shards()
+                     , m_next_shard(0)
+                     , m_mtx()
+                     , m_relocations()
+                     , m_prev_relocations()
+                     , m_rewrites(0)
+                     , m_sync(false)
+                     , m_state_mtx()
+                     , m_backing_paths()
+                     , m_bid_limit(0)
+                     , m_cache(VBLOCK_CACHE_SHARDS, VBLOCK_CACHE_SLICES)
+                     , m_defrag_mtx()
+                     , m_defrag()
+                     , m_defragged(0)
+                     , m_released(0)
+                     , m_swept(0)
+                     , m_scrub_cursor()
+                     , m_scrubbed(0)
+                     , m_corrupt(0)
+                     , m_repaired(0)
+                     , m_codec(CODEC_NONE)
+                     , m_compress_in(0)
+                     , m_compress_out(0)
+                     , m_compress_ns(0)
+                     , m_uncompress_bytes(0)
+                     , m_uncompress_ns(0)
+                     , m_dedup(false)
+                     , m_dedup_hits(0)
+                     , m_dedup_bytes(0)
+                     , m_hole_bytes(0)
+                     , m_prefetched(0)
+                     , m_flushes(0)
 {
 }
 
@@ -30,8 +117,19 @@ get_filesize(const po6::pathname& path)
 }
 
 bool
-blockmap :: setup(const po6::pathname& path, const po6::pathname& backing_path)
+blockmap :: setup(const po6::pathname& path,
+                  const std::vector<po6::pathname>& backing_paths,
+                  size_t shards,
+                  const std::string& backend,
+                  bool preallocate)
 {
+    shards = shards > 0 ? shards : 1;
+
+    for (size_t i = 0; i < shards; ++i)
+    {
+        m_shards.push_back(std::tr1::shared_ptr<shard>(new shard(i)));
+    }
+
     leveldb::Options opts;
     opts.write_buffer_size = 64ULL * 1024ULL * 1024ULL;
     opts.create_if_missing = true;
@@ -86,6 +184,7 @@ blockmap :: setup(const po6::pathname& path, const po6::pathname& backing_path)
 
     leveldb::Slice sk("state", 5);
     std::string sbacking;
+    std::string disk_state;
     st = m_db->Get(ropts, sk, &sbacking);
 
     if (st.ok())
@@ -102,8 +201,8 @@ blockmap :: setup(const po6::pathname& path, const po6::pathname& backing_path)
     {
         if (!first_time)
         {
-            PLOG(ERROR) << "could not restore from LevelDB because a previous "
-                       << "execution crashed; run the recovery program and try again";
+            PLOG(ERROR) << "could not restore from LevelDB because it has no "
+                       << "checkpoint of the log; it was never fully initialized";
             return false;
         }
     }
@@ -127,75 +226,136 @@ blockmap :: setup(const po6::pathname& path, const po6::pathname& backing_path)
         return false;
     }
 
-    //create a new disk.
-    //XXX: Set to true for testing
-    if (true)
+    if (!first_time)
     {
-        m_fd = open(backing_path.get(), O_RDWR | O_CREAT, 0666);
-        if (m_fd.get() < 0)
+        e::unpacker up(sbacking.data(), sbacking.size());
+        uint8_t version = 0;
+        uint32_t paths = 1;
+        up = up >> version >> m_backing_size >> m_bid_limit;
+
+        if (version == STATE_VERSION)
         {
-            PLOG(ERROR) << "could not open backing file " << backing_path;
-            return false;
+            up = up >> paths;
+        }
+        else if (version != 1)
+        {
+            up = up.as_error();
+        }
+
+        for (uint32_t i = 0; !up.error() && i < paths; ++i)
+        {
+            e::slice saved_path;
+            up = up >> saved_path;
+            m_backing_paths.push_back(std::string(
+                        reinterpret_cast<const char*>(saved_path.data()),
+                        saved_path.size()));
         }
 
-        if (ftruncate(m_fd.get(), m_backing_size) < 0)
+        e::slice saved_disk;
+        up = up >> saved_disk;
+
+        if (up.error())
         {
-            PLOG(ERROR) << "could not extend backing file to size " << m_backing_size;
+            PLOG(ERROR) << "could not restore from LevelDB because a previous "
+                << "execution saved invalid state.";
             return false;
         }
 
-        LOG(INFO) << "Backing size is " << m_backing_size;
+        disk_state.assign(reinterpret_cast<const char*>(saved_disk.data()),
+                          saved_disk.size());
+    }
+
+    // The order of the backing files fixes the layout of the log, so files
+    // named for the first time are added after the ones already in use.
+    size_t known = m_backing_paths.size();
+
+    for (size_t i = 0; i < backing_paths.size(); ++i)
+    {
+        std::string p(backing_paths[i].get());
+
+        if (std::find(m_backing_paths.begin(), m_backing_paths.end(), p) ==
+            m_backing_paths.end())
+        {
+            m_backing_paths.push_back(p);
+        }
+    }
+
+    std::vector<device*> devices;
+    std::vector<size_t> lengths;
 
-        char* backing = (char*)mmap(NULL, m_backing_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd.get(), 0);
+    for (size_t i = 0; i < m_backing_paths.size(); ++i)
+    {
+        std::tr1::shared_ptr<device> dev(device::create(backend));
 
-        if (backing == MAP_FAILED)
+        if (!dev.get() ||
+            !dev->open(m_backing_paths[i], m_backing_size, i >= known))
         {
-            PLOG(ERROR) << "mmap of " << m_backing_size << " bytes to file " << backing_path << " failed.";
             return false;
         }
 
-        //LOG(INFO) << "mmaping region " << (void*)backing << "->" << (void*)(backing + m_backing_size);
-        m_disk = new disk(backing, m_backing_size);
+        if (preallocate)
+        {
+            dev->preallocate(m_backing_size);
+        }
 
-        return true;
+        LOG(INFO) << "Backing file " << m_backing_paths[i] << " is "
+                  << m_backing_size << " bytes using the " << backend
+                  << " backend" << (i >= known && !first_time ? " (new)" : "");
+        m_devices.push_back(dev);
+        devices.push_back(dev.get());
+        lengths.push_back(m_backing_size);
     }
 
-    //use an existing disk.
-    e::unpacker up(sbacking.data(), sbacking.size());
-    uint64_t backing_offset;
-    up = up >> backing_offset >> m_backing_size;
-    if (up.error())
+    m_disk = new disk(devices, lengths, SEGMENT_SIZE, shards + 1);
+
+    if (!first_time && !m_disk->restore(e::slice(disk_state.data(), disk_state.size())))
     {
-        PLOG(ERROR) << "could not restore from LevelDB because a previous "
-            << "execution saved invalid state.";
+        LOG(ERROR) << "could not recover the log";
         return false;
     }
 
-    e::slice data = up.as_slice();
-    m_fd = open((char*)data.data(), O_RDWR, 0666);
-    if (m_fd.get() < 0)
+    // Stores from before the segment index get it built once, by a full scan.
+    leveldb::Slice ik("refs", 4);
+    std::string ibacking;
+    bool indexed = first_time || m_db->Get(ropts, ik, &ibacking).ok();
+
+    if (!indexed && !build_references())
     {
-        PLOG(ERROR) << "could not open backing file " << data.data();
+        LOG(ERROR) << "could not index the offset maps by segment";
         return false;
     }
 
-    if (ftruncate(m_fd.get(), m_backing_size) < 0)
+    if (!first_time && !count_live())
     {
-        PLOG(ERROR) << "could not extend backing file to size " << m_backing_size;
+        LOG(ERROR) << "could not count the live bytes of the log";
         return false;
     }
 
-    char* backing = (char*)mmap(NULL, m_backing_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd.get(), 0);
+    // Bids below m_bid_limit may have been handed out before a crash.
+    uint64_t seq = (m_bid_limit + shards - 1) / shards;
 
-    if (backing == MAP_FAILED)
+    for (size_t i = 0; i < shards; ++i)
     {
-        PLOG(ERROR) << "mmap of " << m_backing_size << " bytes to file " << backing_path << " failed.";
-        return false;
+        m_shards[i]->next_seq = seq;
+        m_shards[i]->reserved = seq;
     }
 
-    m_disk = new disk(backing, m_backing_size);
+    // The "wtf" key goes in with the first checkpoint so that the two are
+    // never seen apart.
+    leveldb::WriteBatch updates;
+
+    if (first_time)
+    {
+        updates.Put(rk, leveldb::Slice("1", 1));
+    }
 
-    return true;
+    if (first_time || !indexed)
+    {
+        updates.Put(ik, leveldb::Slice());
+    }
+
+    po6::threads::mutex::hold hold(&m_state_mtx);
+    return save_state(&updates);
 }
 
 ssize_t 
@@ -214,240 +374,2476 @@ blockmap :: read_offset_map(uint64_t bid, vblock& vb)
         return -1;
     }
 
-    std::auto_ptr<e::buffer> buf(e::buffer::create(rbacking.data(), rbacking.size()));
+    e::unpacker up(rbacking.data(), rbacking.size());
+    up = up >> vb;
+
+    if (up.error())
+    {
+        LOG(ERROR) << "offset map for bid " << bid << " is corrupt";
+        return -1;
+    }
 
-    //LOG(INFO) << "bid="<<bid<<": " << buf->hex();
+    return 0;
+}
 
-    e::unpacker up = buf->unpack_from(0);
+// Read-only access to the encoded offset map of bid, served from the cache
+// when possible.  The map is searched in place and never decoded.
+ssize_t
+blockmap :: lookup_offset_map(uint64_t bid, e::intrusive_ptr<vblock_record>* rec)
+{
+    uint64_t epoch;
 
-    up = up >> vb;
+    if (m_cache.get(bid, rec, &epoch))
+    {
+        return 0;
+    }
+
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = true;
+    ropts.verify_checksums = true;
+
+    e::intrusive_ptr<vblock_record> tmp(new vblock_record());
+    leveldb::Slice rk((char*)&bid, sizeof(bid));
+    leveldb::Status st = m_db->Get(ropts, rk, &tmp->data());
+
+    if (!st.ok())
+    {
+        return -1;
+    }
 
-    //LOG(INFO) << vb;
+    if (!tmp->parse())
+    {
+        LOG(ERROR) << "offset map for bid " << bid << " is corrupt";
+        return -1;
+    }
 
+    m_cache.put(bid, tmp, epoch);
+    *rec = tmp;
     return 0;
 }
 
-ssize_t 
-blockmap :: update_offset_map(uint64_t bid, vblock& vb, size_t offset, size_t len, size_t disk_offset)
+ssize_t
+blockmap :: write_offset_map(uint64_t bid, vblock& vb, const origin* o)
 {
-    ssize_t status = read_offset_map(bid, vb);
-    vb.update(offset, len, disk_offset);
+    return write_offset_map(bid, vb, static_cast<const uint64_t*>(NULL), o);
 }
 
+// Write the map of a bid derived from parent, along with a record saying
+// which bid superseded parent.  The parent's map stays put until the client
+// releases it.
 ssize_t
-blockmap :: write_offset_map(uint64_t bid, vblock& vb)
+blockmap :: write_offset_map(uint64_t bid, vblock& vb, uint64_t parent,
+                             const origin* o)
 {
+    return write_offset_map(bid, vb, &parent, o);
+}
 
-    std::auto_ptr<e::buffer> buf(e::buffer::create(vb.pack_size()));
-    e::buffer::packer pa = buf->pack_at(0);
-    pa = pa << vb;
-
-    leveldb::WriteBatch updates;
+// New offset maps are group committed per shard.  Each writer adds its map
+// to the shard's open group and waits; whichever writer finds no commit in
+// progress takes the open group and writes it to LevelDB in one batch while
+// the others keep adding to the next group.  Relocation and cleaner tracking
+// are decided under the shard's lock when the map joins a group, and the
+// cleaner changes them only with every shard's lock held, so writers never
+// contend across shards.  Live bytes are counted with atomics.  The origin,
+// if any, joins the same group as the map.
+ssize_t
+blockmap :: write_offset_map(uint64_t bid, vblock& vb, const uint64_t* parent,
+                             const origin* o)
+{
+    shard* sh = shard_of(bid);
+    sh->mtx.lock();
+    relocate(vb);
 
-    // create the key
-    leveldb::Slice v_block_id((char*)&bid, sizeof(bid));
+    if (sh->tracking && touches_cleaning(vb))
+    {
+        sh->dirty.push_back(bid);
+    }
 
+    account(vb, true);
 
-    // create the value
-    leveldb::Slice offset_map((char*)buf->data(), buf->size());
+    if (!sh->open_group)
+    {
+        sh->open_group = new commit_group();
+    }
 
-    // put the object
-    updates.Put(v_block_id, offset_map);
+    commit_group* g = sh->open_group;
 
-    // Perform the write
-    leveldb::WriteOptions opts;
-    opts.sync = false;
-    leveldb::Status st = m_db->Write(opts, &updates);
+    if (parent)
+    {
+        std::string sk(lifecycle_key(SUPERSEDED, *parent));
+        leveldb::Slice child((char*)&bid, sizeof(bid));
+        g->updates.Put(sk, child);
+    }
 
-    if (st.ok())
+    if (o)
     {
-        return 0;
+        batch_origin(bid, e::slice(o->tag), e::slice(o->peers), &g->updates);
     }
-    else
+
+    batch_offset_map(bid, vb, &g->updates);
+    ++g->writers;
+    ++g->waiters;
+
+    while (!g->done)
     {
-        return -1;
+        if (sh->committing)
+        {
+            sh->commit_cond.wait();
+        }
+        else
+        {
+            commit_open_group(sh);
+        }
     }
 
-}
+    bool ok = g->ok;
 
+    if (--g->waiters == 0)
+    {
+        delete g;
+    }
 
-//Write a completely new block.
-ssize_t
-blockmap :: write(const e::slice& data,
-                 uint64_t& bid)
-{
-    TRACE;
-    ssize_t status = -1;
-    size_t disk_offset;
+    sh->mtx.unlock();
 
-    status = m_disk->write(data, disk_offset);
-    if (status < 0)
+    if (!ok)
     {
-        return status;
+        account(vb, false);
     }
 
-    bid = m_block_id++;
+    return ok ? 0 : -1;
+}
+
+// Must be called with sh->mtx held and no commit in progress on sh.  The lock
+// is dropped while LevelDB does the write.
+void
+blockmap :: commit_open_group(shard* sh)
+{
+    commit_group* g = sh->open_group;
+    sh->open_group = NULL;
+    sh->committing = true;
+    sh->mtx.unlock();
 
-    vblock vb;
-    vb.update(0, data.size(), disk_offset);
+    leveldb::WriteOptions opts;
+    opts.sync = m_sync;
+    leveldb::Status st = m_db->Write(opts, &g->updates);
 
-    if (write_offset_map(bid, vb) < 0)
+    sh->mtx.lock();
+    g->ok = st.ok();
+    g->done = true;
+    sh->committing = false;
+    ++sh->groups;
+    sh->grouped += g->writers;
+
+    if (!g->ok)
     {
-        return -1;
+        LOG(ERROR) << "could not commit " << g->writers
+                   << " offset maps: " << st.ToString();
     }
-    else
+
+    sh->commit_cond.broadcast();
+}
+
+// Wait until every map that has joined a group so far is in LevelDB.  Must be
+// called with every shard's lock held, so that once a shard is flushed no new
+// maps join it.
+void
+blockmap :: flush_groups()
+{
+    for (size_t i = 0; i < m_shards.size(); ++i)
     {
-        return status;
+        shard* sh = m_shards[i].get();
+
+        while (sh->committing || sh->open_group)
+        {
+            if (sh->committing)
+            {
+                sh->commit_cond.wait();
+            }
+            else
+            {
+                commit_open_group(sh);
+            }
+        }
     }
 }
 
-ssize_t
-blockmap :: update(const e::slice& data,
-             size_t offset,
-             uint64_t& bid,
-             uint64_t& block_len)
+// The cleaner's relocation and tracking state is read by writers under their
+// shard's lock, so it changes only with every shard's lock held.  The locks
+// are always taken in shard order.
+void
+blockmap :: hold_shards()
 {
-    TRACE;
-    ssize_t status = -1;
-    size_t disk_offset;
-
-    status = m_disk->write(data, disk_offset);
-    if (status < 0)
+    for (size_t i = 0; i < m_shards.size(); ++i)
     {
-        TRACE;
-        return status;
+        m_shards[i]->mtx.lock();
     }
+}
 
-    vblock vb;
-    if (read_offset_map(bid, vb) < 0)
+void
+blockmap :: release_shards()
+{
+    for (size_t i = m_shards.size(); i > 0; --i)
     {
-        TRACE;
-        return -1;
+        m_shards[i - 1]->mtx.unlock();
     }
+}
 
-    bid = m_block_id++;
-
-    TRACE;
-    vb.update(offset, data.size(), disk_offset);
-    block_len = vb.length();
-
+// Bids are striped across shards so that the shard of any bid is bid % N.
+// Each shard hands out its own stripe without touching the others.  Fails if
+// the reservation covering the bid could not be made durable.
+bool
+blockmap :: next_bid(shard* sh, uint64_t* bid)
+{
+    uint64_t seq = __sync_fetch_and_add(&sh->next_seq, 1);
 
-    if (write_offset_map(bid, vb) < 0)
-    {
-        TRACE;
-        return -1;
-    }
-    else
+    if (seq >= __sync_fetch_and_add(&sh->reserved, 0) &&
+        !reserve_bids(sh, seq))
     {
-        TRACE;
-        return status;
+        return false;
     }
+
+    *bid = seq * m_shards.size() + sh->id;
+    return true;
 }
 
-ssize_t 
-blockmap :: read(uint64_t bid,
-                 uint8_t* data, 
-                 size_t offset,
-                 size_t len)
-{   
-    vblock vb;
+// Extend the shard's reservation past seq and make it durable before any bid
+// in the new range is handed out.  Other threads read sh->reserved without
+// the lock, so it is raised only once the new limit is on disk.
+bool
+blockmap :: reserve_bids(shard* sh, uint64_t seq)
+{
+    po6::threads::mutex::hold hold(&m_state_mtx);
 
-    if (read_offset_map(bid, vb) < 0)
+    if (seq < sh->reserved)
     {
-        return -1;
+        return true;
     }
 
-    vblock::slice_map::const_iterator it;
-    size_t status = vb.get_slices(offset, len, it);
+    uint64_t old_limit = m_bid_limit;
+    m_bid_limit = std::max(m_bid_limit, (seq + BID_LEASE) * m_shards.size());
+    leveldb::WriteBatch updates;
 
-    if (status < 0)
+    if (!save_state(&updates))
     {
-        return -1;
+        LOG(ERROR) << "could not checkpoint bid reservation; refusing to hand "
+                   << "out bid " << seq * m_shards.size() + sh->id;
+        m_bid_limit = old_limit;
+        return false;
     }
 
-    size_t rem = len;
-    size_t disk_offset;
-    size_t disk_len;
-    bool first = true;
+    __sync_lock_test_and_set(&sh->reserved, seq + BID_LEASE);
+    return true;
+}
+
+// Checkpoint the bid reservations and the state of the log along with any
+// other updates.  Must be called with m_state_mtx held.
+bool
+blockmap :: save_state(leveldb::WriteBatch* updates)
+{
+    std::string disk_state;
+    m_disk->save(&disk_state);
+    size_t sz = sizeof(uint8_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t)
+              + sizeof(uint32_t) + disk_state.size();
 
-    do
+    for (size_t i = 0; i < m_backing_paths.size(); ++i)
     {
-        e::intrusive_ptr<vblock::slice> s = it->second;
+        sz += sizeof(uint32_t) + m_backing_paths[i].size();
+    }
 
-        if (s->offset() > offset + rem - 1)
-        {
-            // no more data in the block to read. bail out early.
-            break;
-        }
+    std::auto_ptr<e::buffer> buf(e::buffer::create(sz));
+    e::buffer::packer pa = buf->pack_at(0);
+    pa = pa << static_cast<uint8_t>(STATE_VERSION) << m_backing_size << m_bid_limit
+            << static_cast<uint32_t>(m_backing_paths.size());
 
-        if (first)
-        {
-            // The first one might contain some extra stuff to the left.
-            disk_offset = s->disk_offset() + (offset - s->offset());
-            disk_len = s->length() - (offset - s->offset());
-            first = false;
-        }
-        else if (s->offset() > offset)
-        {
-            // missing slices are allowed, but result is undefined
-            // regions.
-            offset = s->offset();
-            disk_offset = s->disk_offset();
-            disk_len = s->length();
-        }
-        else
-        {
-            //we need to consume the whole slice.
-            disk_offset = s->disk_offset();
-            disk_len = s->length();
-        }
+    for (size_t i = 0; i < m_backing_paths.size(); ++i)
+    {
+        pa = pa << e::slice(m_backing_paths[i].data(), m_backing_paths[i].size());
+    }
 
-        // This will truncate the last slice right where we need it.
-        disk_len = disk_len > rem ? rem : disk_len;
+    pa = pa << e::slice(disk_state.data(), disk_state.size());
 
-        LOG(INFO) << "disk_offset: " << disk_offset;
-        LOG(INFO) << "disk_len: " << disk_len;
+    leveldb::WriteOptions opts;
+    opts.sync = true;
+    leveldb::Slice sk("state", 5);
+    leveldb::Slice sv(reinterpret_cast<const char*>(buf->data()), buf->size());
+    updates->Put(sk, sv);
+    leveldb::Status st = m_db->Write(opts, updates);
 
-        status = m_disk->read(disk_offset, disk_len, (char*)data);
-        if (status < 0)
-        {
-            return -1;
-        }
+    if (!st.ok())
+    {
+        LOG(ERROR) << "could not checkpoint blockmap state: " << st.ToString();
+        return false;
+    }
 
-        rem -= status;
-        offset += status;
-        data += status; //advance the buffer.
-        ++it;
+    return true;
+}
 
-    }while (rem > 0);
+ssize_t
+blockmap :: checkpoint()
+{
+    po6::threads::mutex::hold hold(&m_state_mtx);
 
-    return len - rem;
+    if (!m_disk)
+    {
+        return 0;
+    }
 
+    leveldb::WriteBatch updates;
+    return save_state(&updates) ? 0 : -1;
 }
 
+// Make everything written so far durable: the log first, so that a durable
+// offset map never points at bytes that are not, then the LevelDB log, which
+// a synced write forces out along with every map committed before it.
 ssize_t
-blockmap :: truncate(uint64_t& bid,
-                     size_t len)
+blockmap :: flush()
 {
-    vblock vb;
-    if (read_offset_map(bid, vb) < 0)
+    if (!m_disk || !m_disk->sync())
     {
-        TRACE;
         return -1;
     }
 
-    bid = m_block_id++;
-
-    TRACE;
-    vb.set_len(len);
+    leveldb::WriteBatch empty;
+    leveldb::WriteOptions opts;
+    opts.sync = true;
 
-    if (write_offset_map(bid, vb) < 0)
+    if (!m_db->Write(opts, &empty).ok())
     {
-        TRACE;
         return -1;
     }
-    else
+
+    __sync_fetch_and_add(&m_flushes, 1);
+    return 0;
+}
+
+blockmap::shard*
+blockmap :: shard_of(uint64_t bid)
+{
+    return m_shards[bid % m_shards.size()].get();
+}
+
+// Each thread sticks to one shard for new blocks, assigned round robin the
+// first time it writes.
+blockmap::shard*
+blockmap :: local_shard()
+{
+    static __thread size_t assigned = 0;
+
+    if (assigned == 0)
     {
-        return len;
+        assigned = __sync_add_and_fetch(&m_next_shard, 1);
     }
+
+    return m_shards[(assigned - 1) % m_shards.size()].get();
+}
+
+void
+blockmap :: batch_offset_map(uint64_t bid, vblock& vb, leveldb::WriteBatch* updates)
+{
+    std::auto_ptr<e::buffer> buf(e::buffer::create(vb.pack_size()));
+    e::buffer::packer pa = buf->pack_at(0);
+    pa = pa << vb;
+
+    // create the key
+    leveldb::Slice v_block_id((char*)&bid, sizeof(bid));
+
+    // create the value
+    leveldb::Slice offset_map((char*)buf->data(), buf->size());
+
+    // put the object
+    updates->Put(v_block_id, offset_map);
+    batch_references(vb, v_block_id, updates);
+}
+
+ssize_t
+blockmap :: put_offset_map(uint64_t bid, vblock& vb, leveldb::WriteBatch* updates)
+{
+    batch_offset_map(bid, vb, updates);
+
+    // Perform the write
+    leveldb::WriteOptions opts;
+    opts.sync = m_sync;
+    leveldb::Status st = m_db->Write(opts, updates);
+
+    if (st.ok())
+    {
+        return 0;
+    }
+    else
+    {
+        return -1;
+    }
+
+}
+
+//Write a completely new block.
+ssize_t
+blockmap :: write(const e::slice& data,
+                 uint64_t& bid,
+                 const origin* o)
+{
+    TRACE;
+    ssize_t status = -1;
+    shard* sh = local_shard();
+    vblock::slice s(0, data.size(), 0, 0);
+    bool pinned = false;
+
+    status = place(data, sh->id, &s, &pinned);
+    if (status < 0)
+    {
+        return status;
+    }
+
+    ssize_t ret = -1;
+    vblock vb;
+    vb.update(s);
+
+    if (next_bid(sh, &bid))
+    {
+        ret = write_offset_map(bid, vb, o);
+    }
+
+    if (pinned)
+    {
+        m_disk->unpin(s.disk_offset());
+    }
+
+    if (ret < 0)
+    {
+        return -1;
+    }
+    else
+    {
+        return status;
+    }
+}
+
+ssize_t
+blockmap :: update(const e::slice& data,
+             size_t offset,
+             uint64_t& bid,
+             uint64_t& block_len,
+             const origin* o)
+{
+    TRACE;
+    ssize_t status = -1;
+    shard* sh = shard_of(bid);
+    vblock::slice s(offset, data.size(), 0, 0);
+    bool pinned = false;
+
+    status = place(data, sh->id, &s, &pinned);
+    if (status < 0)
+    {
+        TRACE;
+        return status;
+    }
+
+    vblock vb;
+    ssize_t ret = read_offset_map(bid, vb);
+
+    if (ret == 0)
+    {
+        uint64_t parent = bid;
+
+        if (next_bid(sh, &bid))
+        {
+            TRACE;
+            vb.update(s);
+            block_len = vb.length();
+            ret = write_offset_map(bid, vb, parent, o);
+        }
+        else
+        {
+            ret = -1;
+        }
+    }
+
+    if (pinned)
+    {
+        m_disk->unpin(s.disk_offset());
+    }
+
+    if (ret < 0)
+    {
+        TRACE;
+        return -1;
+    }
+    else
+    {
+        TRACE;
+
+        if (vb.size() >= DEFRAG_MIN_SLICES)
+        {
+            queue_defrag(bid);
+        }
+
+        return status;
+    }
+}
+
+// Check len bytes of data, starting at a chunk boundary at in the record of
+// chunked slice s, against table, the record's CRC table.  Records of a single
+// chunk have no table; the slice's own CRC covers the chunk.
+static bool
+check_chunks(const vblock::slice& s, size_t at, size_t len,
+             const char* data, const char* table)
+{
+    const size_t chunk = vblock::slice::CRC_CHUNK;
+    size_t record = s.record_length();
+
+    if (!s.checksummed())
+    {
+        return true;
+    }
+
+    if (record == s.stored_length())
+    {
+        return crc32c(data, len) == s.crc();
+    }
+
+    if (crc32c(table, s.stored_length() - record) != s.crc())
+    {
+        return false;
+    }
+
+    for (size_t off = 0; off < len; off += chunk)
+    {
+        uint32_t crc;
+        e::unpack32be(reinterpret_cast<const uint8_t*>(table) +
+                      (at + off) / chunk * sizeof(uint32_t), &crc);
+
+        if (crc32c(data + off, std::min(chunk, len - off)) != crc)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Check the CRCs of a whole record, or for a plain slice that is not chunked,
+// of the slice's bytes.
+static bool
+check_record(const vblock::slice& s, const char* record)
+{
+    if (s.chunked())
+    {
+        size_t len = s.record_length();
+        return check_chunks(s, 0, len, record, record + len);
+    }
+
+    return !s.checksummed() || crc32c(record, s.disk_length()) == s.crc();
+}
+
+// A slice can be read in place, without fetching its whole record, unless it
+// is compressed or the read covers only part of a checksummed slice.  Chunked
+// slices are read by chunk instead; see slice_span.
+static bool
+reads_in_place(const vblock::slice& s, size_t from, size_t len)
+{
+    return !s.compressed() && !s.chunked() &&
+           (!s.checksummed() || (from == 0 && len == s.length()));
+}
+
+// The bytes in the log needed to read [from, from + len) of slice s, and
+// whether they are exactly the bytes asked for.  A chunked slice needs the
+// CRC chunks the read touches plus, for records of more than one chunk, the
+// CRC table at the end of the record; [*table, *table_end) is empty when
+// there is no table to read.
+static bool
+slice_span(const vblock::slice& s, size_t from, size_t len,
+           uint64_t* start, uint64_t* end,
+           uint64_t* table, uint64_t* table_end)
+{
+    *table = 0;
+    *table_end = 0;
+
+    if (s.chunked())
+    {
+        const size_t chunk = vblock::slice::CRC_CHUNK;
+        size_t record = s.record_length();
+        size_t at = s.skip() + from;
+        size_t lo = at / chunk * chunk;
+        size_t hi = std::min(record, (at + len + chunk - 1) / chunk * chunk);
+        *start = s.disk_offset() + lo;
+        *end = s.disk_offset() + hi;
+
+        if (record != s.stored_length())
+        {
+            *table = s.disk_offset() + record;
+            *table_end = s.disk_offset() + s.stored_length();
+        }
+
+        return lo == at && hi == at + len;
+    }
+
+    if (reads_in_place(s, from, len))
+    {
+        *start = s.disk_offset() + from;
+        *end = *start + len;
+        return true;
+    }
+
+    *start = s.disk_offset();
+    *end = *start + s.disk_length();
+    return false;
+}
+
+ssize_t 
+blockmap :: read(uint64_t bid,
+                 uint8_t* data, 
+                 size_t offset,
+                 size_t len)
+{   
+    extent ext(bid, offset, len, data);
+
+    if (readv(&ext, 1) < 0)
+    {
+        return -1;
+    }
+
+    return ext.got;
+}
+
+// The part of a readv extent that falls in one slice, and the bytes on disk
+// needed to produce it.
+struct blockmap::readv_piece
+{
+    readv_piece(size_t e, const vblock::slice& _s, size_t f, size_t n, char* o)
+        : ext(e), s(_s), from(f), len(n), out(o)
+        , in_place(false), start(0), end(0), table(0), table_end(0)
+        , range(0), table_range(0)
+    { in_place = slice_span(_s, f, n, &start, &end, &table, &table_end); }
+    size_t ext;
+    vblock::slice s;
+    size_t from;
+    size_t len;
+    char* out;
+    bool in_place;
+    uint64_t start;
+    uint64_t end;
+    uint64_t table;
+    uint64_t table_end;
+    size_t range;
+    size_t table_range;
+};
+
+// Read a set of extents in one go.  Every extent is resolved against its
+// offset map first; holes are zero-filled on the spot.  The bytes needed from
+// disk are then sorted by disk offset, ranges that touch or nearly touch are
+// merged, and the lot is handed to the device as one batch.  A range that
+// feeds exactly one slice read in place lands directly in the caller's
+// buffer; the rest are staged and scattered afterwards.  Like read(), each
+// extent is cut off at the end of its block and ext->got says how much was
+// read; an extent that starts past the end gets nothing.  Fails if any block
+// cannot be looked up or read.
+ssize_t
+blockmap :: readv(extent* exts, size_t exts_sz)
+{
+    std::vector<readv_piece> pieces;
+    ssize_t total = 0;
+
+    for (size_t i = 0; i < exts_sz; ++i)
+    {
+        extent* x = &exts[i];
+        e::intrusive_ptr<vblock_record> rec;
+        x->got = 0;
+
+        if (lookup_offset_map(x->bid, &rec) < 0)
+        {
+            return -1;
+        }
+
+        const vblock_view& vv(rec->view());
+        uint64_t length = vv.length();
+
+        if (x->offset >= length)
+        {
+            continue;
+        }
+
+        size_t want = std::min<uint64_t>(x->len, length - x->offset);
+        size_t idx = vv.find(x->offset);
+        size_t pos = 0;
+
+        while (pos < want && idx < vv.size())
+        {
+            const vblock::slice s(vv.slice_at(idx));
+            uint64_t at = x->offset + pos;
+            char* out = reinterpret_cast<char*>(x->data) + pos;
+
+            if (s.offset() > at)
+            {
+                // A hole: never written, so zeros without any disk I/O.
+                size_t gap = std::min<uint64_t>(s.offset() - at, want - pos);
+                memset(out, 0, gap);
+                __sync_fetch_and_add(&m_hole_bytes, gap);
+                pos += gap;
+                continue;
+            }
+
+            size_t from = at - s.offset();
+            size_t n = std::min<uint64_t>(s.length() - from, want - pos);
+
+            if (n > 0)
+            {
+                pieces.push_back(readv_piece(i, s, from, n, out));
+            }
+
+            pos += n;
+            ++idx;
+        }
+
+        if (pos < want)
+        {
+            // A hole past the last slice reads as zeros too.
+            memset(reinterpret_cast<char*>(x->data) + pos, 0, want - pos);
+            __sync_fetch_and_add(&m_hole_bytes, want - pos);
+            pos = want;
+        }
+
+        x->got = pos;
+        total += pos;
+    }
+
+    // Each piece wants its bytes and maybe a CRC table, told apart by the low
+    // bit of the second member.
+    std::vector<std::pair<uint64_t, size_t> > order;
+    order.reserve(pieces.size());
+
+    for (size_t i = 0; i < pieces.size(); ++i)
+    {
+        order.push_back(std::make_pair(pieces[i].start, 2 * i));
+
+        if (pieces[i].table_end > pieces[i].table)
+        {
+            order.push_back(std::make_pair(pieces[i].table, 2 * i + 1));
+        }
+    }
+
+    std::sort(order.begin(), order.end());
+
+    // Records never span segments, so neither may a merged range.
+    std::vector<std::pair<uint64_t, uint64_t> > ranges;
+    std::vector<size_t> users;
+
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        readv_piece& p(pieces[order[i].second / 2]);
+        bool is_table = order[i].second % 2;
+        uint64_t start = is_table ? p.table : p.start;
+        uint64_t end = is_table ? p.table_end : p.end;
+
+        if (!ranges.empty() &&
+            start <= ranges.back().second + READV_MERGE_GAP &&
+            m_disk->segment_of(start) == m_disk->segment_of(ranges.back().first))
+        {
+            ranges.back().second = std::max(ranges.back().second, end);
+            ++users.back();
+        }
+        else
+        {
+            ranges.push_back(std::make_pair(start, end));
+            users.push_back(1);
+        }
+
+        (is_table ? p.table_range : p.range) = ranges.size() - 1;
+    }
+
+    std::vector<std::vector<char> > staging(ranges.size());
+    std::vector<device::io> ios;
+    ios.reserve(ranges.size());
+
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        readv_piece& p(pieces[order[i].second / 2]);
+        bool is_table = order[i].second % 2;
+        size_t r_idx = is_table ? p.table_range : p.range;
+        const std::pair<uint64_t, uint64_t>& r(ranges[r_idx]);
+
+        if (ios.size() > r_idx)
+        {
+            continue;
+        }
+
+        if (!is_table && users[r_idx] == 1 && p.in_place)
+        {
+            ios.push_back(device::io(r.first, r.second - r.first, p.out));
+        }
+        else
+        {
+            staging[r_idx].resize(r.second - r.first);
+            ios.push_back(device::io(r.first, r.second - r.first, &staging[r_idx][0]));
+        }
+    }
+
+    if (!ios.empty() && m_disk->read_batch(&ios[0], ios.size()) < 0)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < pieces.size(); ++i)
+    {
+        readv_piece& p(pieces[i]);
+        const char* src = staging[p.range].empty()
+                        ? p.out
+                        : &staging[p.range][0] + (p.start - ranges[p.range].first);
+        const char* table = p.table_end > p.table
+                          ? &staging[p.table_range][0] + (p.table - ranges[p.table_range].first)
+                          : NULL;
+
+        if (!unpack_slice(exts[p.ext].bid, p.s, p.from, p.len, src, table, p.out))
+        {
+            return -1;
+        }
+    }
+
+    return total;
+}
+
+// Append data to the log at head, compressed if that pays, and fill in where
+// it landed.  The offset and length of *s are left to the caller.
+ssize_t
+blockmap :: store(const e::slice& data, size_t head, vblock::slice* s)
+{
+    e::slice bytes(data);
+    std::vector<char> packed;
+    uint8_t codec = m_codec;
+
+    if (codec != CODEC_NONE && data.size() >= COMPRESS_MIN_SIZE)
+    {
+        uint64_t start = e::time();
+
+        if (!codec_compress(codec, reinterpret_cast<const char*>(data.data()),
+                            data.size(), &packed))
+        {
+            return -1;
+        }
+
+        __sync_fetch_and_add(&m_compress_ns, e::time() - start);
+        __sync_fetch_and_add(&m_compress_in, data.size());
+
+        if (packed.size() <= data.size() - data.size() / 8)
+        {
+            bytes = e::slice(&packed[0], packed.size());
+        }
+        else
+        {
+            codec = CODEC_NONE;
+        }
+
+        __sync_fetch_and_add(&m_compress_out, bytes.size());
+    }
+    else
+    {
+        codec = CODEC_NONE;
+    }
+
+    // Plain records are chunked, with their chunk CRCs written after the
+    // data; see vblock::slice.
+    const size_t chunk = vblock::slice::CRC_CHUNK;
+    const char* ptr = reinterpret_cast<const char*>(bytes.data());
+    std::vector<uint8_t> table;
+    uint32_t crc;
+
+    if (codec != CODEC_NONE || bytes.size() <= chunk)
+    {
+        crc = crc32c(ptr, bytes.size());
+    }
+    else
+    {
+        table.resize((bytes.size() + chunk - 1) / chunk * sizeof(uint32_t));
+
+        for (size_t i = 0; i * chunk < bytes.size(); ++i)
+        {
+            size_t n = std::min(chunk, bytes.size() - i * chunk);
+            e::pack32be(crc32c(ptr + i * chunk, n), &table[i * sizeof(uint32_t)]);
+        }
+
+        crc = crc32c(reinterpret_cast<const char*>(&table[0]), table.size());
+    }
+
+    size_t disk_offset;
+    e::slice trailer;
+
+    if (!table.empty())
+    {
+        trailer = e::slice(&table[0], table.size());
+    }
+
+    if (m_disk->write(bytes, disk_offset, head, trailer) < 0)
+    {
+        return -1;
+    }
+
+    s->set_disk_offset(disk_offset);
+    s->set_device(m_disk->volume_of(disk_offset));
+    s->set_compression(codec, codec == CODEC_NONE
+                              ? vblock::slice::chunked_length(bytes.size())
+                              : bytes.size(), 0);
+    s->set_crc(crc);
+    return data.size();
+}
+
+// Store data like store() does, unless dedup is on and an identical record is
+// already in the log, in which case *s is pointed at that record instead.  A
+// match is only trusted after comparing its bytes with data.  On a match the
+// record's segment is left pinned and *pinned is set; the caller unpins it
+// once the offset map referencing the record has been committed, after which
+// the cleaner will find it.
+ssize_t
+blockmap :: place(const e::slice& data, size_t head, vblock::slice* s, bool* pinned)
+{
+    *pinned = false;
+
+    if (!m_dedup || data.size() < DEDUP_MIN_SIZE)
+    {
+        return store(data, head, s);
+    }
+
+    std::string key(fingerprint_key(data));
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = true;
+    ropts.verify_checksums = true;
+    std::string value;
+    vblock found;
+    bool have = false;
+
+    if (m_db->Get(ropts, key, &value).ok())
+    {
+        e::unpacker up(value.data(), value.size());
+        up = up >> found;
+        have = !up.error() && found.size() == 1;
+
+        if (!have)
+        {
+            LOG(WARNING) << "fingerprint index entry is corrupt; rewriting it";
+        }
+    }
+
+    if (have &&
+        found.slices()[0].length() == data.size() &&
+        m_disk->pin(found.slices()[0].disk_offset()))
+    {
+        const vblock::slice& r(found.slices()[0]);
+
+        if (same_record(r, data))
+        {
+            size_t offset = s->offset();
+            *s = r;
+            s->set_offset(offset);
+            *pinned = true;
+            __sync_fetch_and_add(&m_dedup_hits, 1);
+            __sync_fetch_and_add(&m_dedup_bytes, data.size());
+            return data.size();
+        }
+
+        m_disk->unpin(r.disk_offset());
+    }
+
+    ssize_t status = store(data, head, s);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    // A failed insert only costs a future match.
+    vblock entry;
+    vblock::slice whole(*s);
+    whole.set_offset(0);
+    entry.update(whole);
+    std::auto_ptr<e::buffer> buf(e::buffer::create(entry.pack_size()));
+    buf->pack_at(0) << entry;
+    leveldb::WriteBatch updates;
+    updates.Put(key, leveldb::Slice((const char*)buf->data(), buf->size()));
+    batch_references(entry, key, &updates);
+    leveldb::WriteOptions opts;
+    opts.sync = false;
+    m_db->Write(opts, &updates);
+    return status;
+}
+
+// True if the whole record r holds exactly data.
+bool
+blockmap :: same_record(const vblock::slice& r, const e::slice& data)
+{
+    std::vector<char> record(r.disk_length());
+
+    if (m_disk->read(r.disk_offset(), record.size(), &record[0]) < 0 ||
+        !check_record(r, &record[0]))
+    {
+        return false;
+    }
+
+    std::vector<char> plain;
+
+    if (r.compressed())
+    {
+        if (!codec_uncompress(r.codec(), &record[0], record.size(), &plain))
+        {
+            return false;
+        }
+
+        record.swap(plain);
+    }
+    else if (r.chunked())
+    {
+        record.resize(r.record_length());
+    }
+
+    return record.size() == data.size() &&
+           memcmp(&record[0], data.data(), data.size()) == 0;
+}
+
+std::string
+blockmap :: fingerprint_key(const e::slice& data)
+{
+    uint64_t h[2];
+    murmur3_128(reinterpret_cast<const char*>(data.data()), data.size(),
+                FINGERPRINT_SEED, &h[0], &h[1]);
+    std::string key(1, static_cast<char>(FINGERPRINT));
+    uint8_t buf[sizeof(h)];
+    e::pack64be(h[0], buf);
+    e::pack64be(h[1], buf + sizeof(uint64_t));
+    key.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+    return key;
+}
+
+// Read len bytes starting from bytes into slice s of bid.  Chunked slices
+// fetch only the CRC chunks the read touches.  Otherwise the CRC of a slice
+// covers its whole record on disk, so partial reads of a checksummed slice and
+// every read of a compressed one fetch the whole record.
+ssize_t
+blockmap :: read_slice(uint64_t bid, const vblock::slice& s,
+                       size_t from, size_t len, char* out)
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t table;
+    uint64_t table_end;
+    bool in_place = slice_span(s, from, len, &start, &end, &table, &table_end);
+    std::vector<char> buf(in_place ? 0 : end - start);
+    std::vector<char> tbuf(table_end - table);
+    char* data = in_place ? out : &buf[0];
+    device::io ios[2] = {device::io(start, end - start, data),
+                         device::io(table, tbuf.size(), tbuf.empty() ? NULL : &tbuf[0])};
+
+    if (m_disk->read_batch(ios, tbuf.empty() ? 1 : 2) < 0 ||
+        !unpack_slice(bid, s, from, len, data, tbuf.empty() ? NULL : &tbuf[0], out))
+    {
+        return -1;
+    }
+
+    return len;
+}
+
+// Check and copy out len bytes starting from bytes into slice s, given data,
+// the bytes that slice_span named, and the CRC table if it named one.
+bool
+blockmap :: unpack_slice(uint64_t bid, const vblock::slice& s,
+                         size_t from, size_t len, const char* data,
+                         const char* table, char* out)
+{
+    if (s.chunked())
+    {
+        const size_t chunk = vblock::slice::CRC_CHUNK;
+        size_t at = s.skip() + from;
+        size_t lo = at / chunk * chunk;
+        size_t hi = std::min(s.record_length(), (at + len + chunk - 1) / chunk * chunk);
+
+        if (!verify_chunks(bid, s, lo, hi - lo, data, table))
+        {
+            return false;
+        }
+
+        if (data + (at - lo) != out)
+        {
+            memmove(out, data + (at - lo), len);
+        }
+
+        return true;
+    }
+
+    if (reads_in_place(s, from, len))
+    {
+        if (data != out)
+        {
+            memmove(out, data, len);
+        }
+
+        return verify(bid, s, out);
+    }
+
+    return unpack_record(bid, s, data, from, len, out);
+}
+
+// Check the whole on-disk record of s and copy out len bytes starting from
+// bytes into the slice, uncompressing if need be.
+bool
+blockmap :: unpack_record(uint64_t bid, const vblock::slice& s,
+                          const char* record, size_t from, size_t len,
+                          char* out)
+{
+    if (!verify(bid, s, record))
+    {
+        return false;
+    }
+
+    if (!s.compressed())
+    {
+        memmove(out, record + s.skip() + from, len);
+        return true;
+    }
+
+    std::vector<char> plain;
+    uint64_t start = e::time();
+
+    if (!codec_uncompress(s.codec(), record, s.disk_length(), &plain))
+    {
+        LOG(ERROR) << "could not uncompress bid " << bid << " at " << s;
+        return false;
+    }
+
+    __sync_fetch_and_add(&m_uncompress_ns, e::time() - start);
+    __sync_fetch_and_add(&m_uncompress_bytes, plain.size());
+
+    if (s.skip() + from + len > plain.size())
+    {
+        LOG(ERROR) << "short compressed record in bid " << bid << " at " << s;
+        return false;
+    }
+
+    memmove(out, &plain[0] + s.skip() + from, len);
+    return true;
+}
+
+// The range of the log holding the records of bid's slices.
+ssize_t
+blockmap :: disk_span(uint64_t bid, uint64_t* start, uint64_t* end)
+{
+    e::intrusive_ptr<vblock_record> rec;
+
+    if (lookup_offset_map(bid, &rec) < 0 || rec->view().size() == 0)
+    {
+        return -1;
+    }
+
+    const vblock_view& vv(rec->view());
+    bool found = false;
+
+    for (size_t i = 0; i < vv.size(); ++i)
+    {
+        const vblock::slice s(vv.slice_at(i));
+
+        // The empty slice that ends a padded block is nowhere on disk.
+        if (s.disk_length() == 0)
+        {
+            continue;
+        }
+
+        *start = found ? std::min<uint64_t>(*start, s.disk_offset()) : s.disk_offset();
+        *end = found ? std::max<uint64_t>(*end, s.disk_offset() + s.disk_length())
+                     : s.disk_offset() + s.disk_length();
+        found = true;
+    }
+
+    return found ? 0 : -1;
+}
+
+void
+blockmap :: prefetch(uint64_t offset, size_t len)
+{
+    m_disk->prefetch(offset, len);
+    __sync_fetch_and_add(&m_prefetched, len);
+}
+
+ssize_t
+blockmap :: length(uint64_t bid)
+{
+    e::intrusive_ptr<vblock_record> rec;
+
+    if (lookup_offset_map(bid, &rec) < 0)
+    {
+        return -1;
+    }
+
+    return rec->view().length();
+}
+
+ssize_t
+blockmap :: truncate(uint64_t& bid,
+                     size_t len,
+                     const origin* o)
+{
+    vblock vb;
+    if (read_offset_map(bid, vb) < 0)
+    {
+        TRACE;
+        return -1;
+    }
+
+    uint64_t parent = bid;
+
+    if (!next_bid(shard_of(parent), &bid))
+    {
+        TRACE;
+        return -1;
+    }
+
+    TRACE;
+    vb.set_len(len);
+    vb.pad(len);
+
+    if (write_offset_map(bid, vb, parent, o) < 0)
+    {
+        TRACE;
+        return -1;
+    }
+    else
+    {
+        return len;
+    }
+}
+
+// Mark bid as no longer referenced by any file.  The offset map itself is
+// deleted later by sweep().
+ssize_t
+blockmap :: release(uint64_t bid)
+{
+    std::string rk(lifecycle_key(RELEASED, bid));
+    leveldb::WriteOptions opts;
+    opts.sync = false;
+    leveldb::Status st = m_db->Put(opts, rk, leveldb::Slice());
+
+    if (!st.ok())
+    {
+        LOG(ERROR) << "could not release bid " << bid << ": " << st.ToString();
+        return -1;
+    }
+
+    __sync_fetch_and_add(&m_released, 1);
+    return 0;
+}
+
+// Delete the offset maps of released bids, along with their lifecycle
+// records, one batch at a time.  Returns the number of bids swept.
+ssize_t
+blockmap :: sweep()
+{
+    std::vector<uint64_t> dead;
+
+    {
+        leveldb::ReadOptions ropts;
+        ropts.fill_cache = false;
+        ropts.verify_checksums = true;
+        std::auto_ptr<leveldb::Iterator> it(m_db->NewIterator(ropts));
+        std::string start(1, static_cast<char>(RELEASED));
+
+        for (it->Seek(start); it->Valid() && dead.size() < SWEEP_BATCH; it->Next())
+        {
+            leveldb::Slice k(it->key());
+
+            if (k.empty() || k[0] != RELEASED)
+            {
+                break;
+            }
+
+            // Plain bids whose first byte happens to match sort here too.
+            if (k.size() != sizeof(uint64_t) + 1)
+            {
+                continue;
+            }
+
+            uint64_t bid;
+            memmove(&bid, k.data() + 1, sizeof(bid));
+            dead.push_back(bid);
+        }
+    }
+
+    if (dead.empty())
+    {
+        return 0;
+    }
+
+    // The maps are read without the lock so that writers are not held up
+    // behind LevelDB.  Only the cleaner and defrag rewrite a map in place; if
+    // either did so meanwhile, the freed ranges are read again under the lock.
+    uint64_t rewrites;
+
+    {
+        po6::threads::mutex::hold hold(&m_mtx);
+        rewrites = m_rewrites;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t> > freed;
+    freed_ranges(dead, &freed);
+    leveldb::WriteBatch updates;
+
+    for (size_t i = 0; i < dead.size(); ++i)
+    {
+        std::string tag;
+        std::string peers;
+        uint64_t tagged;
+
+        if (get_origin(dead[i], &tag, &peers) >= 0 &&
+            find_origin(e::slice(tag.data(), tag.size()), &tagged) >= 0 &&
+            tagged == dead[i])
+        {
+            updates.Delete(tag_key(e::slice(tag.data(), tag.size())));
+        }
+
+        updates.Delete(leveldb::Slice((char*)&dead[i], sizeof(uint64_t)));
+        updates.Delete(lifecycle_key(RELEASED, dead[i]));
+        updates.Delete(lifecycle_key(SUPERSEDED, dead[i]));
+        updates.Delete(lifecycle_key(ORIGIN, dead[i]));
+        updates.Delete(lifecycle_key(QUARANTINED, dead[i]));
+    }
+
+    po6::threads::mutex::hold hold(&m_mtx);
+
+    if (m_rewrites != rewrites)
+    {
+        freed.clear();
+        freed_ranges(dead, &freed);
+    }
+
+    leveldb::WriteOptions opts;
+    opts.sync = false;
+    leveldb::Status st = m_db->Write(opts, &updates);
+
+    if (!st.ok())
+    {
+        LOG(ERROR) << "could not sweep released bids: " << st.ToString();
+        return -1;
+    }
+
+    for (size_t i = 0; i < dead.size(); ++i)
+    {
+        m_cache.invalidate(dead[i]);
+    }
+
+    for (size_t i = 0; i < freed.size(); ++i)
+    {
+        m_disk->remove_live(freed[i].first, freed[i].second);
+    }
+
+    __sync_fetch_and_add(&m_swept, dead.size());
+    return dead.size();
+}
+
+void
+blockmap :: queue_defrag(uint64_t bid)
+{
+    po6::threads::mutex::hold hold(&m_defrag_mtx);
+
+    if (m_defrag.size() < DEFRAG_QUEUE_MAX)
+    {
+        m_defrag.insert(bid);
+    }
+}
+
+bool
+blockmap :: superseded(uint64_t bid)
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = true;
+    ropts.verify_checksums = true;
+    std::string sk(lifecycle_key(SUPERSEDED, bid));
+    std::string child;
+    return m_db->Get(ropts, sk, &child).ok();
+}
+
+// Rewrite the live bytes of fragmented blocks with one append each, and remap
+// the same bid onto the copy.  Adjacent slices collapse into one, so a block
+// with no holes ends up as a single slice.  Blocks that have already been
+// superseded are skipped; the newer version gets queued on its own.
+ssize_t
+blockmap :: defrag()
+{
+    std::vector<uint64_t> bids;
+
+    {
+        po6::threads::mutex::hold hold(&m_defrag_mtx);
+
+        while (!m_defrag.empty() && bids.size() < DEFRAG_PER_PASS)
+        {
+            bids.push_back(*m_defrag.begin());
+            m_defrag.erase(m_defrag.begin());
+        }
+    }
+
+    ssize_t rewritten = 0;
+
+    for (size_t i = 0; i < bids.size(); ++i)
+    {
+        vblock vb;
+
+        if (superseded(bids[i]) ||
+            read_offset_map(bids[i], vb) < 0 ||
+            vb.size() < DEFRAG_MIN_SLICES)
+        {
+            continue;
+        }
+
+        const vblock::slice_list& slices(vb.slices());
+        size_t total = 0;
+
+        for (size_t j = 0; j < slices.size(); ++j)
+        {
+            total += slices[j].length();
+        }
+
+        std::vector<char> buf(total);
+        size_t pos = 0;
+
+        // read_slice checks CRCs, so a corrupt slice is never laundered
+        // into a fresh checksum.
+        for (size_t j = 0; j < slices.size(); ++j)
+        {
+            if (slices[j].length() > 0 &&
+                read_slice(bids[i], slices[j], 0, slices[j].length(), &buf[pos]) < 0)
+            {
+                break;
+            }
+
+            pos += slices[j].length();
+        }
+
+        vblock::slice whole(0, total, 0, 0);
+
+        if (pos != total ||
+            store(e::slice(&buf[0], buf.size()), background_head(), &whole) < 0)
+        {
+            LOG(ERROR) << "defragmenter could not rewrite bid " << bids[i];
+            continue;
+        }
+
+        // Each run of adjacent slices becomes one slice cut from the record
+        // just written, and keeps the record's CRCs.
+        vblock packed;
+        vblock::slice_list& out(packed.slices());
+        size_t run = 0;
+        pos = 0;
+
+        for (size_t j = 0; j < slices.size(); ++j)
+        {
+            pos += slices[j].length();
+
+            if (pos == run)
+            {
+                // The empty slice that ends a padded block stays empty.
+                out.push_back(vblock::slice(slices[j].offset(), 0, 0, 0));
+            }
+            else if (j + 1 == slices.size() || slices[j].end() != slices[j + 1].offset())
+            {
+                vblock::slice s(whole.cut(run, pos - run));
+                s.set_offset(slices[j].end() - (pos - run));
+                out.push_back(s);
+                run = pos;
+            }
+        }
+
+        if (replace_offset_map(bids[i], vb, packed) == 0)
+        {
+            ++rewritten;
+        }
+    }
+
+    __sync_fetch_and_add(&m_defragged, rewritten);
+    return rewritten;
+}
+
+// Swap the map of bid for vb, as long as it still matches expected.  If the
+// cleaner or anybody else got there first, the copy is simply left for the
+// cleaner to reclaim.
+ssize_t
+blockmap :: replace_offset_map(uint64_t bid, const vblock& expected, vblock& vb)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    vblock current;
+
+    if (read_offset_map(bid, current) < 0 ||
+        current.slices() != expected.slices())
+    {
+        return -1;
+    }
+
+    {
+        shard* sh = shard_of(bid);
+        po6::threads::mutex::hold hold_shard(&sh->mtx);
+
+        if (sh->tracking && touches_cleaning(vb))
+        {
+            sh->dirty.push_back(bid);
+        }
+    }
+
+    leveldb::WriteBatch updates;
+
+    if (put_offset_map(bid, vb, &updates) < 0)
+    {
+        return -1;
+    }
+
+    ++m_rewrites;
+    account(current, false);
+    account(vb, true);
+    m_cache.invalidate(bid);
+    return 0;
+}
+
+// True unless s carries a CRC that data, the slice's bytes on disk, does not
+// match.  A mismatch makes bid a suspect.
+bool
+blockmap :: verify(uint64_t bid, const vblock::slice& s, const char* data)
+{
+    if (check_record(s, data))
+    {
+        return true;
+    }
+
+    LOG(ERROR) << "checksum mismatch in bid " << bid << " at " << s;
+    suspect(bid);
+    return false;
+}
+
+// Like verify, for len bytes of the record of chunked slice s starting at
+// at, which must both fall on chunk boundaries or the end of the record.
+bool
+blockmap :: verify_chunks(uint64_t bid, const vblock::slice& s,
+                          size_t at, size_t len, const char* data,
+                          const char* table)
+{
+    if (check_chunks(s, at, len, data, table))
+    {
+        return true;
+    }
+
+    LOG(ERROR) << "checksum mismatch in bid " << bid << " at " << s
+               << " in bytes [" << at << ", " << at + len << ") of its record";
+    suspect(bid);
+    return false;
+}
+
+// Read back every checksummed slice of vb and check it, adding the bytes read
+// to *bytes.
+bool
+blockmap :: verify_slices(const vblock& vb, uint64_t* bytes)
+{
+    const vblock::slice_list& slices(vb.slices());
+    std::vector<char> buf;
+
+    for (size_t i = 0; i < slices.size(); ++i)
+    {
+        if (!slices[i].checksummed())
+        {
+            continue;
+        }
+
+        buf.resize(slices[i].disk_length());
+
+        if (m_disk->read(slices[i].disk_offset(), buf.size(), &buf[0]) < 0 ||
+            !check_record(slices[i], &buf[0]))
+        {
+            return false;
+        }
+
+        *bytes += buf.size();
+    }
+
+    return true;
+}
+
+// A mismatch seen through a map that has since been replaced, or after the
+// cleaner moved the bytes, is not corruption.  Check the current map of bid
+// once more and quarantine it if it really is bad.  Quarantined bids stay
+// unreadable until repair() gives them good bytes.
+bool
+blockmap :: suspect(uint64_t bid)
+{
+    vblock vb;
+    uint64_t bytes = 0;
+
+    if (read_offset_map(bid, vb) < 0 || verify_slices(vb, &bytes))
+    {
+        return false;
+    }
+
+    leveldb::WriteOptions opts;
+    opts.sync = false;
+    leveldb::Status st = m_db->Put(opts, lifecycle_key(QUARANTINED, bid), leveldb::Slice());
+
+    if (!st.ok())
+    {
+        LOG(ERROR) << "could not quarantine bid " << bid << ": " << st.ToString();
+    }
+
+    LOG(ERROR) << "bid " << bid << " is corrupt; quarantined until it is repaired";
+    __sync_fetch_and_add(&m_corrupt, 1);
+    return true;
+}
+
+// Check the CRCs of about budget bytes of slices, starting after the map the
+// last call stopped at and wrapping around after the last map.  Only called
+// from the background thread, which owns the cursor.  Returns the number of
+// bids quarantined.
+ssize_t
+blockmap :: scrub(size_t budget)
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+    ropts.verify_checksums = true;
+    std::auto_ptr<leveldb::Iterator> it(m_db->NewIterator(ropts));
+    uint64_t bytes = 0;
+    ssize_t corrupt = 0;
+    it->Seek(m_scrub_cursor);
+
+    if (it->Valid() && it->key() == leveldb::Slice(m_scrub_cursor))
+    {
+        it->Next();
+    }
+
+    for (; it->Valid() && bytes < budget; it->Next())
+    {
+        if (it->key().size() != sizeof(uint64_t))
+        {
+            continue;
+        }
+
+        uint64_t bid;
+        memmove(&bid, it->key().data(), sizeof(bid));
+        m_scrub_cursor.assign(it->key().data(), it->key().size());
+        vblock vb;
+        e::unpacker up(it->value().data(), it->value().size());
+        up = up >> vb;
+
+        if (!up.error() && !verify_slices(vb, &bytes) && suspect(bid))
+        {
+            ++corrupt;
+        }
+    }
+
+    if (!it->Valid())
+    {
+        m_scrub_cursor.clear();
+    }
+
+    __sync_fetch_and_add(&m_scrubbed, bytes);
+    return corrupt;
+}
+
+ssize_t
+blockmap :: quarantined(std::vector<uint64_t>* bids, size_t max)
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+    ropts.verify_checksums = true;
+    std::auto_ptr<leveldb::Iterator> it(m_db->NewIterator(ropts));
+    std::string start(1, static_cast<char>(QUARANTINED));
+    bids->clear();
+
+    for (it->Seek(start); it->Valid() && bids->size() < max; it->Next())
+    {
+        leveldb::Slice k(it->key());
+
+        if (k.empty() || k[0] != QUARANTINED)
+        {
+            break;
+        }
+
+        if (k.size() != sizeof(uint64_t) + 1)
+        {
+            continue;
+        }
+
+        uint64_t bid;
+        memmove(&bid, k.data() + 1, sizeof(bid));
+        bids->push_back(bid);
+    }
+
+    return bids->size();
+}
+
+// Replace the contents of a quarantined bid with data, a good copy of the
+// whole block from another replica, and lift the quarantine.
+ssize_t
+blockmap :: repair(uint64_t bid, const e::slice& data)
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = true;
+    ropts.verify_checksums = true;
+    std::string ignored;
+    vblock current;
+
+    // Another replica's copy may already have fixed it.
+    if (!m_db->Get(ropts, lifecycle_key(QUARANTINED, bid), &ignored).ok())
+    {
+        return 0;
+    }
+
+    if (read_offset_map(bid, current) < 0)
+    {
+        return -1;
+    }
+
+    if (data.size() != current.length())
+    {
+        LOG(ERROR) << "repair of bid " << bid << " brought " << data.size()
+                   << " bytes for a " << current.length() << " byte block";
+        return -1;
+    }
+
+    vblock fixed;
+    vblock::slice s(0, data.size(), 0, 0);
+
+    if (store(data, shard_of(bid)->id, &s) < 0)
+    {
+        return -1;
+    }
+
+    fixed.update(s);
+
+    if (replace_offset_map(bid, current, fixed) < 0)
+    {
+        return -1;
+    }
+
+    leveldb::WriteOptions opts;
+    opts.sync = false;
+    m_db->Delete(opts, lifecycle_key(QUARANTINED, bid));
+    __sync_fetch_and_add(&m_repaired, 1);
+    LOG(INFO) << "repaired bid " << bid;
+    return data.size();
+}
+
+// Remember what wrote bid: tag identifies the request on every replica that
+// applied it, and peers is whatever the caller needs to find those replicas.
+// Both are opaque here.  Writes pass the origin along so that it commits with
+// the offset map; this is for bids whose origin is learned later.  The record
+// is best effort, like release().
+ssize_t
+blockmap :: set_origin(uint64_t bid, const e::slice& tag, const e::slice& peers)
+{
+    leveldb::WriteBatch updates;
+    batch_origin(bid, tag, peers, &updates);
+    leveldb::WriteOptions opts;
+    opts.sync = false;
+    leveldb::Status st = m_db->Write(opts, &updates);
+
+    if (!st.ok())
+    {
+        LOG(ERROR) << "could not record the origin of bid " << bid << ": " << st.ToString();
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+blockmap :: batch_origin(uint64_t bid, const e::slice& tag,
+                         const e::slice& peers, leveldb::WriteBatch* updates)
+{
+    std::auto_ptr<e::buffer> buf(e::buffer::create(2 * sizeof(uint32_t) +
+                                                   tag.size() + peers.size()));
+    buf->pack_at(0) << tag << peers;
+    updates->Put(lifecycle_key(ORIGIN, bid),
+                 leveldb::Slice(reinterpret_cast<const char*>(buf->data()), buf->size()));
+    updates->Put(tag_key(tag), leveldb::Slice((const char*)&bid, sizeof(bid)));
+}
+
+ssize_t
+blockmap :: get_origin(uint64_t bid, std::string* tag, std::string* peers)
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = true;
+    ropts.verify_checksums = true;
+    std::string value;
+
+    if (!m_db->Get(ropts, lifecycle_key(ORIGIN, bid), &value).ok())
+    {
+        return -1;
+    }
+
+    e::slice t;
+    e::slice p;
+    e::unpacker up(value.data(), value.size());
+    up = up >> t >> p;
+
+    if (up.error())
+    {
+        return -1;
+    }
+
+    tag->assign(reinterpret_cast<const char*>(t.data()), t.size());
+    peers->assign(reinterpret_cast<const char*>(p.data()), p.size());
+    return 0;
+}
+
+ssize_t
+blockmap :: find_origin(const e::slice& tag, uint64_t* bid)
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = true;
+    ropts.verify_checksums = true;
+    std::string value;
+
+    if (!m_db->Get(ropts, tag_key(tag), &value).ok() ||
+        value.size() != sizeof(uint64_t))
+    {
+        return -1;
+    }
+
+    memmove(bid, value.data(), sizeof(uint64_t));
+    return 0;
+}
+
+void
+blockmap :: set_sync(bool sync)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    m_sync = sync;
+}
+
+void
+blockmap :: set_dedup(bool dedup)
+{
+    m_dedup = dedup;
+}
+
+bool
+blockmap :: set_codec(const std::string& name)
+{
+    uint8_t codec;
+
+    if (!codec_by_name(name, &codec))
+    {
+        LOG(ERROR) << "compression \"" << name << "\" is not supported by this build";
+        return false;
+    }
+
+    m_codec = codec;
+    return true;
+}
+
+std::string
+blockmap :: lifecycle_key(lifecycle_prefix prefix, uint64_t bid)
+{
+    std::string key(1, static_cast<char>(prefix));
+    key.append((const char*)&bid, sizeof(bid));
+    return key;
+}
+
+std::string
+blockmap :: tag_key(const e::slice& tag)
+{
+    std::string key(1, static_cast<char>(TAGGED));
+    key.append(reinterpret_cast<const char*>(tag.data()), tag.size());
+    return key;
+}
+
+void
+blockmap :: stat()
+{
+    if (m_disk)
+    {
+        m_disk->stat();
+    }
+
+    m_cache.stat();
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        shard* sh = m_shards[i].get();
+        po6::threads::mutex::hold hold(&sh->mtx);
+        LOG(INFO) << "blockmap: shard=" << i
+                  << " next_seq=" << sh->next_seq
+                  << " commit groups=" << sh->groups
+                  << " maps=" << sh->grouped;
+    }
+    LOG(INFO) << "blockmap: released=" << __sync_fetch_and_add(&m_released, 0)
+              << " swept=" << __sync_fetch_and_add(&m_swept, 0)
+              << " defragmented=" << __sync_fetch_and_add(&m_defragged, 0)
+              << " scrubbed_bytes=" << __sync_fetch_and_add(&m_scrubbed, 0)
+              << " corrupt=" << __sync_fetch_and_add(&m_corrupt, 0)
+              << " repaired=" << __sync_fetch_and_add(&m_repaired, 0);
+
+    uint64_t in = __sync_fetch_and_add(&m_compress_in, 0);
+    uint64_t out = __sync_fetch_and_add(&m_compress_out, 0);
+    uint64_t cns = __sync_fetch_and_add(&m_compress_ns, 0);
+    uint64_t ub = __sync_fetch_and_add(&m_uncompress_bytes, 0);
+    uint64_t uns = __sync_fetch_and_add(&m_uncompress_ns, 0);
+    LOG(INFO) << "blockmap: codec=" << codec_name(m_codec)
+              << " compressed_in=" << in
+              << " compressed_out=" << out
+              << " ratio=" << (out ? double(in) / out : 0.0)
+              << " compress_MBps=" << (cns ? in * 1000 / cns : 0)
+              << " uncompress_MBps=" << (uns ? ub * 1000 / uns : 0);
+    LOG(INFO) << "blockmap: dedup=" << (m_dedup ? "on" : "off")
+              << " dedup_hits=" << __sync_fetch_and_add(&m_dedup_hits, 0)
+              << " dedup_saved_bytes=" << __sync_fetch_and_add(&m_dedup_bytes, 0);
+    LOG(INFO) << "blockmap: hole_bytes_read=" << __sync_fetch_and_add(&m_hole_bytes, 0)
+              << " prefetched_bytes=" << __sync_fetch_and_add(&m_prefetched, 0)
+              << " flushes=" << __sync_fetch_and_add(&m_flushes, 0);
+}
+
+// Offset maps are the only record of which bytes in the log are still
+// referenced, so each map contributes its slices to the live byte count of
+// the segments they land in.  A range shared by several bids is counted once
+// per bid.
+void
+blockmap :: account(vblock& vb, bool add)
+{
+    const vblock::slice_list& slices(vb.slices());
+
+    for (vblock::slice_list::const_iterator it = slices.begin();
+            it != slices.end(); ++it)
+    {
+        if (add)
+        {
+            m_disk->add_live(it->disk_offset(), it->disk_length());
+        }
+        else
+        {
+            m_disk->remove_live(it->disk_offset(), it->disk_length());
+        }
+    }
+}
+
+bool
+blockmap :: touches_cleaning(vblock& vb)
+{
+    const vblock::slice_list& slices(vb.slices());
+
+    for (vblock::slice_list::const_iterator it = slices.begin();
+            it != slices.end(); ++it)
+    {
+        if (m_disk->is_cleaning(it->disk_offset()))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+blockmap :: relocate(const relocation_map& rm, vblock::slice* s)
+{
+    relocation_map::const_iterator it = rm.upper_bound(s->disk_offset());
+
+    if (it == rm.begin())
+    {
+        return false;
+    }
+
+    --it;
+
+    if (s->disk_offset() + s->disk_length() > it->second.end)
+    {
+        return false;
+    }
+
+    s->set_disk_offset(it->second.to + (s->disk_offset() - it->first));
+    s->set_device(m_disk->volume_of(s->disk_offset()));
+    return true;
+}
+
+// Must be called with m_mtx or a shard's lock held.
+bool
+blockmap :: relocate(vblock& vb)
+{
+    if (m_relocations.empty() && m_prev_relocations.empty())
+    {
+        return false;
+    }
+
+    bool changed = false;
+    vblock::slice_list& slices(vb.slices());
+
+    for (vblock::slice_list::iterator it = slices.begin();
+            it != slices.end(); ++it)
+    {
+        if (!m_disk->is_cleaning(it->disk_offset()))
+        {
+            continue;
+        }
+
+        if (relocate(m_relocations, &*it) ||
+            relocate(m_prev_relocations, &*it))
+        {
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// Turn the cleaner's tracking off in every shard, collecting the bids tracked
+// so far into bids if it is not NULL.  Must be called with every shard's lock
+// held.
+void
+blockmap :: stop_tracking(std::vector<uint64_t>* bids)
+{
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        shard* sh = m_shards[i].get();
+
+        if (bids)
+        {
+            bids->insert(bids->end(), sh->dirty.begin(), sh->dirty.end());
+        }
+
+        sh->tracking = false;
+        sh->dirty.clear();
+    }
+}
+
+// Rewrite the offset map of bid so that it points at the relocated copies of
+// its slices.  The contents of the block are unchanged, so the bid stays the
+// same.
+ssize_t
+blockmap :: remap(uint64_t bid)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    vblock vb;
+
+    if (read_offset_map(bid, vb) < 0)
+    {
+        // The map is gone; nothing references the old copy anymore.
+        return 0;
+    }
+
+    account(vb, false);
+    relocate(vb);
+    account(vb, true);
+    leveldb::WriteBatch updates;
+    ssize_t ret = put_offset_map(bid, vb, &updates);
+    ++m_rewrites;
+    m_cache.invalidate(bid);
+    return ret;
+}
+
+// Collect the disk ranges that the offset maps of bids hold.
+void
+blockmap :: freed_ranges(const std::vector<uint64_t>& bids,
+                         std::vector<std::pair<uint64_t, uint64_t> >* freed)
+{
+    for (size_t i = 0; i < bids.size(); ++i)
+    {
+        vblock vb;
+
+        if (read_offset_map(bids[i], vb) < 0)
+        {
+            continue;
+        }
+
+        const vblock::slice_list& slices(vb.slices());
+
+        for (vblock::slice_list::const_iterator it = slices.begin();
+                it != slices.end(); ++it)
+        {
+            freed->push_back(std::make_pair(it->disk_offset(),
+                                            it->disk_length()));
+        }
+    }
+}
+
+// The segment goes in big-endian so that the entries of one segment sort
+// together.
+std::string
+blockmap :: segment_key(size_t segment, const leveldb::Slice& ref)
+{
+    uint8_t buf[sizeof(uint64_t)];
+    e::pack64be(segment, buf);
+    std::string key(1, static_cast<char>(SEGMENT));
+    key.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+    key.append(ref.data(), ref.size());
+    return key;
+}
+
+// Index ref, the key of an offset map or fingerprint entry holding vb, under
+// every segment that vb points into.
+void
+blockmap :: batch_references(const vblock& vb, const leveldb::Slice& ref,
+                             leveldb::WriteBatch* updates)
+{
+    const vblock::slice_list& slices(vb.slices());
+    std::vector<size_t> segments;
+
+    for (vblock::slice_list::const_iterator it = slices.begin();
+            it != slices.end(); ++it)
+    {
+        if (it->disk_length() == 0)
+        {
+            continue;
+        }
+
+        size_t segment = m_disk->segment_of(it->disk_offset());
+
+        if (std::find(segments.begin(), segments.end(), segment) == segments.end())
+        {
+            segments.push_back(segment);
+            updates->Put(segment_key(segment, ref), leveldb::Slice());
+        }
+    }
+}
+
+// Build the segment index from every offset map and fingerprint entry.
+bool
+blockmap :: build_references()
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+    ropts.verify_checksums = true;
+    std::auto_ptr<leveldb::Iterator> it(m_db->NewIterator(ropts));
+    leveldb::WriteBatch updates;
+    size_t indexed = 0;
+
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        if (it->key().size() != sizeof(uint64_t) &&
+            (it->key().size() != FINGERPRINT_KEY_SIZE ||
+             it->key()[0] != static_cast<char>(FINGERPRINT)))
+        {
+            continue;
+        }
+
+        vblock vb;
+        e::unpacker up(it->value().data(), it->value().size());
+        up = up >> vb;
+
+        if (up.error())
+        {
+            continue;
+        }
+
+        batch_references(vb, it->key(), &updates);
+
+        if (++indexed % SEGMENT_INDEX_BATCH == 0)
+        {
+            if (!m_db->Write(leveldb::WriteOptions(), &updates).ok())
+            {
+                return false;
+            }
+
+            updates.Clear();
+        }
+    }
+
+    if (!it->status().ok() ||
+        !m_db->Write(leveldb::WriteOptions(), &updates).ok())
+    {
+        return false;
+    }
+
+    LOG(INFO) << "indexed " << indexed << " offset maps and fingerprints by segment";
+    return true;
+}
+
+// The live byte counts in the checkpoint predate whatever was written or
+// released since, and a segment is only freed once its count drops to zero,
+// so they are recounted from the offset maps on every start.
+bool
+blockmap :: count_live()
+{
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+    ropts.verify_checksums = true;
+    std::auto_ptr<leveldb::Iterator> it(m_db->NewIterator(ropts));
+    size_t counted = 0;
+    m_disk->reset_live();
+
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        if (it->key().size() != sizeof(uint64_t))
+        {
+            continue;
+        }
+
+        vblock vb;
+        e::unpacker up(it->value().data(), it->value().size());
+        up = up >> vb;
+
+        if (up.error())
+        {
+            continue;
+        }
+
+        account(vb, true);
+        ++counted;
+    }
+
+    if (!it->status().ok())
+    {
+        return false;
+    }
+
+    LOG(INFO) << "counted the live bytes of " << counted << " offset maps";
+    return true;
+}
+
+// One pass of the segment cleaner.  The emptiest sealed segments are picked as
+// victims, the maps that the segment index lists under them are checked for
+// slices that land in them, the referenced ranges are copied to the head of
+// the log, and the maps are rewritten to point at the copies.  Maps written
+// while the scan is running are tracked and fixed up before the victims are
+// released.
+ssize_t
+blockmap :: clean()
+{
+    std::vector<size_t> victims;
+
+    if (m_disk->free_segments() >= CLEANER_FREE_SEGMENTS ||
+        m_disk->pick_victims(CLEANER_SEGMENTS_PER_PASS,
+                             m_disk->segment_size() * CLEANER_MAX_LIVE / 100,
+                             &victims) == 0)
+    {
+        // Let the segments from the previous pass go, if any.
+        po6::threads::mutex::hold hold(&m_mtx);
+        hold_shards();
+        m_prev_relocations.clear();
+        m_disk->finish_cleaning(victims);
+        release_shards();
+        return 0;
+    }
+
+    std::vector<bool> is_victim(m_disk->segment_count(), false);
+
+    for (size_t i = 0; i < victims.size(); ++i)
+    {
+        is_victim[victims[i]] = true;
+    }
+
+    leveldb::ReadOptions ropts;
+    ropts.fill_cache = false;
+    ropts.verify_checksums = true;
+    std::auto_ptr<leveldb::Iterator> it;
+
+    {
+        // A map that joined a group before tracking starts must be in the
+        // snapshot, or the pass would miss it.  Holding the shards keeps new
+        // maps out of the groups until tracking is on.
+        po6::threads::mutex::hold hold(&m_mtx);
+        hold_shards();
+        flush_groups();
+        ropts.snapshot = m_db->GetSnapshot();
+        it.reset(m_db->NewIterator(ropts));
+
+        for (size_t i = 0; i < m_shards.size(); ++i)
+        {
+            m_shards[i]->tracking = true;
+            m_shards[i]->dirty.clear();
+        }
+
+        release_shards();
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t> > ranges;
+    std::vector<uint64_t> bids;
+    std::vector<std::pair<std::string, vblock::slice> > fingerprints;
+    std::set<std::string> seen;
+    // Nothing points into the victims once they are cleaned, so their index
+    // entries go when the pass succeeds.
+    leveldb::WriteBatch retired;
+
+    for (size_t v = 0; v < victims.size(); ++v)
+    {
+        std::string prefix(segment_key(victims[v], leveldb::Slice()));
+
+        for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next())
+        {
+            retired.Delete(it->key());
+            std::string ref(it->key().data() + prefix.size(),
+                            it->key().size() - prefix.size());
+            std::string value;
+
+            // Swept maps and overwritten fingerprints leave stale entries.
+            if (!seen.insert(ref).second ||
+                !m_db->Get(ropts, ref, &value).ok())
+            {
+                continue;
+            }
+
+            if (ref.size() == FINGERPRINT_KEY_SIZE &&
+                ref[0] == static_cast<char>(FINGERPRINT))
+            {
+                vblock entry;
+                e::unpacker up(value.data(), value.size());
+                up = up >> entry;
+
+                if (up.error() || entry.size() != 1)
+                {
+                    // Dropped below, since no relocation covers an empty slice.
+                    fingerprints.push_back(std::make_pair(ref, vblock::slice()));
+                }
+                else if (is_victim[m_disk->segment_of(entry.slices()[0].disk_offset())])
+                {
+                    fingerprints.push_back(std::make_pair(ref, entry.slices()[0]));
+                }
+
+                continue;
+            }
+
+            if (ref.size() != sizeof(uint64_t))
+            {
+                continue;
+            }
+
+            uint64_t bid;
+            memmove(&bid, ref.data(), sizeof(bid));
+            vblock vb;
+            e::unpacker up(value.data(), value.size());
+            up = up >> vb;
+
+            if (up.error())
+            {
+                LOG(WARNING) << "cleaner could not parse offset map for bid " << bid;
+                continue;
+            }
+
+            bool found = false;
+            const vblock::slice_list& slices(vb.slices());
+
+            for (vblock::slice_list::const_iterator sit = slices.begin();
+                    sit != slices.end(); ++sit)
+            {
+                uint64_t start = sit->disk_offset();
+
+                if (sit->disk_length() > 0 && is_victim[m_disk->segment_of(start)])
+                {
+                    ranges.push_back(std::make_pair(start, start + sit->disk_length()));
+                    found = true;
+                }
+            }
+
+            if (found)
+            {
+                bids.push_back(bid);
+            }
+        }
+    }
+
+    it.reset();
+    m_db->ReleaseSnapshot(ropts.snapshot);
+
+    // Copy each distinct live range once, no matter how many maps share it.
+    std::sort(ranges.begin(), ranges.end());
+    relocation_map rm;
+    size_t copied = 0;
+    size_t i = 0;
+
+    while (i < ranges.size())
+    {
+        uint64_t start = ranges[i].first;
+        uint64_t end = ranges[i].second;
+
+        for (++i; i < ranges.size() && ranges[i].first <= end; ++i)
+        {
+            end = std::max(end, ranges[i].second);
+        }
+
+        std::vector<char> buf(end - start);
+        size_t to;
+
+        if (m_disk->read(start, buf.size(), &buf[0]) < 0 ||
+            m_disk->write(e::slice(&buf[0], buf.size()), to, background_head()) < 0)
+        {
+            LOG(ERROR) << "cleaner could not relocate " << buf.size()
+                       << " bytes; giving up on this pass";
+            po6::threads::mutex::hold hold(&m_mtx);
+            hold_shards();
+            stop_tracking(NULL);
+            m_disk->cancel_cleaning(victims);
+            release_shards();
+            return -1;
+        }
+
+        rm.insert(std::make_pair(start, relocation(end, to)));
+        copied += buf.size();
+    }
+
+    // The fingerprint index holds no references of its own.  Entries whose
+    // record some map still uses follow it; the rest are dropped.
+    leveldb::WriteBatch index_updates;
+
+    for (size_t j = 0; j < fingerprints.size(); ++j)
+    {
+        vblock::slice r(fingerprints[j].second);
+
+        if (r.length() > 0 && relocate(rm, &r))
+        {
+            vblock entry;
+            entry.update(r);
+            std::auto_ptr<e::buffer> buf(e::buffer::create(entry.pack_size()));
+            buf->pack_at(0) << entry;
+            index_updates.Put(fingerprints[j].first,
+                              leveldb::Slice((const char*)buf->data(), buf->size()));
+            batch_references(entry, fingerprints[j].first, &index_updates);
+        }
+        else
+        {
+            index_updates.Delete(fingerprints[j].first);
+        }
+    }
+
+    if (!fingerprints.empty() &&
+        !m_db->Write(leveldb::WriteOptions(), &index_updates).ok())
+    {
+        LOG(ERROR) << "cleaner could not update the fingerprint index";
+    }
+
+    {
+        po6::threads::mutex::hold hold(&m_mtx);
+        hold_shards();
+        m_relocations.swap(rm);
+        // Tracked maps may still be waiting on a group commit; remap must
+        // be able to read them.
+        flush_groups();
+        stop_tracking(&bids);
+        release_shards();
+    }
+
+    size_t failed = 0;
+
+    for (size_t j = 0; j < bids.size(); ++j)
+    {
+        if (remap(bids[j]) < 0)
+        {
+            LOG(ERROR) << "cleaner could not rewrite offset map for bid " << bids[j];
+            ++failed;
+        }
+    }
+
+    // A map that still points into a victim keeps it from being reused.  The
+    // maps already rewritten point at valid copies, so only the victims go
+    // back; the previous pass's segments stay in limbo under their own map.
+    if (failed > 0)
+    {
+        LOG(ERROR) << "cleaner could not rewrite " << failed
+                   << " offset maps; giving up on this pass";
+        po6::threads::mutex::hold hold(&m_mtx);
+        hold_shards();
+        m_relocations.clear();
+        m_disk->cancel_cleaning(victims);
+        release_shards();
+        return -1;
+    }
+
+    if (!m_db->Write(leveldb::WriteOptions(), &retired).ok())
+    {
+        LOG(WARNING) << "cleaner could not drop the index of the victims";
+    }
+
+    {
+        po6::threads::mutex::hold hold(&m_mtx);
+        hold_shards();
+        m_prev_relocations.swap(m_relocations);
+        m_relocations.clear();
+        m_disk->finish_cleaning(victims);
+        release_shards();
+    }
+
+    LOG(INFO) << "cleaned " << victims.size() << " segments; relocated "
+              << copied << " bytes for " << bids.size() << " blocks";
+    return copied;
 }
@@ -14,6 +14,8 @@
 // po6
 #include <po6/pathname.h>
 #include <po6/io/fd.h>
+#include <po6/threads/cond.h>
+#include <po6/threads/mutex.h>
 
 //e
 #include <e/slice.h>
@@ -23,13 +25,20 @@
 #include <hyperleveldb/db.h>
 
 #include <tr1/memory>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "blockstore/device.h"
 #include "blockstore/disk.h"
 
 #include "blockstore/vblock.h"
+#include "blockstore/vblock_cache.h"
 
 #ifndef wtf_blockmap_h_
 #define wtf_blockmap_h_
@@ -42,32 +51,245 @@ namespace wtf __attribute__ ((visibility("default")))
             blockmap();
             ~blockmap();
             bool setup(const po6::pathname& path,
-                  const po6::pathname& backing_path);
+                  const std::vector<po6::pathname>& backing_paths,
+                  size_t shards,
+                  const std::string& backend,
+                  bool preallocate);
 
+            // What wrote a block; see set_origin().  Passed to write, update
+            // and truncate, it is committed with the block's offset map.
+            struct origin
+            {
+                origin() : tag(), peers() {}
+                std::string tag;
+                std::string peers;
+            };
             ssize_t write(const e::slice& data,
-                        uint64_t& bid);
+                        uint64_t& bid,
+                        const origin* o = NULL);
             ssize_t update(const e::slice& data,
                         uint64_t offset,
                         uint64_t& bid,
-                        uint64_t& block_len);
+                        uint64_t& block_len,
+                        const origin* o = NULL);
             ssize_t read(uint64_t bid,
                         uint8_t* data, 
                         size_t data_offset,
                         size_t data_sz);
+            struct extent
+            {
+                extent() : bid(0), offset(0), len(0), data(NULL), got(0) {}
+                extent(uint64_t b, size_t o, size_t l, uint8_t* d)
+                    : bid(b), offset(o), len(l), data(d), got(0) {}
+                uint64_t bid;
+                size_t offset;
+                size_t len;
+                uint8_t* data;
+                size_t got;
+            };
+            ssize_t readv(extent* exts, size_t exts_sz);
+            ssize_t disk_span(uint64_t bid, uint64_t* start, uint64_t* end);
+            void prefetch(uint64_t offset, size_t len);
             ssize_t truncate(uint64_t& bid,
-                             size_t len);
+                             size_t len,
+                             const origin* o = NULL);
+            ssize_t length(uint64_t bid);
+            ssize_t release(uint64_t bid);
+            ssize_t sweep();
+            ssize_t defrag();
+            ssize_t clean();
+            ssize_t scrub(size_t budget);
+            ssize_t checkpoint();
+            ssize_t flush();
+            void set_sync(bool sync);
+            void set_dedup(bool dedup);
+            bool set_codec(const std::string& name);
+            void stat();
         private:
             ssize_t read_offset_map(uint64_t bid, vblock& vb);
-            ssize_t write_offset_map(uint64_t bid, vblock& vb);
-            ssize_t update_offset_map(uint64_t bid, vblock& vb, size_t offset, size_t len, size_t disk_offset);
+            ssize_t lookup_offset_map(uint64_t bid, e::intrusive_ptr<vblock_record>* rec);
+            ssize_t write_offset_map(uint64_t bid, vblock& vb, const origin* o);
+            ssize_t write_offset_map(uint64_t bid, vblock& vb, uint64_t parent,
+                                     const origin* o);
+            ssize_t write_offset_map(uint64_t bid, vblock& vb,
+                                     const uint64_t* parent, const origin* o);
+            void batch_offset_map(uint64_t bid, vblock& vb,
+                                  leveldb::WriteBatch* updates);
+            ssize_t put_offset_map(uint64_t bid, vblock& vb,
+                                   leveldb::WriteBatch* updates);
+
+        // compression and deduplication
+        private:
+            ssize_t place(const e::slice& data, size_t head,
+                          vblock::slice* s, bool* pinned);
+            ssize_t store(const e::slice& data, size_t head, vblock::slice* s);
+            bool same_record(const vblock::slice& r, const e::slice& data);
+            static std::string fingerprint_key(const e::slice& data);
+            ssize_t read_slice(uint64_t bid, const vblock::slice& s,
+                               size_t from, size_t len, char* out);
+            bool unpack_slice(uint64_t bid, const vblock::slice& s,
+                              size_t from, size_t len, const char* data,
+                              const char* table, char* out);
+            bool unpack_record(uint64_t bid, const vblock::slice& s,
+                               const char* record, size_t from, size_t len,
+                               char* out);
+            struct readv_piece;
+
+        // segment cleaning
+        private:
+            struct relocation
+            {
+                relocation() : end(0), to(0) {}
+                relocation(uint64_t _end, uint64_t _to) : end(_end), to(_to) {}
+                uint64_t end;
+                uint64_t to;
+            };
+            typedef std::map<uint64_t, relocation> relocation_map;
+            void account(vblock& vb, bool add);
+            bool relocate(vblock& vb);
+            bool relocate(const relocation_map& rm, vblock::slice* s);
+            bool touches_cleaning(vblock& vb);
+            void stop_tracking(std::vector<uint64_t>* bids);
+            ssize_t remap(uint64_t bid);
+            void freed_ranges(const std::vector<uint64_t>& bids,
+                              std::vector<std::pair<uint64_t, uint64_t> >* freed);
+            // The SEGMENT keys index, per segment, the offset maps and
+            // fingerprints that point into it.  Entries are added with the
+            // map and only dropped when the segment is cleaned, so some of
+            // them are stale.
+            static std::string segment_key(size_t segment, const leveldb::Slice& ref);
+            void batch_references(const vblock& vb, const leveldb::Slice& ref,
+                                  leveldb::WriteBatch* updates);
+            bool build_references();
+            bool count_live();
+
+        // sharding and group commit
+        private:
+            struct commit_group
+            {
+                commit_group() : updates(), writers(0), waiters(0), done(false), ok(false) {}
+                leveldb::WriteBatch updates;
+                size_t writers;
+                size_t waiters;
+                bool done;
+                bool ok;
+            };
+            // A shard owns a stripe of the bid space, an append head on the
+            // disk and a group commit queue.  The offset maps of all shards
+            // live in the same LevelDB; the key of a map is its bid.  While
+            // the cleaner runs, each shard tracks the maps written into the
+            // segments being cleaned.
+            struct shard
+            {
+                shard(size_t _id)
+                    : id(_id), next_seq(0), reserved(0), mtx(), commit_cond(&mtx)
+                    , open_group(NULL), committing(false), groups(0), grouped(0)
+                    , tracking(false), dirty() {}
+                size_t id;
+                uint64_t next_seq;
+                uint64_t reserved;
+                po6::threads::mutex mtx;
+                po6::threads::cond commit_cond;
+                commit_group* open_group;
+                bool committing;
+                uint64_t groups;
+                uint64_t grouped;
+                bool tracking;
+                std::vector<uint64_t> dirty;
+
+                private:
+                    shard(const shard&);
+                    shard& operator = (const shard&);
+            };
+            bool next_bid(shard* sh, uint64_t* bid);
+            bool reserve_bids(shard* sh, uint64_t seq);
+            bool save_state(leveldb::WriteBatch* updates);
+            shard* shard_of(uint64_t bid);
+            shard* local_shard();
+            size_t background_head() const { return m_shards.size(); }
+            void commit_open_group(shard* sh);
+            void flush_groups();
+            void hold_shards();
+            void release_shards();
+
+        // defragmentation
+        private:
+            void queue_defrag(uint64_t bid);
+            bool superseded(uint64_t bid);
+            ssize_t replace_offset_map(uint64_t bid, const vblock& expected, vblock& vb);
+
+        // integrity
+        public:
+            ssize_t quarantined(std::vector<uint64_t>* bids, size_t max);
+            ssize_t repair(uint64_t bid, const e::slice& data);
+            ssize_t set_origin(uint64_t bid, const e::slice& tag,
+                               const e::slice& peers);
+            ssize_t get_origin(uint64_t bid, std::string* tag, std::string* peers);
+            ssize_t find_origin(const e::slice& tag, uint64_t* bid);
+        private:
+            void batch_origin(uint64_t bid, const e::slice& tag,
+                              const e::slice& peers, leveldb::WriteBatch* updates);
+            bool verify(uint64_t bid, const vblock::slice& s, const char* data);
+            bool verify_chunks(uint64_t bid, const vblock::slice& s,
+                               size_t at, size_t len, const char* data,
+                               const char* table);
+            bool verify_slices(const vblock& vb, uint64_t* bytes);
+            bool suspect(uint64_t bid);
+
+        // bid lifecycle
+        private:
+            enum lifecycle_prefix
+            {
+                FINGERPRINT = 'f',
+                SEGMENT = 'g',
+                ORIGIN = 'o',
+                QUARANTINED = 'q',
+                RELEASED = 'r',
+                SUPERSEDED = 's',
+                TAGGED = 't'
+            };
+            static const size_t FINGERPRINT_KEY_SIZE = 1 + 2 * sizeof(uint64_t);
+            static std::string lifecycle_key(lifecycle_prefix prefix, uint64_t bid);
+            static std::string tag_key(const e::slice& tag);
 
         private:
             typedef std::tr1::shared_ptr<leveldb::DB> leveldb_db_ptr;
             leveldb_db_ptr m_db;
             uint64_t m_backing_size;
             disk* m_disk;
-            po6::io::fd m_fd;
-            uint64_t m_block_id;
+            std::vector<std::tr1::shared_ptr<device> > m_devices;
+            std::vector<std::tr1::shared_ptr<shard> > m_shards;
+            size_t m_next_shard;
+            po6::threads::mutex m_mtx;
+            relocation_map m_relocations;
+            relocation_map m_prev_relocations;
+            uint64_t m_rewrites;
+            bool m_sync;
+            po6::threads::mutex m_state_mtx;
+            std::vector<std::string> m_backing_paths;
+            uint64_t m_bid_limit;
+            vblock_cache m_cache;
+            po6::threads::mutex m_defrag_mtx;
+            std::set<uint64_t> m_defrag;
+            uint64_t m_defragged;
+            uint64_t m_released;
+            uint64_t m_swept;
+            std::string m_scrub_cursor;
+            uint64_t m_scrubbed;
+            uint64_t m_corrupt;
+            uint64_t m_repaired;
+            uint8_t m_codec;
+            uint64_t m_compress_in;
+            uint64_t m_compress_out;
+            uint64_t m_compress_ns;
+            uint64_t m_uncompress_bytes;
+            uint64_t m_uncompress_ns;
+            bool m_dedup;
+            uint64_t m_dedup_hits;
+            uint64_t m_dedup_bytes;
+            uint64_t m_hole_bytes;
+            uint64_t m_prefetched;
+            uint64_t m_flushes;
 
     };
 }
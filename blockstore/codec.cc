@@ -0,0 +1,144 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
+
+// WTF
+#include "blockstore/codec.h"
+
+bool
+wtf :: codec_by_name(const std::string& name, uint8_t* codec)
+{
+    if (name == "none")
+    {
+        *codec = CODEC_NONE;
+    }
+    else if (name == "snappy")
+    {
+        *codec = CODEC_SNAPPY;
+    }
+    else
+    {
+        return false;
+    }
+
+    return codec_supported(*codec);
+}
+
+const char*
+wtf :: codec_name(uint8_t codec)
+{
+    switch (codec)
+    {
+        case CODEC_NONE:
+            return "none";
+        case CODEC_SNAPPY:
+            return "snappy";
+        default:
+            return "unknown";
+    }
+}
+
+bool
+wtf :: codec_supported(uint8_t codec)
+{
+    switch (codec)
+    {
+        case CODEC_NONE:
+            return true;
+#ifdef HAVE_SNAPPY
+        case CODEC_SNAPPY:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool
+wtf :: codec_compress(uint8_t codec, const char* data, size_t len,
+                      std::vector<char>* out)
+{
+    switch (codec)
+    {
+#ifdef HAVE_SNAPPY
+        case CODEC_SNAPPY:
+        {
+            size_t sz = snappy_max_compressed_length(len);
+            out->resize(sz);
+
+            if (snappy_compress(data, len, &(*out)[0], &sz) != SNAPPY_OK)
+            {
+                return false;
+            }
+
+            out->resize(sz);
+            return true;
+        }
+#endif
+        default:
+            (void) data;
+            (void) len;
+            (void) out;
+            return false;
+    }
+}
+
+bool
+wtf :: codec_uncompress(uint8_t codec, const char* data, size_t len,
+                        std::vector<char>* out)
+{
+    switch (codec)
+    {
+#ifdef HAVE_SNAPPY
+        case CODEC_SNAPPY:
+        {
+            size_t sz;
+
+            if (snappy_uncompressed_length(data, len, &sz) != SNAPPY_OK)
+            {
+                return false;
+            }
+
+            out->resize(sz);
+            return sz == 0 ||
+                   snappy_uncompress(data, len, &(*out)[0], &sz) == SNAPPY_OK;
+        }
+#endif
+        default:
+            (void) data;
+            (void) len;
+            (void) out;
+            return false;
+    }
+}
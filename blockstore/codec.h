@@ -0,0 +1,58 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef wtf_codec_h_
+#define wtf_codec_h_
+
+// C
+#include <stddef.h>
+#include <stdint.h>
+
+// STL
+#include <string>
+#include <vector>
+
+namespace wtf __attribute__ ((visibility("hidden")))
+{
+    // Compression codecs for slices.  The id of the codec a slice was
+    // written with is kept in its offset map, so ids must never be reused.
+    enum codec_id
+    {
+        CODEC_NONE = 0,
+        CODEC_SNAPPY = 1
+    };
+
+    bool codec_by_name(const std::string& name, uint8_t* codec);
+    const char* codec_name(uint8_t codec);
+    bool codec_supported(uint8_t codec);
+    bool codec_compress(uint8_t codec, const char* data, size_t len,
+                        std::vector<char>* out);
+    bool codec_uncompress(uint8_t codec, const char* data, size_t len,
+                          std::vector<char>* out);
+}
+
+#endif // wtf_codec_h_
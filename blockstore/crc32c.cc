@@ -0,0 +1,161 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// C
+#include <string.h>
+
+// WTF
+#include "blockstore/crc32c.h"
+
+// The Castagnoli polynomial, bit reversed.
+#define CRC32C_POLY 0x82f63b78U
+
+namespace
+{
+
+// table[k][b] is the CRC of byte b followed by k zero bytes, which lets the
+// software path fold in eight bytes per step.
+class crc32c_tables
+{
+    public:
+        crc32c_tables();
+
+    public:
+        uint32_t table[8][256];
+        bool hardware;
+};
+
+crc32c_tables :: crc32c_tables()
+    : hardware(false)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; ++j)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+
+        table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        for (int k = 1; k < 8; ++k)
+        {
+            uint32_t prev = table[k - 1][i];
+            table[k][i] = (prev >> 8) ^ table[0][prev & 0xff];
+        }
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+const crc32c_tables s_crc;
+
+uint32_t
+crc32c_software(uint32_t crc, const uint8_t* p, size_t len)
+{
+    const uint32_t (*t)[256] = s_crc.table;
+
+    while (len >= 8)
+    {
+        uint32_t lo = crc ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 |
+                             uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+              t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0)
+    {
+        crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+        ++p;
+        --len;
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__ ((target("sse4.2")))
+uint32_t
+crc32c_hardware(uint32_t crc, const uint8_t* p, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = crc64;
+
+    while (len > 0)
+    {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+        ++p;
+        --len;
+    }
+
+    return crc;
+}
+#endif
+
+} // namespace
+
+uint32_t
+wtf :: crc32c(const char* data, size_t len)
+{
+    return crc32c_extend(0, data, len);
+}
+
+uint32_t
+wtf :: crc32c_extend(uint32_t crc, const char* data, size_t len)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    crc = ~crc;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (s_crc.hardware)
+    {
+        return ~crc32c_hardware(crc, p, len);
+    }
+#endif
+
+    return ~crc32c_software(crc, p, len);
+}
@@ -0,0 +1,130 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+// POSIX
+#include <errno.h>
+#include <fcntl.h>
+
+// STL
+#include <algorithm>
+
+// Google Log
+#include <glog/logging.h>
+
+// WTF
+#include "blockstore/device.h"
+#include "blockstore/mmap_device.h"
+#ifdef HAVE_LIBURING
+#include "blockstore/uring_device.h"
+#endif
+
+#define PREALLOCATE_CHUNK (1ULL << 30)
+
+using wtf::device;
+
+device*
+device :: create(const std::string& backend)
+{
+    if (backend == "mmap")
+    {
+        return new mmap_device();
+    }
+
+    if (backend == "uring")
+    {
+#ifdef HAVE_LIBURING
+        return new uring_device();
+#else
+        LOG(ERROR) << "this build of wtf has no io_uring support; reconfigure with liburing installed";
+        return NULL;
+#endif
+    }
+
+    LOG(ERROR) << "unknown blockstore I/O backend \"" << backend << "\"";
+    return NULL;
+}
+
+ssize_t
+device :: read_batch(io* ios, size_t ios_sz)
+{
+    ssize_t total = 0;
+
+    for (size_t i = 0; i < ios_sz; ++i)
+    {
+        ssize_t ret = read(ios[i].offset, ios[i].len, ios[i].buf);
+
+        if (ret < 0)
+        {
+            return -1;
+        }
+
+        total += ret;
+    }
+
+    return total;
+}
+
+void
+device :: prefetch(size_t, size_t)
+{
+}
+
+void
+device :: populate(size_t, size_t)
+{
+}
+
+// Allocation goes a chunk at a time so that a filesystem that runs out of
+// space part way keeps what it did allocate.  Whatever is left over stays
+// sparse and is allocated by the writes themselves, as without this.
+void
+device :: allocate(int fd, size_t size)
+{
+    for (size_t off = 0; off < size; off += PREALLOCATE_CHUNK)
+    {
+        size_t len = std::min<size_t>(PREALLOCATE_CHUNK, size - off);
+
+        if (fallocate(fd, 0, off, len) < 0)
+        {
+            if (errno == EOPNOTSUPP)
+            {
+                LOG(WARNING) << "the filesystem cannot preallocate the backing file";
+            }
+            else
+            {
+                PLOG(WARNING) << "preallocation stopped at " << off << " of "
+                              << size << " bytes";
+            }
+
+            return;
+        }
+    }
+}
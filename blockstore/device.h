@@ -0,0 +1,91 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef wtf_device_h_
+#define wtf_device_h_
+
+// STL
+#include <string>
+
+// C
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace wtf __attribute__ ((visibility("hidden")))
+{
+    // Byte-addressed storage under the log.  Offsets and lengths passed to
+    // write() are multiples of alignment(); reads may be arbitrary.
+    class device
+    {
+        public:
+            struct io
+            {
+                io() : offset(0), len(0), buf(NULL) {}
+                io(size_t o, size_t l, char* b) : offset(o), len(l), buf(b) {}
+                size_t offset;
+                size_t len;
+                char* buf;
+            };
+
+        public:
+            // Returns NULL if the named backend is unknown or was not built.
+            static device* create(const std::string& backend);
+
+        public:
+            device() {}
+            virtual ~device() throw () {}
+
+        public:
+            virtual bool open(const std::string& path, size_t size, bool create) = 0;
+            virtual size_t alignment() const = 0;
+            virtual ssize_t read(size_t offset, size_t len, char* data) = 0;
+            virtual ssize_t write(size_t offset, const char* data, size_t len) = 0;
+            // Make every write that has returned durable.
+            virtual bool sync() = 0;
+            // Perform a set of reads, possibly concurrently.  Returns the
+            // number of bytes read or -1 if any read fails.
+            virtual ssize_t read_batch(io* ios, size_t ios_sz);
+            // Hint that [offset, offset + len) will be read soon.  Returns
+            // at once; by default it does nothing.
+            virtual void prefetch(size_t offset, size_t len);
+            // Allocate the first size bytes on the filesystem so that
+            // appends need not, and get the device ready for populate().
+            virtual void preallocate(size_t size) = 0;
+            // [offset, offset + len) is about to be appended to.  By default
+            // it does nothing.
+            virtual void populate(size_t offset, size_t len);
+
+        protected:
+            static void allocate(int fd, size_t size);
+
+        private:
+            device(const device&);
+            device& operator = (const device&);
+    };
+}
+
+#endif // wtf_device_h_
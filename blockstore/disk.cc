@@ -25,36 +25,159 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+// C
+#include <stdlib.h>
+#include <string.h>
+
+// STL
+#include <algorithm>
+#include <memory>
+
+// e
+#include <e/buffer.h>
+#include <e/endian.h>
+#include <e/unpacker.h>
+
 #include "disk.h"
 
+// Identifies a record header.  The rest of the header is the head the record
+// was appended through, the payload length and the segment generation.
+#define RECORD_MAGIC 0x7774
+
+// Records are padded out to the device's alignment, a power of two.
+#define ALIGN_UP(X, A) (((X) + (A) - 1) & ~((A) - 1))
+
+// Threads reserve log space from a head in extents of this size.  Extents
+// start on multiples of the extent size within a segment.
+#define EXTENT_SIZE (4ULL * 1024ULL * 1024ULL)
+
 using wtf::disk;
+using wtf::device;
+
+static void
+pack_header(char* where, uint16_t head, uint32_t len, uint64_t gen)
+{
+    uint8_t* ptr = reinterpret_cast<uint8_t*>(where);
+    ptr = e::pack16be(RECORD_MAGIC, ptr);
+    ptr = e::pack16be(head, ptr);
+    ptr = e::pack32be(len, ptr);
+    ptr = e::pack64be(gen, ptr);
+}
 
-disk::disk(char* log, size_t log_len)
-    : m_log(log)
-    , m_log_len(log_len)
-    , m_log_offset(0)
+static bool
+unpack_header(const char* where, uint16_t* head, uint32_t* len, uint64_t* gen)
 {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(where);
+    uint16_t magic;
+    ptr = e::unpack16be(ptr, &magic);
+    ptr = e::unpack16be(ptr, head);
+    ptr = e::unpack32be(ptr, len);
+    ptr = e::unpack64be(ptr, gen);
+    return magic == RECORD_MAGIC && *gen > 0;
+}
+
+disk::disk(const std::vector<device*>& devices,
+           const std::vector<size_t>& lengths,
+           size_t segment_size, size_t heads)
+    : m_segment_size(segment_size)
+    , m_extent_size(segment_size % EXTENT_SIZE == 0 ? EXTENT_SIZE : segment_size)
+    , m_mtx()
+    , m_segments()
+    , m_volumes(devices.size())
+    , m_limbo()
+    , m_heads(NULL)
+    , m_heads_per_volume(heads > 0 ? heads : 1)
+    , m_heads_sz(0)
+    , m_generation(0)
+    , m_next_volume(0)
+    , m_writer_key()
+    , m_writers()
+{
+    for (size_t v = 0; v < m_volumes.size(); ++v)
+    {
+        volume& vol(m_volumes[v]);
+        vol.dev = devices[v];
+        vol.align = devices[v]->alignment();
+        vol.base = m_segments.size() * m_segment_size;
+        vol.segments = lengths[v] / m_segment_size;
+        vol.free_count = vol.segments;
+
+        for (size_t i = 0; i < vol.segments; ++i)
+        {
+            vol.free.push_back(m_segments.size());
+            m_segments.push_back(segment());
+            m_segments.back().volume = v;
+        }
+    }
+
+    m_heads_sz = m_volumes.size() * m_heads_per_volume;
+    m_heads = new append_head[m_heads_sz];
+
+    for (size_t i = 0; i < m_heads_sz; ++i)
+    {
+        m_heads[i].active = m_segments.size();
+    }
+
+    if (pthread_key_create(&m_writer_key, &disk::retire_writer) != 0)
+    {
+        PLOG(FATAL) << "could not create the per-thread extent key";
+    }
 }
 
 disk::~disk()
 {
+    pthread_key_delete(m_writer_key);
+
+    for (size_t i = 0; i < m_writers.size(); ++i)
+    {
+        delete m_writers[i];
+    }
+
+    delete[] m_heads;
 }
 
 ssize_t
 disk::write(const e::slice& data,
-            size_t& offset)
+            size_t& offset,
+            size_t head,
+            const e::slice& trailer)
 {
-    size_t sz = data.size();
-    offset = __sync_fetch_and_add(&m_log_offset, sz);
-    char* buffer = m_log + offset;
+    writer* w = this_writer();
+    size_t sz = data.size() + trailer.size();
 
-    if (offset + data.size() > m_log_len)
+    if (w->segment < m_segments.size() &&
+        w->next + ALIGN_UP(RECORD_HEADER_SIZE + sz,
+                           m_volumes[w->volume].align) <= w->end)
     {
-        return -1;
+        return append(w, data, trailer, &offset);
     }
 
-    memmove(buffer, data.data(), data.size());
-    return data.size();
+    release(w);
+    std::vector<bool> tried(m_volumes.size(), false);
+    head = head % m_heads_per_volume;
+
+    for (size_t i = 0; i < m_volumes.size(); ++i)
+    {
+        size_t v = pick_volume(tried);
+        bool full = false;
+
+        if (reserve(v, head, sz, w, &full))
+        {
+            volume& vol(m_volumes[v]);
+            vol.dev->populate(w->next - vol.base, w->end - w->next);
+            return append(w, data, trailer, &offset);
+        }
+
+        if (!full)
+        {
+            return -1;
+        }
+
+        tried[v] = true;
+    }
+
+    LOG(ERROR) << "log is full; no free segments left";
+    return -1;
 }
 
 ssize_t 
@@ -62,7 +185,759 @@ disk::read(size_t offset,
            size_t len,
            char* data)
 {
-    char* buffer = m_log + offset;
-    memmove(data, buffer, len);
-    return len;
+    volume& vol(m_volumes[volume_of(offset)]);
+    __sync_fetch_and_add(&vol.inflight, 1);
+    ssize_t ret = vol.dev->read(offset - vol.base, len, data);
+    __sync_fetch_and_sub(&vol.inflight, 1);
+    return ret;
+}
+
+// Reads are passed to each volume's device as one batch, in the order given,
+// with offsets made relative to the volume.  No read may cross volumes.
+ssize_t
+disk::read_batch(device::io* ios, size_t ios_sz)
+{
+    std::vector<std::vector<device::io> > per(m_volumes.size());
+
+    for (size_t i = 0; i < ios_sz; ++i)
+    {
+        size_t v = volume_of(ios[i].offset);
+        per[v].push_back(device::io(ios[i].offset - m_volumes[v].base,
+                                    ios[i].len, ios[i].buf));
+    }
+
+    ssize_t total = 0;
+
+    for (size_t v = 0; v < per.size(); ++v)
+    {
+        if (per[v].empty())
+        {
+            continue;
+        }
+
+        volume& vol(m_volumes[v]);
+        __sync_fetch_and_add(&vol.inflight, per[v].size());
+        ssize_t ret = vol.dev->read_batch(&per[v][0], per[v].size());
+        __sync_fetch_and_sub(&vol.inflight, per[v].size());
+
+        if (ret < 0)
+        {
+            return -1;
+        }
+
+        total += ret;
+    }
+
+    return total;
+}
+
+// Sync every volume, even if one fails.
+bool
+disk::sync()
+{
+    bool ok = true;
+
+    for (size_t v = 0; v < m_volumes.size(); ++v)
+    {
+        if (!m_volumes[v].dev->sync())
+        {
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+// Passed on to the device, clipped to the volume holding offset.
+void
+disk::prefetch(size_t offset, size_t len)
+{
+    if (offset >= m_segments.size() * m_segment_size)
+    {
+        return;
+    }
+
+    volume& vol(m_volumes[volume_of(offset)]);
+    size_t end = vol.base + vol.segments * m_segment_size;
+    vol.dev->prefetch(offset - vol.base, std::min(len, end - offset));
+}
+
+bool
+disk::read_header(size_t offset, uint16_t* head, uint32_t* len, uint64_t* gen)
+{
+    volume& vol(m_volumes[volume_of(offset)]);
+    char hdr[RECORD_HEADER_SIZE];
+    return vol.dev->read(offset - vol.base, RECORD_HEADER_SIZE, hdr) >= 0 &&
+           unpack_header(hdr, head, len, gen);
+}
+
+// Volumes are compared by outstanding I/Os, then by the fraction of their
+// segments that are free in sixteenths.  Scanning starts at a different volume
+// each time so that appends spread round robin across comparable volumes.
+size_t
+disk::pick_volume(const std::vector<bool>& tried)
+{
+    size_t best = m_volumes.size();
+    uint64_t best_depth = 0;
+    size_t best_free = 0;
+    size_t start = __sync_fetch_and_add(&m_next_volume, 1);
+
+    for (size_t i = 0; i < m_volumes.size(); ++i)
+    {
+        size_t v = (start + i) % m_volumes.size();
+
+        if (tried[v])
+        {
+            continue;
+        }
+
+        volume& vol(m_volumes[v]);
+        uint64_t depth = __sync_fetch_and_add(&vol.inflight, 0);
+        size_t free = __sync_fetch_and_add(&vol.free_count, 0) * 16
+                    / std::max(vol.segments, static_cast<size_t>(1));
+
+        if (best == m_volumes.size() || depth < best_depth ||
+            (depth == best_depth && free > best_free))
+        {
+            best = v;
+            best_depth = depth;
+            best_free = free;
+        }
+    }
+
+    return best;
+}
+
+disk::writer*
+disk::this_writer()
+{
+    writer* w = static_cast<writer*>(pthread_getspecific(m_writer_key));
+
+    if (!w)
+    {
+        w = new writer(this, m_segments.size());
+
+        {
+            po6::threads::mutex::hold hold(&m_mtx);
+            m_writers.push_back(w);
+        }
+
+        pthread_setspecific(m_writer_key, w);
+    }
+
+    return w;
+}
+
+// Reserve a fresh extent for w from one of volume v's heads, large enough for
+// a record of sz bytes.  Sets *full and fails if the volume has no room left.
+bool
+disk::reserve(size_t v, size_t head, size_t sz,
+              writer* w, bool* full)
+{
+    size_t rec = ALIGN_UP(RECORD_HEADER_SIZE + sz, m_volumes[v].align);
+    size_t need = extent_up(rec);
+
+    if (need > m_segment_size)
+    {
+        LOG(ERROR) << "write of " << sz << " bytes is larger than the "
+                   << m_segment_size << " byte segment size";
+        return false;
+    }
+
+    size_t idx = v * m_heads_per_volume + head;
+    append_head* h = &m_heads[idx];
+    po6::threads::mutex::hold hold(&h->mtx);
+
+    if (h->active == m_segments.size() ||
+        h->offset + need > (h->active + 1) * m_segment_size)
+    {
+        if (!next_segment(v, h))
+        {
+            *full = true;
+            return false;
+        }
+    }
+
+    w->volume = v;
+    w->segment = h->active;
+    w->gen = m_segments[h->active].gen;
+    w->head = idx;
+    w->next = h->offset;
+    w->end = h->offset + need;
+    h->offset += need;
+    __sync_fetch_and_add(&m_segments[h->active].writers, 1);
+    return true;
+}
+
+// Give up the rest of w's extent.
+void
+disk::release(writer* w)
+{
+    if (w->segment < m_segments.size())
+    {
+        __sync_fetch_and_sub(&m_segments[w->segment].writers, 1);
+        w->segment = m_segments.size();
+    }
+}
+
+void
+disk::retire_writer(void* p)
+{
+    writer* w = static_cast<writer*>(p);
+    disk* d = w->owner;
+    po6::threads::mutex::hold hold(&d->m_mtx);
+    d->release(w);
+    d->m_writers.erase(std::find(d->m_writers.begin(), d->m_writers.end(), w));
+    delete w;
+}
+
+// Append to w's extent, which must have room.  The extent belongs to this
+// thread alone, so records within it are written in order and without locks.
+// The trailer, if any, is written right after the data as part of the same
+// record.
+ssize_t
+disk::append(writer* w, const e::slice& data,
+             const e::slice& trailer, size_t* offset)
+{
+    volume& vol(m_volumes[w->volume]);
+    size_t sz = data.size() + trailer.size();
+    size_t rec = ALIGN_UP(RECORD_HEADER_SIZE + sz, vol.align);
+    size_t start = w->next;
+    w->next += rec;
+    *offset = start + RECORD_HEADER_SIZE;
+    ssize_t ret = sz;
+    __sync_fetch_and_add(&vol.inflight, 1);
+
+    // Devices that need aligned writes get the whole record, padding and
+    // all, in one write.
+    if (vol.align > 1)
+    {
+        void* tmp = NULL;
+
+        if (posix_memalign(&tmp, vol.align, rec) != 0)
+        {
+            LOG(ERROR) << "could not allocate a " << rec << " byte record";
+            ret = -1;
+        }
+        else
+        {
+            char* aligned = static_cast<char*>(tmp);
+            pack_header(aligned, w->head, sz, w->gen);
+            memmove(aligned + RECORD_HEADER_SIZE, data.data(), data.size());
+            memmove(aligned + RECORD_HEADER_SIZE + data.size(),
+                    trailer.data(), trailer.size());
+            memset(aligned + RECORD_HEADER_SIZE + sz, 0, rec - RECORD_HEADER_SIZE - sz);
+            ret = vol.dev->write(start - vol.base, aligned, rec) < 0 ? -1 : ret;
+            free(aligned);
+        }
+    }
+    else
+    {
+        char hdr[RECORD_HEADER_SIZE];
+        pack_header(hdr, w->head, sz, w->gen);
+
+        if (vol.dev->write(start - vol.base, hdr, RECORD_HEADER_SIZE) < 0 ||
+            vol.dev->write(*offset - vol.base, reinterpret_cast<const char*>(data.data()), data.size()) < 0 ||
+            (trailer.size() > 0 &&
+             vol.dev->write(*offset + data.size() - vol.base,
+                            reinterpret_cast<const char*>(trailer.data()), trailer.size()) < 0))
+        {
+            ret = -1;
+        }
+    }
+
+    __sync_fetch_and_sub(&vol.inflight, 1);
+    return ret;
+}
+
+// Serialize the segment table and the position of every append head.  Heads
+// are locked so that each saved offset falls on an extent boundary.
+void
+disk::save(std::string* out)
+{
+    for (size_t i = 0; i < m_heads_sz; ++i)
+    {
+        m_heads[i].mtx.lock();
+    }
+
+    m_mtx.lock();
+    size_t sz = 2 * sizeof(uint64_t)
+              + m_segments.size() * (sizeof(uint8_t) + 2 * sizeof(uint64_t))
+              + sizeof(uint64_t)
+              + m_heads_sz * 2 * sizeof(uint64_t)
+              + sizeof(uint64_t)
+              + m_volumes.size() * sizeof(uint64_t);
+    std::auto_ptr<e::buffer> buf(e::buffer::create(sz));
+    e::buffer::packer pa = buf->pack_at(0);
+    pa = pa << m_generation << static_cast<uint64_t>(m_segments.size());
+
+    for (size_t i = 0; i < m_segments.size(); ++i)
+    {
+        pa = pa << static_cast<uint8_t>(m_segments[i].state)
+                << static_cast<uint64_t>(m_segments[i].live)
+                << m_segments[i].gen;
+    }
+
+    pa = pa << static_cast<uint64_t>(m_heads_sz);
+
+    for (size_t i = 0; i < m_heads_sz; ++i)
+    {
+        pa = pa << static_cast<uint64_t>(m_heads[i].active)
+                << static_cast<uint64_t>(m_heads[i].offset);
+    }
+
+    pa = pa << static_cast<uint64_t>(m_volumes.size());
+
+    for (size_t i = 0; i < m_volumes.size(); ++i)
+    {
+        pa = pa << static_cast<uint64_t>(m_volumes[i].align);
+    }
+
+    m_mtx.unlock();
+
+    for (size_t i = 0; i < m_heads_sz; ++i)
+    {
+        m_heads[i].mtx.unlock();
+    }
+
+    out->assign(reinterpret_cast<const char*>(buf->data()), buf->size());
+}
+
+// Rebuild the segment table from a save() and the log itself.  Segments that
+// were activated after the save are recognized by the generation in the first
+// record header of any of their extents; an extent reserved just before a
+// crash may never have been written.  Each head resumes in the newest segment
+// it wrote to, past the last extent that holds an intact record header; the
+// scan never leaves that segment.
+// Segments that were being cleaned go back to the cleaner.  Live byte counts
+// are those of the save, and segments activated since start at zero; after a
+// crash the owner of the offset maps must recount them before cleaning.
+// Volumes added since the save start out empty.
+bool
+disk::restore(const e::slice& saved)
+{
+    e::unpacker up(saved);
+    uint64_t generation = 0;
+    uint64_t nsegs = 0;
+    up = up >> generation >> nsegs;
+
+    if (up.error() || nsegs > m_segments.size())
+    {
+        LOG(ERROR) << "saved disk state describes more than the "
+                   << m_segments.size() << " segments on the backing devices";
+        return false;
+    }
+
+    std::vector<segment> segs(m_segments);
+
+    for (size_t i = 0; i < nsegs; ++i)
+    {
+        uint8_t state = 0;
+        uint64_t live = 0;
+        up = up >> state >> live >> segs[i].gen;
+        segs[i].live = static_cast<int64_t>(live);
+
+        switch (state)
+        {
+            case SEGMENT_FREE:
+            case SEGMENT_LIMBO:
+                segs[i].state = SEGMENT_FREE;
+                break;
+            case SEGMENT_ACTIVE:
+            case SEGMENT_SEALED:
+            case SEGMENT_CLEANING:
+                segs[i].state = SEGMENT_SEALED;
+                break;
+            default:
+                up = up.as_error();
+                break;
+        }
+    }
+
+    uint64_t nheads = 0;
+    up = up >> nheads;
+    std::vector<size_t> resume(m_heads_sz, segs.size());
+    std::vector<size_t> resume_offset(m_heads_sz, 0);
+
+    for (size_t i = 0; !up.error() && i < nheads; ++i)
+    {
+        uint64_t active = 0;
+        uint64_t offset = 0;
+        up = up >> active >> offset;
+
+        if (i < m_heads_sz && active < nsegs &&
+            segs[active].volume == i / m_heads_per_volume)
+        {
+            resume[i] = active;
+            resume_offset[i] = offset;
+        }
+    }
+
+    // Records written before the save are padded to the alignment of the
+    // device they were written through, which need not be this one.
+    uint64_t nvols = 0;
+    up = up >> nvols;
+    std::vector<uint64_t> align(m_volumes.size(), 1);
+
+    for (size_t i = 0; !up.error() && i < nvols; ++i)
+    {
+        uint64_t a = 0;
+        up = up >> a;
+
+        if (a == 0 || (a & (a - 1)) != 0)
+        {
+            up = up.as_error();
+        }
+        else if (i < align.size())
+        {
+            align[i] = a;
+        }
+    }
+
+    if (up.error())
+    {
+        LOG(ERROR) << "saved disk state is corrupt";
+        return false;
+    }
+
+    uint64_t max_generation = generation;
+
+    for (size_t i = 0; i < segs.size(); ++i)
+    {
+        uint16_t head = 0;
+        uint32_t len = 0;
+        uint64_t gen = 0;
+        bool found = false;
+
+        for (size_t off = i * m_segment_size;
+                !found && off < (i + 1) * m_segment_size; off += m_extent_size)
+        {
+            found = read_header(off, &head, &len, &gen) && gen > generation;
+        }
+
+        if (!found)
+        {
+            continue;
+        }
+
+        segs[i].state = SEGMENT_SEALED;
+        segs[i].live = 0;
+        segs[i].gen = gen;
+        max_generation = std::max(max_generation, gen);
+
+        if (head < m_heads_sz && segs[i].volume == head / m_heads_per_volume &&
+            (resume[head] == segs.size() || segs[resume[head]].gen < gen))
+        {
+            resume[head] = i;
+            resume_offset[head] = i * m_segment_size;
+        }
+    }
+
+    size_t scanned = 0;
+
+    for (size_t h = 0; h < m_heads_sz; ++h)
+    {
+        m_heads[h].active = segs.size();
+
+        if (resume[h] == segs.size())
+        {
+            continue;
+        }
+
+        size_t seg = resume[h];
+        size_t v = segs[seg].volume;
+        size_t end = (seg + 1) * m_segment_size;
+        size_t off = resume_offset[h];
+        uint16_t head;
+        uint32_t len;
+        uint64_t gen;
+
+        // Walk the records that follow the saved offset, which a log
+        // written before extents existed need not have put on an extent
+        // boundary, then look for extents reserved since.
+        while (off + RECORD_HEADER_SIZE <= end &&
+               read_header(off, &head, &len, &gen) &&
+               head == h && gen == segs[seg].gen &&
+               off + RECORD_HEADER_SIZE + len <= end)
+        {
+            off += ALIGN_UP(RECORD_HEADER_SIZE + len, align[v]);
+        }
+
+        off = extent_up(off);
+
+        for (size_t ext = off; ext + RECORD_HEADER_SIZE <= end; )
+        {
+            if (read_header(ext, &head, &len, &gen) &&
+                head == h && gen == segs[seg].gen &&
+                ext + RECORD_HEADER_SIZE + len <= end)
+            {
+                ext += extent_up(ALIGN_UP(RECORD_HEADER_SIZE + len, align[v]));
+                off = ext;
+            }
+            else
+            {
+                ext += m_extent_size;
+            }
+        }
+
+        scanned += off - resume_offset[h];
+
+        if (off + RECORD_HEADER_SIZE > end)
+        {
+            continue;
+        }
+
+        segs[seg].state = SEGMENT_ACTIVE;
+        m_heads[h].active = seg;
+        m_heads[h].offset = off;
+    }
+
+    po6::threads::mutex::hold hold(&m_mtx);
+    m_segments.swap(segs);
+    m_limbo.clear();
+    m_generation = max_generation;
+    size_t free = 0;
+
+    for (size_t v = 0; v < m_volumes.size(); ++v)
+    {
+        m_volumes[v].free.clear();
+        m_volumes[v].free_count = 0;
+    }
+
+    for (size_t i = 0; i < m_segments.size(); ++i)
+    {
+        if (m_segments[i].state == SEGMENT_FREE)
+        {
+            volume& vol(m_volumes[m_segments[i].volume]);
+            vol.free.push_back(i);
+            ++vol.free_count;
+            ++free;
+        }
+    }
+
+    LOG(INFO) << "restored log with " << free << " free segments on "
+              << m_volumes.size() << " volumes; recovered " << scanned
+              << " bytes past the last checkpoint";
+    return true;
+}
+
+size_t
+disk::free_segments()
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    size_t free = 0;
+
+    for (size_t v = 0; v < m_volumes.size(); ++v)
+    {
+        free += m_volumes[v].free.size();
+    }
+
+    return free;
+}
+
+void
+disk::add_live(size_t offset, size_t len)
+{
+    __sync_fetch_and_add(&m_segments[segment_of(offset)].live, len);
+}
+
+void
+disk::remove_live(size_t offset, size_t len)
+{
+    __sync_fetch_and_sub(&m_segments[segment_of(offset)].live, len);
+}
+
+// Zero every live byte count so that they can be recounted from scratch.
+void
+disk::reset_live()
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+
+    for (size_t i = 0; i < m_segments.size(); ++i)
+    {
+        m_segments[i].live = 0;
+    }
+}
+
+int64_t
+disk::live_bytes(size_t segment) const
+{
+    return m_segments[segment].live;
+}
+
+bool
+disk::is_cleaning(size_t offset) const
+{
+    segment_state st = m_segments[segment_of(offset)].state;
+    return st == SEGMENT_CLEANING || st == SEGMENT_LIMBO;
+}
+
+// Keep the segment holding offset from being picked by the cleaner, the same
+// way an outstanding extent does.  Fails if the segment is already being
+// cleaned or is free.
+bool
+disk::pin(size_t offset)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    segment& seg(m_segments[segment_of(offset)]);
+
+    if (seg.state != SEGMENT_ACTIVE && seg.state != SEGMENT_SEALED)
+    {
+        return false;
+    }
+
+    __sync_fetch_and_add(&seg.writers, 1);
+    return true;
+}
+
+void
+disk::unpin(size_t offset)
+{
+    __sync_fetch_and_sub(&m_segments[segment_of(offset)].writers, 1);
+}
+
+static bool
+compare_live(const std::pair<int64_t, size_t>& lhs,
+             const std::pair<int64_t, size_t>& rhs)
+{
+    return lhs.first < rhs.first;
+}
+
+size_t
+disk::pick_victims(size_t max, size_t max_live,
+                   std::vector<size_t>* victims)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    std::vector<std::pair<int64_t, size_t> > candidates;
+
+    for (size_t i = 0; i < m_segments.size(); ++i)
+    {
+        if (m_segments[i].state == SEGMENT_SEALED &&
+            m_segments[i].live <= static_cast<int64_t>(max_live) &&
+            __sync_fetch_and_add(&m_segments[i].writers, 0) == 0)
+        {
+            candidates.push_back(std::make_pair(m_segments[i].live, i));
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), compare_live);
+    victims->clear();
+
+    for (size_t i = 0; i < candidates.size() && i < max; ++i)
+    {
+        m_segments[candidates[i].second].state = SEGMENT_CLEANING;
+        victims->push_back(candidates[i].second);
+    }
+
+    return victims->size();
+}
+
+// Cleaned segments sit in limbo for one cleaning pass before being reused so
+// that readers which looked up an offset map just before it was relocated
+// still find their bytes intact.  A segment that some map still references
+// is never freed; it goes back to being sealed and may be picked again.
+void
+disk::finish_cleaning(const std::vector<size_t>& victims)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+
+    for (size_t i = 0; i < m_limbo.size(); ++i)
+    {
+        segment& seg(m_segments[m_limbo[i]]);
+
+        if (seg.live != 0)
+        {
+            LOG(WARNING) << "segment " << m_limbo[i] << " still has "
+                         << seg.live << " live bytes after cleaning; "
+                         << "keeping it";
+            seg.state = SEGMENT_SEALED;
+            continue;
+        }
+
+        seg.state = SEGMENT_FREE;
+        seg.live = 0;
+        volume& vol(m_volumes[seg.volume]);
+        vol.free.push_back(m_limbo[i]);
+        __sync_fetch_and_add(&vol.free_count, 1);
+    }
+
+    m_limbo = victims;
+
+    for (size_t i = 0; i < m_limbo.size(); ++i)
+    {
+        m_segments[m_limbo[i]].state = SEGMENT_LIMBO;
+    }
+}
+
+void
+disk::cancel_cleaning(const std::vector<size_t>& victims)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+
+    for (size_t i = 0; i < victims.size(); ++i)
+    {
+        m_segments[victims[i]].state = SEGMENT_SEALED;
+    }
+}
+
+void
+disk::stat()
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    size_t sealed = 0;
+    size_t cleaning = 0;
+    int64_t live = 0;
+
+    for (size_t i = 0; i < m_segments.size(); ++i)
+    {
+        sealed += m_segments[i].state == SEGMENT_SEALED ? 1 : 0;
+        cleaning += m_segments[i].state == SEGMENT_CLEANING ||
+                    m_segments[i].state == SEGMENT_LIMBO ? 1 : 0;
+        live += m_segments[i].live;
+    }
+
+    size_t free = 0;
+
+    for (size_t v = 0; v < m_volumes.size(); ++v)
+    {
+        free += m_volumes[v].free.size();
+        LOG(INFO) << "disk: volume=" << v
+                  << " segments=" << m_volumes[v].segments
+                  << " free=" << m_volumes[v].free.size()
+                  << " inflight=" << m_volumes[v].inflight;
+    }
+
+    LOG(INFO) << "disk: segments=" << m_segments.size()
+              << " free=" << free
+              << " sealed=" << sealed
+              << " cleaning=" << cleaning
+              << " writers=" << m_writers.size()
+              << " live_bytes=" << live;
+}
+
+// Must be called with h->mtx held.  h must be one of volume v's heads.
+bool
+disk::next_segment(size_t v, append_head* h)
+{
+    po6::threads::mutex::hold hold(&m_mtx);
+    volume& vol(m_volumes[v]);
+
+    if (h->active < m_segments.size())
+    {
+        m_segments[h->active].state = SEGMENT_SEALED;
+        h->active = m_segments.size();
+    }
+
+    if (vol.free.empty())
+    {
+        return false;
+    }
+
+    h->active = vol.free.front();
+    vol.free.pop_front();
+    __sync_fetch_and_sub(&vol.free_count, 1);
+    m_segments[h->active].state = SEGMENT_ACTIVE;
+    m_segments[h->active].gen = ++m_generation;
+    h->offset = h->active * m_segment_size;
+    return true;
 }
@@ -28,29 +28,185 @@
 #ifndef wtf_disk_h_
 #define wtf_disk_h_
 
+// POSIX
+#include <pthread.h>
+
+// STL
+#include <deque>
+#include <string>
+#include <vector>
+
 // Google Log
 #include <glog/logging.h>
 #include <glog/raw_logging.h>
 
+// po6
+#include <po6/threads/mutex.h>
+
 #include <e/slice.h>
+
+// WTF
+#include "blockstore/device.h"
+
 namespace wtf __attribute__ ((visibility("hidden")))
 {
+    // The log is carved into fixed-size segments.  Appends go to the active
+    // segment until it fills, at which point it is sealed and a free segment
+    // becomes active.  Sealed segments are handed to the cleaner, which moves
+    // whatever is still live elsewhere and returns them to the free list.
+    //
+    // There may be several append heads, each with its own active segment, so
+    // that writers on different heads do not contend for the tail of the log.
+    // Threads do not append through a head directly.  Each thread reserves an
+    // extent of a few megabytes from a head and fills it without taking any
+    // lock, so a stream of writes from one thread lands contiguously on disk.
+    // The head passed to write() only picks where the next extent comes from.
+    // A sealed segment is not cleaned while some thread still holds an extent
+    // in it.
+    //
+    // Every append is preceded by a small record header naming the head and
+    // the generation of the segment it went into.  After a crash, restore()
+    // uses these to find where each head left off since the last save().
+    //
+    // The log may span several devices, or volumes.  Offsets are global: each
+    // volume holds a contiguous run of segments.  Every volume has its own
+    // free list and its own set of append heads; an append goes to the volume
+    // with the fewest outstanding I/Os and, among those, the most free space.
     class disk 
     {
         public:
-            disk(char* log, size_t log_len);
+            disk(const std::vector<device*>& devices,
+                 const std::vector<size_t>& lengths,
+                 size_t segment_size, size_t heads);
             ~disk();
 
         public:
             ssize_t write(const e::slice& data,
-                          size_t& offset);
+                          size_t& offset,
+                          size_t head = 0,
+                          const e::slice& trailer = e::slice());
             ssize_t read(size_t offset,
                          size_t len,
                          char* data);
+            ssize_t read_batch(device::io* ios, size_t ios_sz);
+            void prefetch(size_t offset, size_t len);
+            bool sync();
+
+        public:
+            static const size_t RECORD_HEADER_SIZE = 16;
+            void save(std::string* out);
+            bool restore(const e::slice& saved);
+
+        public:
+            size_t heads() const { return m_heads_per_volume; }
+            size_t volumes() const { return m_volumes.size(); }
+            uint32_t volume_of(size_t offset) const { return m_segments[segment_of(offset)].volume; }
+            size_t segment_size() const { return m_segment_size; }
+            size_t segment_count() const { return m_segments.size(); }
+            size_t segment_of(size_t offset) const { return offset / m_segment_size; }
+            size_t free_segments();
+            void add_live(size_t offset, size_t len);
+            void remove_live(size_t offset, size_t len);
+            void reset_live();
+            int64_t live_bytes(size_t segment) const;
+            bool is_cleaning(size_t offset) const;
+            bool pin(size_t offset);
+            void unpin(size_t offset);
+            size_t pick_victims(size_t max, size_t max_live,
+                                std::vector<size_t>* victims);
+            void finish_cleaning(const std::vector<size_t>& victims);
+            void cancel_cleaning(const std::vector<size_t>& victims);
+            void stat();
+
+        private:
+            enum segment_state
+            {
+                SEGMENT_FREE,
+                SEGMENT_ACTIVE,
+                SEGMENT_SEALED,
+                SEGMENT_CLEANING,
+                SEGMENT_LIMBO
+            };
+
+            struct segment
+            {
+                segment() : state(SEGMENT_FREE), live(0), gen(0), volume(0), writers(0) {}
+                segment_state state;
+                int64_t live;
+                uint64_t gen;
+                uint32_t volume;
+                uint64_t writers;
+            };
+
+            struct volume
+            {
+                volume() : dev(NULL), align(1), base(0), segments(0), free()
+                         , free_count(0), inflight(0) {}
+                device* dev;
+                size_t align;
+                size_t base;
+                size_t segments;
+                std::deque<size_t> free;
+                size_t free_count;
+                uint64_t inflight;
+            };
+
+            struct append_head
+            {
+                append_head() : mtx(), active(0), offset(0) {}
+                po6::threads::mutex mtx;
+                size_t active;
+                size_t offset;
+            };
+
+            // A thread's current extent, [next, end) in the given segment.
+            // Only the owning thread touches it, except on thread exit.
+            struct writer
+            {
+                writer(disk* d, size_t none)
+                    : owner(d), volume(0), segment(none), gen(0)
+                    , head(0), next(0), end(0) {}
+                disk* owner;
+                size_t volume;
+                size_t segment;
+                uint64_t gen;
+                uint16_t head;
+                size_t next;
+                size_t end;
+            };
+
+        private:
+            size_t pick_volume(const std::vector<bool>& tried);
+            writer* this_writer();
+            bool reserve(size_t v, size_t head, size_t sz,
+                         writer* w, bool* full);
+            void release(writer* w);
+            ssize_t append(writer* w, const e::slice& data,
+                           const e::slice& trailer, size_t* offset);
+            bool next_segment(size_t v, append_head* h);
+            size_t extent_up(size_t x) const
+            { return (x + m_extent_size - 1) / m_extent_size * m_extent_size; }
+            static void retire_writer(void* w);
+            bool read_header(size_t offset, uint16_t* head, uint32_t* len, uint64_t* gen);
+
+        private:
+            size_t m_segment_size;
+            size_t m_extent_size;
+            po6::threads::mutex m_mtx;
+            std::vector<segment> m_segments;
+            std::vector<volume> m_volumes;
+            std::vector<size_t> m_limbo;
+            append_head* m_heads;
+            size_t m_heads_per_volume;
+            size_t m_heads_sz;
+            uint64_t m_generation;
+            size_t m_next_volume;
+            pthread_key_t m_writer_key;
+            std::vector<writer*> m_writers;
+
         private:
-            char* m_log;
-            size_t m_log_len;
-            size_t m_log_offset;
+            disk(const disk&);
+            disk& operator = (const disk&);
     };
 }
 
@@ -0,0 +1,220 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// C
+#include <stdint.h>
+#include <string.h>
+
+// STL
+#include <algorithm>
+
+// POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Google Log
+#include <glog/logging.h>
+
+// WTF
+#include "blockstore/mmap_device.h"
+
+using wtf::mmap_device;
+
+mmap_device :: mmap_device()
+    : m_fd()
+    , m_base(NULL)
+    , m_size(0)
+    , m_populate(false)
+    , m_huge(false)
+    , m_dirty_mtx()
+    , m_dirty_lo(SIZE_MAX)
+    , m_dirty_hi(0)
+{
+}
+
+mmap_device :: ~mmap_device() throw ()
+{
+    if (m_base)
+    {
+        munmap(m_base, m_size);
+    }
+}
+
+bool
+mmap_device :: open(const std::string& path, size_t size, bool create)
+{
+    m_fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0666);
+
+    if (m_fd.get() < 0)
+    {
+        PLOG(ERROR) << "could not open backing file " << path;
+        return false;
+    }
+
+    if (ftruncate(m_fd.get(), size) < 0)
+    {
+        PLOG(ERROR) << "could not extend backing file to size " << size;
+        return false;
+    }
+
+    char* base = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd.get(), 0);
+
+    if (base == MAP_FAILED)
+    {
+        PLOG(ERROR) << "mmap of " << size << " bytes to file " << path << " failed.";
+        return false;
+    }
+
+    m_base = base;
+    m_size = size;
+    return true;
+}
+
+ssize_t
+mmap_device :: read(size_t offset, size_t len, char* data)
+{
+    memmove(data, m_base + offset, len);
+    return len;
+}
+
+ssize_t
+mmap_device :: write(size_t offset, const char* data, size_t len)
+{
+    memmove(m_base + offset, data, len);
+    po6::threads::mutex::hold hold(&m_dirty_mtx);
+    m_dirty_lo = std::min(m_dirty_lo, offset);
+    m_dirty_hi = std::max(m_dirty_hi, offset + len);
+    return len;
+}
+
+// Only the range written since the last sync is flushed, so that the kernel
+// need not walk the page tables of the whole mapping.
+bool
+mmap_device :: sync()
+{
+    size_t lo;
+    size_t hi;
+
+    {
+        po6::threads::mutex::hold hold(&m_dirty_mtx);
+        lo = m_dirty_lo;
+        hi = m_dirty_hi;
+        m_dirty_lo = SIZE_MAX;
+        m_dirty_hi = 0;
+    }
+
+    if (lo >= hi)
+    {
+        return true;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    lo = lo / page * page;
+
+    if (msync(m_base + lo, hi - lo, MS_SYNC) < 0)
+    {
+        PLOG(ERROR) << "msync of " << hi - lo << " bytes failed";
+        return false;
+    }
+
+    return true;
+}
+
+// Have the kernel start paging the range in so that the copy in read() does
+// not fault on every page.
+void
+mmap_device :: prefetch(size_t offset, size_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    size_t end = std::min(offset + len, m_size);
+
+    if (start < end && madvise(m_base + start, end - start, MADV_WILLNEED) < 0)
+    {
+        PLOG(WARNING) << "madvise(MADV_WILLNEED) failed";
+    }
+}
+
+// Preallocated blocks read back as zeros without touching the disk, so
+// populate() can map an extent in one go before the first write to it.
+void
+mmap_device :: preallocate(size_t size)
+{
+    allocate(m_fd.get(), size);
+    m_populate = true;
+    m_huge = true;
+    advise_huge(m_base, m_size);
+}
+
+// Map the extent again with MAP_POPULATE so that the appends into it do not
+// take a write fault per page.  The new mapping has the same file and
+// protections as its neighbours, so the kernel merges it back into them.
+void
+mmap_device :: populate(size_t offset, size_t len)
+{
+    if (!m_populate)
+    {
+        return;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    size_t end = std::min(offset + len, m_size);
+
+    if (start >= end)
+    {
+        return;
+    }
+
+    void* base = mmap(m_base + start, end - start, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED | MAP_POPULATE, m_fd.get(), start);
+
+    if (base == MAP_FAILED)
+    {
+        // The old mapping of the range is gone as well.
+        PLOG(FATAL) << "could not map " << end - start << " bytes at " << start;
+    }
+
+    advise_huge(m_base + start, end - start);
+}
+
+// Transparent huge pages for a file mapping depend on the filesystem; where
+// the kernel refuses, stop asking.
+void
+mmap_device :: advise_huge(char* base, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+    if (m_huge && madvise(base, len, MADV_HUGEPAGE) < 0)
+    {
+        PLOG(INFO) << "transparent huge pages are not available for the backing file";
+        m_huge = false;
+    }
+#else
+    m_huge = false;
+#endif
+}
@@ -0,0 +1,74 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef wtf_mmap_device_h_
+#define wtf_mmap_device_h_
+
+// po6
+#include <po6/io/fd.h>
+#include <po6/threads/mutex.h>
+
+// WTF
+#include "blockstore/device.h"
+
+namespace wtf __attribute__ ((visibility("hidden")))
+{
+    // The whole backing file mapped MAP_SHARED; reads and writes are copies
+    // and the kernel decides when to write back.
+    class mmap_device : public device
+    {
+        public:
+            mmap_device();
+            virtual ~mmap_device() throw ();
+
+        public:
+            virtual bool open(const std::string& path, size_t size, bool create);
+            virtual size_t alignment() const { return 1; }
+            virtual ssize_t read(size_t offset, size_t len, char* data);
+            virtual ssize_t write(size_t offset, const char* data, size_t len);
+            virtual bool sync();
+            virtual void prefetch(size_t offset, size_t len);
+            virtual void preallocate(size_t size);
+            virtual void populate(size_t offset, size_t len);
+
+        private:
+            void advise_huge(char* base, size_t len);
+
+        private:
+            po6::io::fd m_fd;
+            char* m_base;
+            size_t m_size;
+            bool m_populate;
+            bool m_huge;
+            // Bounds of everything written since the last sync().
+            po6::threads::mutex m_dirty_mtx;
+            size_t m_dirty_lo;
+            size_t m_dirty_hi;
+    };
+}
+
+#endif // wtf_mmap_device_h_
@@ -0,0 +1,452 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#define __STDC_LIMIT_MACROS
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LIBURING
+
+// C
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+
+// STL
+#include <algorithm>
+#include <vector>
+
+// Google Log
+#include <glog/logging.h>
+
+// WTF
+#include "blockstore/uring_device.h"
+
+// O_DIRECT transfers must be aligned to the logical block size; 4K covers
+// every device we run on.
+#define URING_ALIGNMENT 4096ULL
+#define URING_RINGS 8
+#define URING_DEPTH 64
+// Completions are polled this many times before sleeping in the kernel.
+#define URING_SPIN 1024
+
+#define ALIGN_DOWN(X) ((X) & ~(URING_ALIGNMENT - 1))
+#define ALIGN_UP(X) ALIGN_DOWN((X) + URING_ALIGNMENT - 1)
+
+using wtf::uring_device;
+
+uring_device :: uring_device()
+    : m_fd()
+    , m_rings(NULL)
+    , m_rings_sz(0)
+    , m_next_ring(0)
+{
+}
+
+uring_device :: ~uring_device() throw ()
+{
+    for (size_t i = 0; i < m_rings_sz; ++i)
+    {
+        if (m_rings[i].ready)
+        {
+            io_uring_queue_exit(&m_rings[i].uring);
+        }
+    }
+
+    delete[] m_rings;
+}
+
+bool
+uring_device :: open(const std::string& path, size_t size, bool create)
+{
+    m_fd = ::open(path.c_str(), O_RDWR | O_DIRECT | (create ? O_CREAT : 0), 0666);
+
+    if (m_fd.get() < 0)
+    {
+        PLOG(ERROR) << "could not open backing file " << path << " with O_DIRECT";
+        return false;
+    }
+
+    if (ftruncate(m_fd.get(), size) < 0)
+    {
+        PLOG(ERROR) << "could not extend backing file to size " << size;
+        return false;
+    }
+
+    m_rings = new ring[URING_RINGS];
+    m_rings_sz = URING_RINGS;
+
+    for (size_t i = 0; i < m_rings_sz; ++i)
+    {
+        int ret = io_uring_queue_init(URING_DEPTH, &m_rings[i].uring, 0);
+
+        if (ret < 0)
+        {
+            errno = -ret;
+            PLOG(ERROR) << "could not set up io_uring";
+            return false;
+        }
+
+        m_rings[i].ready = true;
+    }
+
+    return true;
+}
+
+// Without the page cache there are no faults to avoid, so populate() is left
+// as the default.
+void
+uring_device :: preallocate(size_t size)
+{
+    allocate(m_fd.get(), size);
+}
+
+size_t
+uring_device :: alignment() const
+{
+    return URING_ALIGNMENT;
+}
+
+ssize_t
+uring_device :: read(size_t offset, size_t len, char* data)
+{
+    io one(offset, len, data);
+    return read_batch(&one, 1);
+}
+
+// Reads that are not aligned go through an aligned bounce buffer covering the
+// blocks they touch.
+ssize_t
+uring_device :: read_batch(io* ios, size_t ios_sz)
+{
+    std::vector<char*> bounce(ios_sz, static_cast<char*>(NULL));
+    std::vector<ssize_t> results(URING_DEPTH);
+    ssize_t total = 0;
+    bool ok = true;
+    ring* r = local_ring();
+    po6::threads::mutex::hold hold(&r->mtx);
+
+    for (size_t base = 0; ok && base < ios_sz; base += URING_DEPTH)
+    {
+        size_t count = std::min(ios_sz - base, static_cast<size_t>(URING_DEPTH));
+        uint64_t batch = ++r->batch;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            io* x = &ios[base + i];
+            size_t start = ALIGN_DOWN(x->offset);
+            size_t end = ALIGN_UP(x->offset + x->len);
+            char* buf = x->buf;
+
+            if (start != x->offset || end != x->offset + x->len ||
+                reinterpret_cast<uintptr_t>(buf) % URING_ALIGNMENT != 0)
+            {
+                void* tmp = NULL;
+
+                if (posix_memalign(&tmp, URING_ALIGNMENT, end - start) != 0)
+                {
+                    LOG(ERROR) << "could not allocate " << end - start
+                               << " byte bounce buffer";
+                    ok = false;
+                    count = i;
+                    break;
+                }
+
+                buf = bounce[base + i] = static_cast<char*>(tmp);
+            }
+
+            struct io_uring_sqe* sqe = io_uring_get_sqe(&r->uring);
+            io_uring_prep_read(sqe, m_fd.get(), buf, end - start, start);
+            io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(tag(batch, i)));
+        }
+
+        if (count > 0 && (!submit(r, count) || !reap(r, batch, count, &results[0])))
+        {
+            // The kernel may still read into the bounce buffers.
+            drain(r);
+            ok = false;
+            break;
+        }
+
+        for (size_t i = 0; ok && i < count; ++i)
+        {
+            io* x = &ios[base + i];
+            size_t start = ALIGN_DOWN(x->offset);
+
+            if (results[i] < static_cast<ssize_t>(x->offset + x->len - start))
+            {
+                LOG(ERROR) << "short read of " << x->len << " bytes at " << x->offset;
+                ok = false;
+                break;
+            }
+
+            if (bounce[base + i])
+            {
+                memmove(x->buf, bounce[base + i] + (x->offset - start), x->len);
+            }
+
+            total += x->len;
+        }
+    }
+
+    for (size_t i = 0; i < bounce.size(); ++i)
+    {
+        free(bounce[i]);
+    }
+
+    return ok ? total : -1;
+}
+
+// O_DIRECT writes bypass the page cache but may still sit in the drive's
+// volatile cache until the file is synced.
+bool
+uring_device :: sync()
+{
+    if (fdatasync(m_fd.get()) < 0)
+    {
+        PLOG(ERROR) << "fdatasync of the backing file failed";
+        return false;
+    }
+
+    return true;
+}
+
+ssize_t
+uring_device :: write(size_t offset, const char* data, size_t len)
+{
+    if (offset % URING_ALIGNMENT != 0 || len % URING_ALIGNMENT != 0)
+    {
+        LOG(ERROR) << "unaligned write of " << len << " bytes at " << offset;
+        return -1;
+    }
+
+    const char* buf = data;
+    void* tmp = NULL;
+
+    if (reinterpret_cast<uintptr_t>(data) % URING_ALIGNMENT != 0)
+    {
+        if (posix_memalign(&tmp, URING_ALIGNMENT, len) != 0)
+        {
+            LOG(ERROR) << "could not allocate " << len << " byte bounce buffer";
+            return -1;
+        }
+
+        memmove(tmp, data, len);
+        buf = static_cast<const char*>(tmp);
+    }
+
+    ssize_t result = -1;
+
+    {
+        ring* r = local_ring();
+        po6::threads::mutex::hold hold(&r->mtx);
+        uint64_t batch = ++r->batch;
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&r->uring);
+        io_uring_prep_write(sqe, m_fd.get(), buf, len, offset);
+        io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(tag(batch, 0)));
+
+        if (!submit(r, 1) || !reap(r, batch, 1, &result))
+        {
+            // The kernel may still read from buf.
+            drain(r);
+            result = -1;
+        }
+    }
+
+    free(tmp);
+
+    if (result != static_cast<ssize_t>(len))
+    {
+        LOG(ERROR) << "short write of " << len << " bytes at " << offset;
+        return -1;
+    }
+
+    return len;
+}
+
+// Each thread sticks to one ring, assigned round robin the first time it
+// does I/O.
+uring_device::ring*
+uring_device :: local_ring()
+{
+    static __thread size_t assigned = 0;
+
+    if (assigned == 0)
+    {
+        assigned = __sync_add_and_fetch(&m_next_ring, 1);
+    }
+
+    return &m_rings[(assigned - 1) % m_rings_sz];
+}
+
+// Completions are tagged with the batch they belong to and their index in it.
+uintptr_t
+uring_device :: tag(uint64_t batch, size_t idx)
+{
+    return static_cast<uintptr_t>((batch << 16) | idx);
+}
+
+// Submit the count entries queued on r, whose mutex must be held.
+bool
+uring_device :: submit(ring* r, size_t count)
+{
+    int ret = io_uring_submit(&r->uring);
+
+    if (ret > 0)
+    {
+        r->inflight += ret;
+    }
+
+    if (ret < 0)
+    {
+        errno = -ret;
+        PLOG(ERROR) << "could not submit io_uring requests";
+        return false;
+    }
+
+    if (static_cast<size_t>(ret) != count)
+    {
+        LOG(ERROR) << "io_uring took " << ret << " of " << count << " requests";
+        return false;
+    }
+
+    return true;
+}
+
+// After a failed submission or reap, entries may still be queued or in flight
+// on r, and they point at buffers the caller is about to free or reuse.  Push
+// out everything queued and wait for every completion.  If that cannot be
+// done, nothing about those buffers is safe, so give up entirely.
+void
+uring_device :: drain(ring* r)
+{
+    while (true)
+    {
+        unsigned queued = io_uring_sq_ready(&r->uring);
+
+        if (queued == 0 && r->inflight == 0)
+        {
+            return;
+        }
+
+        if (queued > 0)
+        {
+            int ret = io_uring_submit(&r->uring);
+
+            if (ret > 0)
+            {
+                r->inflight += ret;
+            }
+            else if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+            {
+                errno = -ret;
+                PLOG(FATAL) << "could not drain io_uring; queued requests still "
+                            << "reference their buffers";
+            }
+        }
+
+        if (r->inflight > 0)
+        {
+            struct io_uring_cqe* cqe = NULL;
+            int ret = io_uring_wait_cqe(&r->uring, &cqe);
+
+            if (ret == 0)
+            {
+                io_uring_cqe_seen(&r->uring, cqe);
+                --r->inflight;
+            }
+            else if (ret != -EINTR && ret != -EAGAIN)
+            {
+                errno = -ret;
+                PLOG(FATAL) << "could not drain io_uring; requests in flight "
+                            << "still reference their buffers";
+            }
+        }
+    }
+}
+
+// Collect count completions of batch from r, whose mutex must be held.  The
+// result of entry i lands in results[i].
+bool
+uring_device :: reap(ring* r, uint64_t batch, size_t count, ssize_t* results)
+{
+    bool ok = true;
+
+    for (size_t done = 0; done < count; )
+    {
+        struct io_uring_cqe* cqe = NULL;
+        int ret = -EAGAIN;
+
+        for (size_t spin = 0; ret == -EAGAIN && spin < URING_SPIN; ++spin)
+        {
+            ret = io_uring_peek_cqe(&r->uring, &cqe);
+        }
+
+        if (ret == -EAGAIN)
+        {
+            ret = io_uring_wait_cqe(&r->uring, &cqe);
+        }
+
+        if (ret < 0)
+        {
+            errno = -ret;
+            PLOG(ERROR) << "could not reap io_uring completion";
+            return false;
+        }
+
+        uintptr_t t = reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe));
+        size_t idx = t & 0xffff;
+        int res = cqe->res;
+        io_uring_cqe_seen(&r->uring, cqe);
+        --r->inflight;
+
+        if (t >> 16 != (batch & (UINTPTR_MAX >> 16)) || idx >= count)
+        {
+            continue;
+        }
+
+        if (res < 0)
+        {
+            errno = -res;
+            PLOG(ERROR) << "io_uring request failed";
+            ok = false;
+        }
+
+        results[idx] = res;
+        ++done;
+    }
+
+    return ok;
+}
+
+#endif // HAVE_LIBURING
@@ -0,0 +1,88 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef wtf_uring_device_h_
+#define wtf_uring_device_h_
+
+// liburing
+#include <liburing.h>
+
+// po6
+#include <po6/io/fd.h>
+#include <po6/threads/mutex.h>
+
+// WTF
+#include "blockstore/device.h"
+
+namespace wtf __attribute__ ((visibility("hidden")))
+{
+    // The backing file opened O_DIRECT and driven through io_uring, so that
+    // block I/O bypasses the page cache.  Each thread sticks to one of a few
+    // rings; a batch is submitted at once and its completions polled for.
+    class uring_device : public device
+    {
+        public:
+            uring_device();
+            virtual ~uring_device() throw ();
+
+        public:
+            virtual bool open(const std::string& path, size_t size, bool create);
+            virtual size_t alignment() const;
+            virtual ssize_t read(size_t offset, size_t len, char* data);
+            virtual ssize_t write(size_t offset, const char* data, size_t len);
+            virtual ssize_t read_batch(io* ios, size_t ios_sz);
+            virtual bool sync();
+            virtual void preallocate(size_t size);
+
+        private:
+            struct ring
+            {
+                ring() : mtx(), batch(0), inflight(0), ready(false) {}
+                po6::threads::mutex mtx;
+                struct io_uring uring;
+                uint64_t batch;
+                // submitted and not yet reaped
+                uint64_t inflight;
+                bool ready;
+            };
+
+        private:
+            ring* local_ring();
+            static uintptr_t tag(uint64_t batch, size_t idx);
+            bool submit(ring* r, size_t count);
+            bool reap(ring* r, uint64_t batch, size_t count, ssize_t* results);
+            void drain(ring* r);
+
+        private:
+            po6::io::fd m_fd;
+            ring* m_rings;
+            size_t m_rings_sz;
+            size_t m_next_ring;
+    };
+}
+
+#endif // wtf_uring_device_h_
@@ -25,6 +25,9 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+// STL
+#include <algorithm>
+
 // WTF
 #include "vblock.h"
 #define TRACECALLS
@@ -33,390 +36,367 @@
 #include <glog/raw_logging.h>
 
 using wtf::vblock;
+using wtf::vblock_view;
 
-vblock :: vblock()
-   : m_ref(0)
-   , m_slice_map()
+namespace
 {
-}
 
-vblock :: ~vblock() throw()
+// Orders slices by where they end, which lets lower_bound find the first
+// slice that reaches past a given offset.
+struct ends_before
 {
-}
+    bool operator () (const vblock::slice& lhs, size_t offset) const
+    {
+        return lhs.end() <= offset;
+    }
+};
 
-vblock :: slice :: slice()
-    : m_ref(0)
-    , m_offset(0)
-    , m_length(0)
-    , m_disk_offset(0)
+struct starts_before
 {
-}
+    bool operator () (const vblock::slice& lhs, size_t offset) const
+    {
+        return lhs.offset() < offset;
+    }
+};
+
+} // namespace
 
-vblock :: slice :: slice(size_t off, size_t len, size_t disk_off)
-    : m_ref(0)
-    , m_offset(off)
-    , m_length(len)
-    , m_disk_offset(disk_off)
+vblock :: vblock()
+   : m_ref(0)
+   , m_slices()
 {
 }
 
-vblock :: slice :: ~slice() throw()
+vblock :: ~vblock() throw()
 {
 }
 
 uint64_t
-vblock :: length()
+vblock :: length() const
 {
-    TRACE;
-    if (m_slice_map.empty())
+    if (m_slices.empty())
     {
         return 0;
     }
 
-    slice_map::iterator end = m_slice_map.end();
-    end--;
+    return m_slices.back().end();
+}
 
-    uint64_t offset = end->first;
-    uint64_t len = end->second->length();
-    LOG(INFO) << "offset " << offset;
-    LOG(INFO) << "len " << len;
-    return offset + len;
+void
+vblock :: update(size_t off, size_t len, size_t disk_off, uint32_t device)
+{
+    update(slice(off, len, disk_off, device));
 }
 
+// Overlay s onto the block.  Every slice it overlaps is replaced by at most
+// three: what is left of the first one on the left, s, and what is left of
+// the last one on the right.
 void
-vblock :: update(size_t off, size_t len, size_t disk_off)
+vblock :: update(const slice& s)
 {
     TRACE;
-    size_t new_start = off;
-    size_t new_end = off+ len - 1;
 
-    std::cout << "new_start = " << new_start << std::endl;
-    std::cout << "new_end = " << new_end << std::endl;
-
-    vblock::slice_map::iterator after = m_slice_map.lower_bound(new_start);
-    e::intrusive_ptr<vblock::slice> new_slice(new vblock::slice(new_start, len, disk_off));
-
-    
-
-    //new block
-    if (m_slice_map.size() == 0)
+    if (s.length() == 0)
     {
-        TRACE;
-        m_slice_map[new_start] = new_slice;
         return;
     }
 
-    //beginning of the block
-    if (after == m_slice_map.begin())
+    size_t new_start = s.offset();
+    size_t new_end = s.end();
+
+    slice_list::iterator lo = std::lower_bound(m_slices.begin(), m_slices.end(),
+                                               new_start, ends_before());
+    slice_list::iterator hi = std::lower_bound(lo, m_slices.end(),
+                                               new_end, starts_before());
+
+    slice replacement[3];
+    size_t n = 0;
+
+    if (lo != hi && lo->offset() < new_start)
     {
-        TRACE;
-        e::intrusive_ptr<slice> old_slice = after->second;
-        size_t old_length = old_slice->m_length;
-        size_t old_start = old_slice->m_offset;
-        size_t old_end = old_start + old_length - 1;
+        replacement[n++] = lo->cut(lo->offset(), new_start - lo->offset());
+    }
 
-        if (old_start != new_start)
-        {
-            TRACE;
-            m_slice_map[new_start] = new_slice;
-        }
-        else if (old_end <= new_end)
-        {
-            TRACE;
-            after++;
-            m_slice_map[new_start] = new_slice;
-
-            if (after == m_slice_map.end())
-            {
-                return;
-            }
-
-            old_slice = after->second;
-            old_length = old_slice->m_length;
-            old_start = old_slice->m_offset;
-            old_end = old_start + old_length - 1;
-        }
-        else
-        {
-            TRACE;
-            old_slice->m_length = old_end - new_end;
-            old_slice->m_offset = new_end + 1;
-            old_slice->m_disk_offset += (new_end + 1 - old_start);
-
-            m_slice_map[old_slice->m_offset] = old_slice;
-            m_slice_map[new_start] = new_slice;
-            return;
-        }
+    replacement[n++] = s;
 
-        //remove completely overwritten slices
-        while (old_end <= new_end)
-        {
-            TRACE;
-            vblock::slice_map::iterator old_iter = after;
-            old_slice = old_iter->second;
-            after++;
-
-            m_slice_map.erase(old_iter);
-
-            if (after == m_slice_map.end())
-            {
-                TRACE;
-                break;
-            }
-
-            old_slice = after->second;
-            old_start = old_slice->m_offset;
-            old_length = old_slice->m_length;
-            old_end = old_start + old_length - 1;
-        }
+    if (lo != hi && (hi - 1)->end() > new_end)
+    {
+        const slice& last(*(hi - 1));
+        replacement[n++] = last.cut(new_end, last.end() - new_end);
+    }
 
-        //cut the beginning off the overlapping slice on the right
-        if (after != m_slice_map.end())
-        {
-            TRACE;
-            old_slice->m_length = old_end - new_end;
-            old_slice->m_offset = new_end + 1;
-            old_slice->m_disk_offset += (new_end + 1 - old_start);
-        }
+    // Reuse the overlapped entries in place and shift the tail only when the
+    // count changes.
+    size_t overlapped = hi - lo;
+    size_t idx = lo - m_slices.begin();
 
-        //XXX: Check this later.  dinner time.
-        TRACE;
-        return;
+    if (overlapped < n)
+    {
+        m_slices.insert(hi, n - overlapped, slice());
     }
-    //somewhere in the middle of the block 
-    else if (after != m_slice_map.end())
+    else if (overlapped > n)
     {
-        TRACE;
-        e::intrusive_ptr<slice> old_slice = after->second;
-        size_t old_length = old_slice->m_length;
-        size_t old_start = old_slice->m_offset;
-        size_t old_end = old_start + old_length - 1;
+        m_slices.erase(lo + n, hi);
+    }
 
-        if (old_start != new_start)
-        {
-            TRACE;
-            //store a pointer to the slice before this one
-            //we can do before-- because we know this isn't the first one.
-            vblock::slice_map::iterator before = after;
-            before--;
-
-            m_slice_map[new_start] = new_slice;
-
-            //remove completely overwritten slices
-            while (old_end <= new_end)
-            {
-                TRACE;
-                vblock::slice_map::iterator old_iter = after;
-                old_slice = old_iter->second;
-                after++;
-
-                m_slice_map.erase(old_iter);
-
-                if (after == m_slice_map.end())
-                {
-                    TRACE;
-                    break;
-                }
-
-                old_slice = after->second;
-                old_start = old_slice->m_offset;
-                old_length = old_slice->m_length;
-                old_end = old_start + old_length - 1;
-            }
-
-            //cut the beginning off the overlapping slice on the right
-            if (after != m_slice_map.end())
-            {
-                TRACE;
-                old_slice->m_length = old_end - new_end;
-                old_slice->m_offset = new_end + 1;
-                old_slice->m_disk_offset += (new_end + 1 - old_start);
-            }
-
-            old_slice = before->second;
-            old_start = old_slice->m_offset;
-            old_length = old_slice->m_length;
-            old_end = old_start + old_length - 1;
-
-            //cut the end off the overlapping slice to the left
-            if (old_end >= new_start)
-            {
-                TRACE;
-                old_slice->m_length -= (old_end - new_start + 1);  
-            }
-
-            TRACE;
-            //mic drop.
-            return;
-        }
+    std::copy(replacement, replacement + n, m_slices.begin() + idx);
+}
 
-        //starts at the same offset
-        else
-        {
-            TRACE;
-            if (old_end > new_end)
-            {
-                TRACE;
-                //smaller than existing slice, so we need to split the slice..
-                //XXX change disk offset
-                old_slice->m_offset = new_end + 1;
-                old_slice->m_length = old_end - new_end;
-                m_slice_map[new_end + 1] = old_slice;
-                m_slice_map[new_start] = new_slice;
-                return;
-            }
-            else if (old_end < new_end)
-            {
-                TRACE;
-                //larger than existing slice, so we get rid of this slice
-                //and check the next one.  Note that after is == to current
-                //slice, so we have to increment before replacing.
-                after++;
-                m_slice_map[new_start] = new_slice;
-
-                //remove completely overwritten slices
-                while (old_end <= new_end)
-                {
-                    TRACE;
-                    vblock::slice_map::iterator old_iter = after;
-                    old_slice = old_iter->second;
-                    after++;
-
-                    m_slice_map.erase(old_iter);
-
-                    if (after == m_slice_map.end())
-                    {
-                        TRACE;
-                        break;
-                    }
-
-                    old_slice = after->second;
-                    old_start = old_slice->m_offset;
-                    old_length = old_slice->m_length;
-                    old_end = old_start + old_length - 1;
-                }
-
-                //cut the beginning off the overlapping slice on the right
-                if (after != m_slice_map.end())
-                {
-                    TRACE;
-                    old_slice->m_length = old_end - new_end;
-                    old_slice->m_offset = new_end + 1;
-                    old_slice->m_disk_offset += (new_end + 1 - old_start);
-                }
-
-                TRACE;
-                //fuck yeah.
-                return;
-           }
-           else
-           {
-               TRACE;
-               //exact same offset and size as existing block, just replace it
-                m_slice_map[new_start] = new_slice;
-                return;
-           }
-        }
+size_t
+vblock :: slice :: pack_size()
+{ 
+    return 3 * sizeof(uint64_t) + 4 * sizeof(uint32_t);
+}
+
+// The part of this slice covering [offset, offset + length), which must lie
+// within it.
+vblock::slice
+vblock :: slice :: cut(size_t offset, size_t length) const
+{
+    slice s(*this);
+    size_t delta = offset - m_offset;
+    s.m_offset = offset;
+    s.m_length = length;
+
+    if (m_stored != 0)
+    {
+        s.m_skip += delta;
     }
     else
     {
-        TRACE;
-        after--;
+        s.m_disk_offset += delta;
 
-        //just put it at the end.
-        m_slice_map[new_start] = new_slice;
-
-        e::intrusive_ptr<slice> old_slice = after->second;
-        size_t old_length = old_slice->m_length;
-        size_t old_start = old_slice->m_offset;
-        size_t old_end = old_start + old_length - 1;
-
-        if (old_end > new_end)
+        if (delta != 0 || length != m_length)
         {
-            TRACE;
-            //smaller than existing slice, so we need to split the slice..
-            e::intrusive_ptr<vblock::slice> end_slice(new vblock::slice(new_end + 1, old_end - new_end, old_slice->m_disk_offset));
-            old_slice->m_length -= (old_end - new_start + 1);
-            end_slice->m_disk_offset += old_slice->m_length + new_slice->m_length;
-            m_slice_map[new_end + 1] = end_slice;
-            m_slice_map[new_start] = new_slice;
-            return;
+            s.clear_crc();
         }
+    }
 
-        //cut the end off the overlapping slice to the left
-        if (old_end >= new_start)
-        {
-            TRACE;
-            old_slice->m_length -= (old_end - new_start + 1);  
-        }
+    return s;
+}
 
-        TRACE;
-        return;
+// The bytes a chunked record holding len bytes of data takes in the log.
+size_t
+vblock :: slice :: chunked_length(size_t len)
+{
+    if (len <= CRC_CHUNK)
+    {
+        return len;
     }
 
-    TRACE;
+    return len + (len + CRC_CHUNK - 1) / CRC_CHUNK * sizeof(uint32_t);
 }
 
+// The bytes of data in the record of a chunked slice, without its CRC table.
+// A record of n > 1 chunks is longer than (CRC_CHUNK + 4) * (n - 1) and at
+// most (CRC_CHUNK + 4) * n, which gives n back from the stored length.
 size_t
-vblock :: slice :: pack_size()
-{ 
-    return 3*sizeof(size_t);
+vblock :: slice :: record_length() const
+{
+    if (m_stored <= CRC_CHUNK)
+    {
+        return m_stored;
+    }
+
+    size_t n = (m_stored + CRC_CHUNK + sizeof(uint32_t) - 1) /
+               (CRC_CHUNK + sizeof(uint32_t));
+    return m_stored - n * sizeof(uint32_t);
 }
 
 size_t
-vblock :: pack_size()
+vblock :: pack_size() const
 { 
-    return sizeof(size_t) + m_slice_map.size() * slice::pack_size();
+    return HEADER_SIZE + m_slices.size() * slice::pack_size();
 }
 
+bool
+vblock :: parse_header(const uint8_t* data, size_t sz,
+                       size_t* header, size_t* width, size_t* count)
+{
+    if (sz < HEADER_SIZE)
+    {
+        return false;
+    }
+
+    if (data[0] == 0)
+    {
+        uint64_t c;
+        e::unpack64be(data, &c);
+        *header = sizeof(uint64_t);
+        *width = slice::BASE_PACK_SIZE;
+        *count = c;
+    }
+    else if (data[0] == FORMAT_VERSION)
+    {
+        uint32_t c;
+        e::unpack32be(data + 4, &c);
+        *header = HEADER_SIZE;
+        *width = data[1];
+        *count = c;
+    }
+    else
+    {
+        return false;
+    }
+
+    return *width >= slice::BASE_PACK_SIZE &&
+           *count <= (sz - *header) / *width;
+}
+
+// Find the first slice that overlaps [offset, offset + len).
 ssize_t
-vblock :: get_slices(size_t offset, size_t len, vblock::slice_map::const_iterator& slices)
+vblock :: get_slices(size_t offset, size_t len, vblock::slice_list::const_iterator& slices) const
 {
-    size_t start = offset;
-    size_t end = offset + len - 1;
+    slice_list::const_iterator it = std::lower_bound(m_slices.begin(), m_slices.end(),
+                                                     offset, ends_before());
 
-    if (m_slice_map.size() == 0)
+    if (it == m_slices.end() || it->offset() >= offset + len)
     {
         return -1;
     }
 
-    vblock::slice_map::const_iterator after = m_slice_map.lower_bound(offset);
+    slices = it;
+    return 0;
+}
 
-    if (after == m_slice_map.end())
+void
+vblock :: set_len(size_t len)
+{
+    slice_list::iterator it = std::lower_bound(m_slices.begin(), m_slices.end(),
+                                               len, ends_before());
+
+    if (it == m_slices.end())
     {
-        after--;
-        if (after->second->m_offset + after->second->m_length - 1 >= start)
-        {
-            slices = after;
-            return 0;
-        }
+        return;
     }
-    else if (after->second->m_offset <= end)
+
+    if (it->offset() < len)
     {
-        slices = after;
-        return 0;
+        it->set_length(len - it->offset());
+        ++it;
     }
 
-    return -1;
+    m_slices.erase(it, m_slices.end());
 }
 
+// Make the block len bytes long when its slices end short of len, as after a
+// truncate into a hole.  An empty slice at len marks the end, and the bytes
+// before it read as a hole.
 void
-vblock :: set_len(size_t len)
+vblock :: pad(size_t len)
 {
-    slice_map::iterator it = m_slice_map.begin();
-    for (; it != m_slice_map.end(); it++)
+    if (len <= length())
+    {
+        return;
+    }
+
+    if (!m_slices.empty() && m_slices.back().length() == 0)
     {
-        if (it->first + it->second->length() >= len)
+        m_slices.back().set_offset(len);
+    }
+    else
+    {
+        m_slices.push_back(slice(len, 0, 0, 0));
+    }
+}
+
+vblock_view :: vblock_view()
+    : m_table(NULL)
+    , m_width(0)
+    , m_count(0)
+{
+}
+
+bool
+vblock_view :: parse(const uint8_t* data, size_t sz)
+{
+    size_t header;
+
+    if (!vblock::parse_header(data, sz, &header, &m_width, &m_count))
+    {
+        return false;
+    }
+
+    m_table = data + header;
+    return true;
+}
+
+vblock::slice
+vblock_view :: slice_at(size_t idx) const
+{
+    const uint8_t* ptr = m_table + idx * m_width;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t disk_offset;
+    ptr = e::unpack64be(ptr, &offset);
+    ptr = e::unpack64be(ptr, &length);
+    ptr = e::unpack64be(ptr, &disk_offset);
+    uint32_t device = 0;
+    uint32_t crc = 0;
+    uint32_t stored = 0;
+    uint32_t skip = 0;
+
+    if (m_width >= vblock::slice::DEVICE_PACK_SIZE)
+    {
+        ptr = e::unpack32be(ptr, &device);
+        ptr = e::unpack32be(ptr, &crc);
+    }
+
+    if (m_width >= vblock::slice::pack_size())
+    {
+        ptr = e::unpack32be(ptr, &stored);
+        ptr = e::unpack32be(ptr, &skip);
+    }
+
+    vblock::slice s(offset, length, disk_offset,
+                    device & vblock::slice::DEVICE_MASK);
+
+    if (device & vblock::slice::CHECKSUMMED)
+    {
+        s.set_crc(crc);
+    }
+
+    if (m_width >= vblock::slice::pack_size())
+    {
+        s.set_compression((device >> vblock::slice::CODEC_SHIFT) &
+                          vblock::slice::CODEC_MASK, stored, skip);
+    }
+
+    return s;
+}
+
+// Index of the first slice that ends past offset, or size() if none does.
+size_t
+vblock_view :: find(size_t offset) const
+{
+    size_t lo = 0;
+    size_t hi = m_count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        vblock::slice s(slice_at(mid));
+
+        if (s.end() <= offset)
         {
-            it->second->set_length(len - it->first);
-            break;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
         }
     }
 
-    it++;
+    return lo;
+}
 
-    for (; it != m_slice_map.end(); it++)
+uint64_t
+vblock_view :: length() const
+{
+    if (m_count == 0)
     {
-        m_slice_map.erase(it);
+        return 0;
     }
+
+    return slice_at(m_count - 1).end();
 }
@@ -34,7 +34,7 @@
 #include <e/endian.h>
 
 // STL
-#include <map>
+#include <vector>
 
 namespace wtf __attribute__ ((visibility("hidden")))
 {
@@ -46,16 +46,33 @@ class vblock
         ~vblock() throw ();
 
     public:
-        void update(size_t offset, size_t len, size_t disk_offset);
-        uint64_t size() { return m_slice_map.size(); }
-        uint64_t length();
-        size_t pack_size(); 
+        void update(size_t offset, size_t len, size_t disk_offset, uint32_t device);
+        uint64_t size() const { return m_slices.size(); }
+        uint64_t length() const;
+        size_t pack_size() const;
         void set_len(size_t len);
+        void pad(size_t len);
 
     public:
+        // Encoded maps start with a header of a format version, the width of
+        // each slice entry, two reserved bytes and a 32-bit slice count.  The
+        // sorted, fixed-width slice table follows, so a map can be searched
+        // without decoding it.  Maps written before the header existed start
+        // with a 64-bit count, and so with a zero byte.  Entries may be wider
+        // than the fields a reader knows about; the rest is skipped.
+        static const uint8_t FORMAT_VERSION = 1;
+        static const size_t HEADER_SIZE = 8;
+        static bool parse_header(const uint8_t* data, size_t sz,
+                                 size_t* header, size_t* width, size_t* count);
+
+    public:
+        // Slices are kept in a flat array sorted by offset.  They never
+        // overlap, but there may be holes between them.
         class slice;
-        typedef std::map<size_t, e::intrusive_ptr<slice> > slice_map;
-        void slice_at(size_t offset, e::intrusive_ptr<slice>& slc) { slc = m_slice_map[offset]; }
+        typedef std::vector<slice> slice_list;
+        const slice_list& slices() const { return m_slices; }
+        slice_list& slices() { return m_slices; }
+        void update(const slice& s);
 
     private:
         friend class e::intrusive_ptr<vblock>;
@@ -73,41 +90,98 @@ class vblock
             operator << (e::buffer::packer pa, const e::intrusive_ptr<vblock>& rhs);
 
     public:
-        ssize_t get_slices(size_t offset, size_t len, slice_map::const_iterator& slices);
+        ssize_t get_slices(size_t offset, size_t len, slice_list::const_iterator& slices) const;
     private:
         vblock(const vblock&);
-        void update(slice& s);
 
     private:
-        void inc() { ++m_ref; }
-        void dec() { assert(m_ref > 0); if (--m_ref == 0) delete this; }
+        void inc() { __sync_add_and_fetch(&m_ref, 1); }
+        void dec() { assert(m_ref > 0); if (__sync_sub_and_fetch(&m_ref, 1) == 0) delete this; }
 
     private:
         vblock& operator = (const vblock&);
 
     private:
         size_t m_ref;
-        slice_map m_slice_map;
+        slice_list m_slices;
 };
 
 class vblock::slice
 {
     public:
-        slice();
-        slice(size_t offset, size_t length, size_t disk_offset);
-        ~slice() throw();
-        static size_t pack_size();
-        size_t offset() { return m_offset; }
-        size_t length() { return m_length; }
-        void set_length(size_t length) { m_length = length; }
-        size_t disk_offset() { return m_disk_offset; }
+        slice() : m_offset(0), m_length(0), m_disk_offset(0), m_device(0)
+                , m_checksummed(false), m_crc(0), m_codec(0), m_stored(0)
+                , m_skip(0) {}
+        slice(size_t offset, size_t length, size_t disk_offset, uint32_t device)
+            : m_offset(offset), m_length(length), m_disk_offset(disk_offset)
+            , m_device(device), m_checksummed(false), m_crc(0), m_codec(0)
+            , m_stored(0), m_skip(0) {}
 
-    private:
-        void inc() { ++m_ref; }
-        void dec() { assert(m_ref > 0); if (--m_ref == 0) delete this; }
+    public:
+        // Entries are the offset, length and disk offset, then the device
+        // and the CRC-32C of the slice's bytes on disk, then the stored
+        // length and skip of a compressed slice.  The top bit of the device
+        // word says whether the CRC is set and the next seven hold the
+        // codec.  Entries of BASE_PACK_SIZE bytes predate the device and are
+        // all on device 0; entries of DEVICE_PACK_SIZE bytes are never
+        // compressed.
+        //
+        // A compressed slice points at a whole compressed record of stored
+        // bytes; its data starts skip bytes into the uncompressed record.
+        // Cutting a compressed slice only moves the skip, so both halves
+        // keep the CRC of the record.
+        //
+        // A plain slice with a stored length is chunked: it points at a
+        // whole record the same way, and the record's data carries a CRC
+        // per CRC_CHUNK bytes.  Records of more than one chunk end with a
+        // table of the chunk CRCs, and the slice's CRC covers the table; a
+        // single chunk record has no table and the slice's CRC covers the
+        // chunk.  Reads fetch and check only the chunks they touch, and cuts
+        // keep coverage.  Plain slices without a stored length predate
+        // chunking: cutting one moves the disk offset and the pieces lose
+        // their CRC.
+        static const size_t BASE_PACK_SIZE = 3 * sizeof(uint64_t);
+        static const size_t DEVICE_PACK_SIZE = BASE_PACK_SIZE + 2 * sizeof(uint32_t);
+        static const uint32_t CHECKSUMMED = 0x80000000U;
+        static const uint32_t CODEC_SHIFT = 24;
+        static const uint32_t CODEC_MASK = 0x7fU;
+        static const uint32_t DEVICE_MASK = 0x00ffffffU;
+        static const size_t CRC_CHUNK = 65536;
+        static size_t pack_size();
+        static size_t chunked_length(size_t len);
+        size_t offset() const { return m_offset; }
+        void set_offset(size_t offset) { m_offset = offset; }
+        size_t length() const { return m_length; }
+        size_t end() const { return m_offset + m_length; }
+        bool operator == (const slice& rhs) const
+        { return m_offset == rhs.m_offset && m_length == rhs.m_length &&
+                 m_disk_offset == rhs.m_disk_offset && m_device == rhs.m_device &&
+                 m_checksummed == rhs.m_checksummed && m_crc == rhs.m_crc &&
+                 m_codec == rhs.m_codec && m_stored == rhs.m_stored &&
+                 m_skip == rhs.m_skip; }
+        void set_length(size_t length)
+        { if (length != m_length && m_stored == 0) { m_checksummed = false; } m_length = length; }
+        slice cut(size_t offset, size_t length) const;
+        size_t disk_offset() const { return m_disk_offset; }
+        void set_disk_offset(size_t disk_offset) { m_disk_offset = disk_offset; }
+        uint32_t device() const { return m_device; }
+        void set_device(uint32_t device) { m_device = device; }
+        bool checksummed() const { return m_checksummed; }
+        uint32_t crc() const { return m_crc; }
+        void set_crc(uint32_t crc) { m_checksummed = true; m_crc = crc; }
+        void clear_crc() { m_checksummed = false; m_crc = 0; }
+        bool compressed() const { return m_codec != 0; }
+        uint8_t codec() const { return m_codec; }
+        size_t stored_length() const { return m_stored; }
+        size_t skip() const { return m_skip; }
+        void set_compression(uint8_t codec, size_t stored, size_t skip)
+        { m_codec = codec; m_stored = stored; m_skip = skip; }
+        bool chunked() const { return !compressed() && m_stored != 0; }
+        size_t record_length() const;
+        // The bytes the slice occupies in the log.
+        size_t disk_length() const { return m_stored != 0 ? m_stored : m_length; }
 
      private:
-        friend class e::intrusive_ptr<slice>;
         friend class vblock;
         friend std::ostream& 
             operator << (std::ostream& lhs, const vblock::slice& rhs);
@@ -116,24 +190,39 @@ class vblock::slice
         friend e::unpacker
             operator >> (e::unpacker up, slice& rhs);
         friend e::unpacker
-            operator >> (e::unpacker up, e::intrusive_ptr<slice>& rhs);
-        friend e::unpacker 
             operator >> (e::unpacker up, vblock& rhs);
-        friend e::unpacker 
-            operator >> (e::unpacker up, e::intrusive_ptr<vblock>& rhs);
-        friend std::ostream& 
-            operator << (std::ostream& lhs, const e::intrusive_ptr<vblock::slice>& rhs);
-        friend e::buffer::packer 
-            operator << (e::buffer::packer pa, const e::intrusive_ptr<vblock>& rhs);
-        friend e::buffer::packer 
-            operator << (e::buffer::packer pa, const e::intrusive_ptr<vblock::slice>& rhs);
      private:
-        size_t m_ref;
         size_t m_offset;
         size_t m_length;
         size_t m_disk_offset;
+        uint32_t m_device;
+        bool m_checksummed;
+        uint32_t m_crc;
+        uint8_t m_codec;
+        uint32_t m_stored;
+        uint32_t m_skip;
 };
         
+// Searches an encoded offset map in place.  The view does not own the bytes
+// it points at.
+class vblock_view
+{
+    public:
+        vblock_view();
+
+    public:
+        bool parse(const uint8_t* data, size_t sz);
+        size_t size() const { return m_count; }
+        vblock::slice slice_at(size_t idx) const;
+        size_t find(size_t offset) const;
+        uint64_t length() const;
+
+    private:
+        const uint8_t* m_table;
+        size_t m_width;
+        size_t m_count;
+};
+
 template <typename T>
     std::ostream&
 operator << (std::ostream& lhs, const std::vector<T>& rhs)
@@ -142,150 +231,157 @@ operator << (std::ostream& lhs, const std::vector<T>& rhs)
     {
         if (i > 0)
         {
-            lhs << " " << rhs;
+            lhs << " " << rhs[i];
         }
         else
         {
-            lhs << rhs;
+            lhs << rhs[i];
         }
     }
 
     return lhs;
 }
 
-inline std::ostream& 
-operator << (std::ostream& lhs, const wtf::vblock& rhs) 
+//SLICE SERIALIZATION
+inline e::buffer::packer 
+operator << (e::buffer::packer pa, const vblock::slice& rhs) 
 { 
-    lhs << "vblock(slices=[";
+    uint32_t device = (rhs.m_device & vblock::slice::DEVICE_MASK)
+                    | (uint32_t(rhs.m_codec) << vblock::slice::CODEC_SHIFT)
+                    | (rhs.m_checksummed ? vblock::slice::CHECKSUMMED : 0);
+    pa = pa << rhs.m_offset << rhs.m_length << rhs.m_disk_offset
+            << device << rhs.m_crc << rhs.m_stored << rhs.m_skip;
+    return pa;
+} 
 
-    bool first = true;
+// Reads only the base fields; the rest are read by the map's unpacker when the
+// entries are wide enough to hold them.
+inline e::unpacker 
+operator >> (e::unpacker up, vblock::slice& rhs) 
+{ 
+    up = up >> rhs.m_offset >> rhs.m_length >> rhs.m_disk_offset;
+    rhs.m_device = 0;
+    rhs.clear_crc();
+    rhs.set_compression(0, 0, 0);
+    return up; 
+} 
 
-    for (vblock::slice_map::const_iterator it = rhs.m_slice_map.begin();
-            it != rhs.m_slice_map.end(); ++it)
-    {
-        if(!first)
-        {
-            lhs << ",";
-            first = false;
-        }
+inline std::ostream& 
+operator << (std::ostream& lhs, const vblock::slice& rhs) 
+{ 
+    lhs << "slice(" << rhs.m_offset << "," << rhs.m_length << "," << rhs.m_disk_offset
+        << "@" << rhs.m_device;
 
-        lhs << it->second;
+    if (rhs.m_checksummed)
+    {
+        lhs << " crc=" << rhs.m_crc;
     }
 
-    lhs << "])";
-
+    lhs << ")";
     return lhs;
 } 
 
 inline std::ostream& 
-operator << (std::ostream& lhs, const e::intrusive_ptr<vblock>& rhs) 
+operator << (std::ostream& lhs, const wtf::vblock& rhs) 
 { 
     lhs << "vblock(slices=[";
 
-    bool first = true;
-
-    for (vblock::slice_map::const_iterator it = rhs->m_slice_map.begin();
-            it != rhs->m_slice_map.end(); ++it)
+    for (size_t i = 0; i < rhs.m_slices.size(); ++i)
     {
-        if(!first)
+        if (i > 0)
         {
             lhs << ",";
-            first = false;
         }
 
-        lhs << it->second;
+        lhs << rhs.m_slices[i];
     }
 
     lhs << "])";
 
-    return lhs;
-}
-
-//SLICE SERIALIZATION
-inline e::buffer::packer 
-operator << (e::buffer::packer pa, const e::intrusive_ptr<vblock::slice>& rhs) 
-{ 
-    pa = pa << rhs->m_offset << rhs->m_length << rhs->m_disk_offset;
-    return pa;
-} 
-
-inline e::buffer::packer 
-operator << (e::buffer::packer pa, const vblock::slice& rhs) 
-{ 
-    pa = pa << rhs.m_offset << rhs.m_length << rhs.m_disk_offset;
-    return pa;
-} 
-
-inline e::unpacker 
-operator >> (e::unpacker up, vblock::slice& rhs) 
-{ 
-    up = up >> rhs.m_offset >> rhs.m_length >> rhs.m_disk_offset;
-    return up; 
-} 
-
-inline e::unpacker 
-operator >> (e::unpacker up, e::intrusive_ptr<vblock::slice>& rhs) 
-{ 
-    up = up >> rhs->m_offset >> rhs->m_length >> rhs->m_disk_offset;
-    return up; 
-}
-
-inline std::ostream& 
-operator << (std::ostream& lhs, const vblock::slice& rhs) 
-{ 
-    lhs << "slice(" << rhs.m_offset << "," << rhs.m_length << "," << rhs.m_disk_offset << ")";
     return lhs;
 } 
 
 inline std::ostream& 
-operator << (std::ostream& lhs, const e::intrusive_ptr<vblock::slice>& rhs) 
+operator << (std::ostream& lhs, const e::intrusive_ptr<vblock>& rhs) 
 { 
-    lhs << "slice(" << rhs->m_offset << "," << rhs->m_length << "," << rhs->m_disk_offset << ")";
-    return lhs;
+    return lhs << *rhs;
 }
 
 //VBLOCK SERIALIZATION
 inline e::buffer::packer 
-operator << (e::buffer::packer pa, const e::intrusive_ptr<vblock>& rhs) 
+operator << (e::buffer::packer pa, const vblock& rhs) 
 { 
-    uint64_t size = rhs->m_slice_map.size();
-    pa = pa << size; 
+    uint8_t version = vblock::FORMAT_VERSION;
+    uint8_t width = vblock::slice::pack_size();
+    uint16_t reserved = 0;
+    uint32_t size = rhs.m_slices.size();
+    pa = pa << version << width << reserved << size;
 
-    for (vblock::slice_map::const_iterator it = rhs->m_slice_map.begin();
-            it != rhs->m_slice_map.end(); ++it)
+    for (size_t i = 0; i < rhs.m_slices.size(); ++i)
     {
-        pa = pa << it->second;
+        pa = pa << rhs.m_slices[i];
     }
 
     return pa;
 } 
 
 inline e::buffer::packer 
-operator << (e::buffer::packer pa, const vblock& rhs) 
+operator << (e::buffer::packer pa, const e::intrusive_ptr<vblock>& rhs) 
 { 
-    uint64_t size = rhs.m_slice_map.size();
-    pa = pa << size; 
-
-    for (vblock::slice_map::const_iterator it = rhs.m_slice_map.begin();
-            it != rhs.m_slice_map.end(); ++it)
-    {
-        pa = pa << it->second;
-    }
-
-    return pa;
+    return pa << *rhs;
 } 
 
 inline e::unpacker 
 operator >> (e::unpacker up, vblock& rhs) 
 { 
-    uint64_t size;
-    up = up >> size; 
+    e::slice rest(up.as_slice());
+    size_t header;
+    size_t width;
+    size_t size;
 
-    for (uint64_t i = 0; i < size; ++i)
+    if (up.error() ||
+        !vblock::parse_header(rest.data(), rest.size(), &header, &width, &size))
     {
-        e::intrusive_ptr<vblock::slice> s(new vblock::slice());
+        return up.as_error();
+    }
+
+    up = up.advance(header);
+    rhs.m_slices.clear();
+    rhs.m_slices.reserve(size);
+
+    for (size_t i = 0; i < size && !up.error(); ++i)
+    {
+        vblock::slice s;
+        size_t used = vblock::slice::BASE_PACK_SIZE;
         up = up >> s;
-        rhs.m_slice_map[s->m_offset] = s;
+
+        if (width >= vblock::slice::DEVICE_PACK_SIZE)
+        {
+            uint32_t device;
+            uint32_t crc;
+            up = up >> device >> crc;
+            s.m_device = device & vblock::slice::DEVICE_MASK;
+
+            if (device & vblock::slice::CHECKSUMMED)
+            {
+                s.set_crc(crc);
+            }
+
+            used += 2 * sizeof(uint32_t);
+
+            if (width >= vblock::slice::pack_size())
+            {
+                uint32_t stored;
+                uint32_t skip;
+                up = up >> stored >> skip;
+                s.set_compression((device >> vblock::slice::CODEC_SHIFT) &
+                                  vblock::slice::CODEC_MASK, stored, skip);
+                used += 2 * sizeof(uint32_t);
+            }
+        }
+
+        up = up.advance(width - used);
+        rhs.m_slices.push_back(s);
     }
 
     return up; 
@@ -294,17 +390,7 @@ operator >> (e::unpacker up, vblock& rhs)
 inline e::unpacker 
 operator >> (e::unpacker up, e::intrusive_ptr<vblock>& rhs) 
 { 
-    uint64_t sz;
-    up = up >> sz; 
-
-    for (uint64_t i = 0; i < sz; ++i)
-    {
-        e::intrusive_ptr<vblock::slice> s(new vblock::slice());
-        up = up >> s;
-        rhs->m_slice_map[s->m_disk_offset] = s;
-    }
-
-    return up; 
+    return up >> *rhs;
 }
 
 }
@@ -0,0 +1,180 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// Google Log
+#include <glog/logging.h>
+
+// WTF
+#include "blockstore/vblock_cache.h"
+
+using wtf::vblock_record;
+using wtf::vblock_cache;
+
+vblock_cache :: vblock_cache(size_t shards, size_t capacity)
+    : m_num_shards(shards)
+    , m_shard_capacity(capacity / shards)
+    , m_shards(new shard[shards])
+    , m_hits(0)
+    , m_misses(0)
+{
+}
+
+vblock_cache :: ~vblock_cache() throw ()
+{
+    delete[] m_shards;
+}
+
+bool
+vblock_cache :: get(uint64_t bid, e::intrusive_ptr<vblock_record>* rec, uint64_t* epoch)
+{
+    shard* s = get_shard(bid);
+    po6::threads::mutex::hold hold(&s->mtx);
+    index_t::iterator it = s->index.find(bid);
+
+    if (it == s->index.end())
+    {
+        *epoch = s->epoch;
+        __sync_fetch_and_add(&m_misses, 1);
+        return false;
+    }
+
+    entry& ent(s->entries[it->second]);
+    ent.referenced = true;
+    *rec = ent.rec;
+    __sync_fetch_and_add(&m_hits, 1);
+    return true;
+}
+
+void
+vblock_cache :: put(uint64_t bid, e::intrusive_ptr<vblock_record> rec, uint64_t epoch)
+{
+    size_t cost = 1 + rec->view().size();
+    shard* s = get_shard(bid);
+    po6::threads::mutex::hold hold(&s->mtx);
+
+    if (s->epoch != epoch || cost > m_shard_capacity ||
+        s->index.find(bid) != s->index.end())
+    {
+        return;
+    }
+
+    evict(s, cost);
+    size_t idx;
+
+    if (s->unused.empty())
+    {
+        idx = s->entries.size();
+        s->entries.push_back(entry());
+    }
+    else
+    {
+        idx = s->unused.back();
+        s->unused.pop_back();
+    }
+
+    entry& ent(s->entries[idx]);
+    ent.bid = bid;
+    ent.rec = rec;
+    ent.cost = cost;
+    ent.referenced = false;
+    s->index[bid] = idx;
+    s->used += cost;
+}
+
+void
+vblock_cache :: invalidate(uint64_t bid)
+{
+    shard* s = get_shard(bid);
+    po6::threads::mutex::hold hold(&s->mtx);
+    ++s->epoch;
+    index_t::iterator it = s->index.find(bid);
+
+    if (it != s->index.end())
+    {
+        remove(s, it->second);
+    }
+}
+
+void
+vblock_cache :: stat()
+{
+    uint64_t hits = this->hits();
+    uint64_t misses = this->misses();
+    size_t used = 0;
+    size_t entries = 0;
+
+    for (size_t i = 0; i < m_num_shards; ++i)
+    {
+        po6::threads::mutex::hold hold(&m_shards[i].mtx);
+        used += m_shards[i].used;
+        entries += m_shards[i].index.size();
+    }
+
+    LOG(INFO) << "vblock cache: hits=" << hits << " misses=" << misses
+              << " entries=" << entries << " slices=" << used
+              << "/" << m_shard_capacity * m_num_shards;
+}
+
+// Sweep the clock hand until there is room for need more slices.  Must be
+// called with the shard lock held.
+void
+vblock_cache :: evict(shard* s, size_t need)
+{
+    while (s->used + need > m_shard_capacity && !s->index.empty())
+    {
+        if (s->hand >= s->entries.size())
+        {
+            s->hand = 0;
+        }
+
+        entry& ent(s->entries[s->hand]);
+
+        if (ent.rec.get() != NULL)
+        {
+            if (ent.referenced)
+            {
+                ent.referenced = false;
+            }
+            else
+            {
+                remove(s, s->hand);
+            }
+        }
+
+        ++s->hand;
+    }
+}
+
+void
+vblock_cache :: remove(shard* s, size_t idx)
+{
+    entry& ent(s->entries[idx]);
+    s->index.erase(ent.bid);
+    s->used -= ent.cost;
+    ent = entry();
+    s->unused.push_back(idx);
+}
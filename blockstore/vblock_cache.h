@@ -0,0 +1,135 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef wtf_vblock_cache_h_
+#define wtf_vblock_cache_h_
+
+// STL
+#include <string>
+#include <tr1/unordered_map>
+#include <vector>
+
+// po6
+#include <po6/threads/mutex.h>
+
+// e
+#include <e/intrusive_ptr.h>
+
+// WTF
+#include "blockstore/vblock.h"
+
+namespace wtf __attribute__ ((visibility("hidden")))
+{
+    // An encoded offset map as read from LevelDB, searched in place through
+    // its view.  Records are immutable once parsed.
+    class vblock_record
+    {
+        public:
+            vblock_record() : m_ref(0), m_data(), m_view() {}
+
+        public:
+            std::string& data() { return m_data; }
+            bool parse() { return m_view.parse((const uint8_t*)m_data.data(), m_data.size()); }
+            const vblock_view& view() const { return m_view; }
+
+        private:
+            friend class e::intrusive_ptr<vblock_record>;
+            void inc() { __sync_add_and_fetch(&m_ref, 1); }
+            void dec() { assert(m_ref > 0); if (__sync_sub_and_fetch(&m_ref, 1) == 0) delete this; }
+
+        private:
+            size_t m_ref;
+            std::string m_data;
+            vblock_view m_view;
+
+        private:
+            vblock_record(const vblock_record&);
+            vblock_record& operator = (const vblock_record&);
+    };
+
+    // A cache of encoded offset maps, keyed by bid.  It is split into shards
+    // that each run CLOCK over their own entries, and is bounded by the total
+    // number of slices held rather than the number of maps.
+    //
+    // The contents of a bid never change, but the cleaner rewrites its disk
+    // offsets and the sweeper deletes it, so both invalidate the entry.  A
+    // miss hands back the shard's epoch; an insert is dropped if anything in
+    // the shard was invalidated since, so a fill racing with a remap can never
+    // install the stale map.
+    class vblock_cache
+    {
+        public:
+            vblock_cache(size_t shards, size_t capacity);
+            ~vblock_cache() throw ();
+
+        public:
+            bool get(uint64_t bid, e::intrusive_ptr<vblock_record>* rec, uint64_t* epoch);
+            void put(uint64_t bid, e::intrusive_ptr<vblock_record> rec, uint64_t epoch);
+            void invalidate(uint64_t bid);
+            uint64_t hits() { return __sync_fetch_and_add(&m_hits, 0); }
+            uint64_t misses() { return __sync_fetch_and_add(&m_misses, 0); }
+            void stat();
+
+        private:
+            struct entry
+            {
+                entry() : bid(0), rec(), cost(0), referenced(false) {}
+                uint64_t bid;
+                e::intrusive_ptr<vblock_record> rec;
+                size_t cost;
+                bool referenced;
+            };
+            typedef std::tr1::unordered_map<uint64_t, size_t> index_t;
+            struct shard
+            {
+                shard() : mtx(), index(), entries(), unused(), hand(0), used(0), epoch(0) {}
+                po6::threads::mutex mtx;
+                index_t index;
+                std::vector<entry> entries;
+                std::vector<size_t> unused;
+                size_t hand;
+                size_t used;
+                uint64_t epoch;
+            };
+            shard* get_shard(uint64_t bid) { return &m_shards[bid % m_num_shards]; }
+            void evict(shard* s, size_t need);
+            void remove(shard* s, size_t idx);
+
+        private:
+            size_t m_num_shards;
+            size_t m_shard_capacity;
+            shard* m_shards;
+            uint64_t m_hits;
+            uint64_t m_misses;
+
+        private:
+            vblock_cache(const vblock_cache&);
+            vblock_cache& operator = (const vblock_cache&);
+    };
+}
+
+#endif // wtf_vblock_cache_h_
@@ -93,6 +93,13 @@ wtf_client_destroy(wtf_client* client)
     delete reinterpret_cast<wtf::client*>(client);
 }
 
+WTF_API void
+wtf_client_set_chain_replication(wtf_client* _cl, int enable)
+{
+    wtf::client* cl = reinterpret_cast<wtf::client*>(_cl);
+    cl->set_chain_replication(enable != 0);
+}
+
 WTF_API const char*
 wtf_client_error_message(wtf_client* _cl)
 {
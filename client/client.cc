@@ -113,6 +113,7 @@ client :: client(const char* host, in_port_t port,
     , m_fds()
     , m_cwd("/")
     , m_addr()
+    , m_chain_replication(false)
 {
 	TRACE;
     busybee_discover(&m_addr);
@@ -251,6 +252,62 @@ client :: perform_aggregation(const std::vector<server_id>& servers,
     return op->client_visible_id();
 }
 
+// The request goes to the first server only and the servers pass it down the
+// chain themselves.  Server i answers under nonce + i: the last one once the
+// whole chain has applied the request, or whichever one could not pass it on.
+// A NOP registers the op with every server past the first, so that losing
+// any of them fails the op instead of leaving it waiting on the last.
+int64_t
+client :: perform_chain(const std::vector<server_id>& servers,
+                        e::intrusive_ptr<pending_aggregation> _op,
+                        wtf_network_msgtype mt,
+                        std::auto_ptr<e::buffer> msg,
+                        wtf_client_returncode* status)
+{
+    TRACE;
+    e::intrusive_ptr<pending_aggregation> op(_op.get());
+    uint64_t nonce = m_next_server_nonce;
+    m_next_server_nonce += servers.size();
+
+    for (size_t i = 1; i < servers.size(); ++i)
+    {
+        std::auto_ptr<e::buffer> nop(e::buffer::create(WTF_CLIENT_HEADER_SIZE_REQ));
+
+        if (!send(PACKET_NOP, servers[i], nonce + i, nop, op, status))
+        {
+            m_failed.push_back(pending_server_pair(servers[i], op));
+            return op->client_visible_id();
+        }
+    }
+
+    if (!send(mt, servers.front(), nonce, msg, op, status))
+    {
+        m_failed.push_back(pending_server_pair(servers.front(), op));
+    }
+
+    return op->client_visible_id();
+}
+
+// Stop expecting a reply from si on behalf of op.  Returns false if none was
+// expected.
+bool
+client :: forget(pending_aggregation* op, const server_id& si)
+{
+    TRACE;
+
+    for (pending_map_t::iterator it = m_pending_ops.begin();
+         it != m_pending_ops.end(); ++it)
+    {
+        if (it->second.si == si && it->second.op.get() == op)
+        {
+            m_pending_ops.erase(it);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 bool
 client :: send_nop(const server_id& to)
 {
@@ -264,6 +321,66 @@ client :: send_nop(const server_id& to)
     m_busybee.send(to.get(), msg);
 }
 
+bool
+client :: send_release(const server_id& to, const std::vector<uint64_t>& bids)
+{
+    TRACE;
+    uint32_t num_blocks = bids.size();
+    size_t sz = WTF_CLIENT_HEADER_SIZE_REQ
+        + sizeof(uint32_t) // number of blocks
+        + num_blocks * sizeof(uint64_t);
+    std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+    e::buffer::packer pa = msg->pack_at(BUSYBEE_HEADER_SIZE);
+    const uint8_t type = static_cast<uint8_t>(REQ_RELEASE);
+    pa = pa << type << m_next_server_nonce++ << num_blocks;
+
+    for (uint32_t i = 0; i < num_blocks; ++i)
+    {
+        pa = pa << bids[i];
+    }
+
+    m_busybee.set_timeout(-1);
+    return m_busybee.send(to.get(), msg) == BUSYBEE_SUCCESS;
+}
+
+// Tell the block servers that nothing references these blocks anymore.  This
+// must only be called once the metadata that dropped them has committed.  A
+// server that cannot be told keeps its blocks, and the failure is reported
+// through status.
+bool
+client :: release_blocks(const std::set<block_location>& locations,
+                         wtf_client_returncode* status)
+{
+    TRACE;
+    std::map<uint64_t, std::vector<uint64_t> > by_server;
+
+    for (std::set<block_location>::const_iterator it = locations.begin();
+         it != locations.end(); ++it)
+    {
+        if (*it == block_location())
+        {
+            continue;
+        }
+
+        by_server[it->si].push_back(it->bi);
+    }
+
+    bool released = true;
+
+    for (std::map<uint64_t, std::vector<uint64_t> >::iterator it = by_server.begin();
+         it != by_server.end(); ++it)
+    {
+        if (!send_release(server_id(it->first), it->second))
+        {
+            ERROR(SERVERERROR) << "could not release " << it->second.size()
+                               << " blocks on server " << it->first;
+            released = false;
+        }
+    }
+
+    return released;
+}
+
 bool
 client :: send(wtf_network_msgtype mt,
                const server_id& to,
@@ -36,6 +36,7 @@
 
 // STL
 #include <map>
+#include <set>
 #include <vector>
 #include <string>
 #include <memory>
@@ -116,6 +117,7 @@ class client
         int64_t opendir(const char* path);
         int64_t closedir(int fd);
         int64_t readdir(const char* path, char** entry, wtf_client_returncode* status);
+        void set_chain_replication(bool enable) { m_chain_replication = enable; }
         const char* error_message();
         const char* error_location();
         void set_error_message(const char* msg);
@@ -170,6 +172,9 @@ class client
     private:
         bool maintain_coord_connection(wtf_client_returncode* status);
         bool send_nop(const server_id& to);
+        bool send_release(const server_id& to, const std::vector<uint64_t>& bids);
+        bool release_blocks(const std::set<block_location>& locations,
+                            wtf_client_returncode* status);
         bool send(wtf_network_msgtype mt,
                   const server_id& to,
                   uint64_t nonce,
@@ -182,6 +187,12 @@ class client
                               wtf_network_msgtype mt,
                               std::auto_ptr<e::buffer> msg,
                               wtf_client_returncode* status);
+        int64_t perform_chain(const std::vector<server_id>& servers,
+                              e::intrusive_ptr<pending_aggregation> _op,
+                              wtf_network_msgtype mt,
+                              std::auto_ptr<e::buffer> msg,
+                              wtf_client_returncode* status);
+        bool forget(pending_aggregation* op, const server_id& si);
 
         void prepare_write_op(e::intrusive_ptr<file> f, 
                               size_t& rem, 
@@ -251,6 +262,7 @@ class client
         file_map_t m_fds;
         std::string m_cwd;
         po6::net::ipaddr m_addr;
+        bool m_chain_replication;
 };
 
 std::ostream&
@@ -38,4 +38,8 @@
                                       + sizeof(uint8_t) /*mt*/ \
                                       + sizeof(uint64_t) /*nonce*/)
 
+// A read sends each server at most this much per REQ_MULTIGET.
+#define WTF_MULTIGET_MAX_EXTENTS 256
+#define WTF_MULTIGET_MAX_BYTES (16ULL * 1024ULL * 1024ULL)
+
 #endif // wtf_client_constants_h_
@@ -134,6 +134,18 @@ file :: length() const
     return m_block_map.length();
 }
 
+void
+file :: block_locations(std::set<block_location>* locations) const
+{
+    m_block_map.block_locations(locations);
+}
+
+std::vector<wtf::slice>
+file :: slices(uint64_t offset, uint64_t length)
+{
+    return m_block_map.get_slices(offset, length);
+}
+
 std::auto_ptr<e::buffer>
 file :: serialize_blockmap()
 {
@@ -34,6 +34,7 @@
 // STL
 #include <vector>
 #include <map>
+#include <set>
 
 //PO6
 #include <po6/pathname.h>
@@ -74,6 +75,8 @@ class file
         uint64_t offset() { return m_offset; }
         uint64_t pack_size();
         uint64_t length() const;
+        void block_locations(std::set<block_location>* locations) const;
+        std::vector<wtf::slice> slices(uint64_t offset, uint64_t length);
         std::auto_ptr<e::buffer> serialize_blockmap();
         void truncate(size_t length);
         size_t block_size() { return m_block_size; }
@@ -50,7 +50,7 @@ pending_read :: pending_read(client* cl, uint64_t id, e::intrusive_ptr<file> f,
     , m_file(f)
     , m_done(false)
     , m_state(0)
-    , m_offset_map()
+    , m_extent_map()
 {
     set_status(WTF_CLIENT_SUCCESS);
     set_error(e::error());
@@ -87,29 +87,92 @@ pending_read :: handle_wtf_failure(const server_id& si)
 bool
 pending_read :: handle_wtf_message(client* cl,
                                     const server_id& si,
-                                    std::auto_ptr<e::buffer>,
+                                    std::auto_ptr<e::buffer> msg,
                                     e::unpacker up,
                                     wtf_client_returncode* status,
                                     e::error* err)
 {
+    uint8_t mt = 0;
+
+    if (msg.get())
+    {
+        msg->unpack_from(BUSYBEE_HEADER_SIZE) >> mt;
+    }
+
     bool handled = pending_aggregation::handle_wtf_message(cl, si, std::auto_ptr<e::buffer>(), up, status, err);
     assert(handled);
 
     *status = WTF_CLIENT_SUCCESS;
     *err = e::error();
 
-    /* Put data in client's buffer. */
+    if (mt == RESP_MULTIGET)
+    {
+        return handle_multiget(si, up);
+    }
+
+    /* A whole-block REQ_GET, as rereplicate sends: the block goes at the
+     * start of the buffer.  Reads of file data all go through REQ_MULTIGET. */
     uint64_t bi;
     response_returncode rc;
     up = up >> rc >> bi;
-    struct buffer_block_len bbl = m_offset_map[std::make_pair(si.get(), bi)];
     e::slice data = up.as_slice();
-    size_t len = std::min(data.size() - bbl.block_offset, m_max_buf_sz - bbl.buf_offset);
-    memmove(m_buf + bbl.buf_offset, data.data() + bbl.block_offset, len); 
+
+    if (rc != RESPONSE_SUCCESS)
+    {
+        PENDING_ERROR(SERVERERROR) << "server " << si << " could not read block " << bi;
+        return true;
+    }
+
+    size_t len = std::min(data.size(), m_max_buf_sz);
+    memmove(m_buf, data.data(), len); 
     *m_buf_sz += len; 
     return true;
 }
 
+bool
+pending_read :: handle_multiget(const server_id& si, e::unpacker up)
+{
+    response_returncode rc;
+    uint32_t count;
+    up = up >> rc >> count;
+
+    if (up.error() || rc != RESPONSE_SUCCESS)
+    {
+        PENDING_ERROR(SERVERERROR) << "server " << si << " could not read blocks";
+        return true;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint64_t bi;
+        uint32_t offset;
+        uint32_t len;
+        up = up >> bi >> offset >> len;
+
+        if (up.error() || up.remain() < len)
+        {
+            PENDING_ERROR(SERVERERROR) << "server " << si << " sent a short multi-get reply";
+            return true;
+        }
+
+        extent_map_t::iterator it = m_extent_map.find(
+                std::make_pair(std::make_pair(si.get(), bi), uint64_t(offset)));
+
+        if (it != m_extent_map.end())
+        {
+            const buffer_block_len& bbl(it->second);
+            size_t n = std::min<size_t>(len, bbl.len);
+            n = std::min(n, m_max_buf_sz - bbl.buf_offset);
+            memmove(m_buf + bbl.buf_offset, up.as_slice().data(), n);
+            *m_buf_sz += n;
+        }
+
+        up = up.advance(len);
+    }
+
+    return true;
+}
+
 bool
 pending_read :: try_op()
 {
@@ -147,23 +210,58 @@ pending_read :: handle_hyperdex_message(client* cl,
         size_t attrs_sz = msg->attrs_sz();
         parse_metadata(attrs, attrs_sz);
         size_t rem = std::min(*m_buf_sz, m_file->length() - m_file->offset());
+        std::vector<wtf::slice> slices = m_file->slices(m_file->offset(), rem);
 
         size_t buf_offset = 0;
         *m_buf_sz = 0;
+        // Extents bound for each server, sent a batch at a time.
+        std::map<uint64_t, std::vector<get_extent> > batches;
+        std::map<uint64_t, size_t> batch_bytes;
+
+        for (size_t i = 0; i < slices.size() && rem > 0; ++i)
+        {
+            size_t len = std::min<uint64_t>(slices[i].length, rem);
+
+            if (slices[i].location.empty())
+            {
+                // A hole in the file; nothing to fetch.
+                memset(m_buf + buf_offset, 0, len);
+                *m_buf_sz += len;
+            }
+            else
+            {
+                // Any replica will do.  The server returns just the bytes of
+                // the slice.
+                const block_location& bl = slices[i].location[0];
+                std::vector<get_extent>& batch(batches[bl.si]);
+
+                if (!batch.empty() &&
+                    (batch.size() >= WTF_MULTIGET_MAX_EXTENTS ||
+                     batch_bytes[bl.si] + len > WTF_MULTIGET_MAX_BYTES))
+                {
+                    send_multiget(bl.si, batch, status);
+                    batch.clear();
+                    batch_bytes[bl.si] = 0;
+                }
+
+                batch.push_back(get_extent(bl.bi, slices[i].offset, len));
+                batch_bytes[bl.si] += len;
+                m_extent_map[std::make_pair(std::make_pair(bl.si, bl.bi),
+                                            slices[i].offset)] =
+                    buffer_block_len(buf_offset, 0, len);
+            }
+
+            buf_offset += len;
+            rem -= len;
+        }
 
-        while(rem > 0)
+        for (std::map<uint64_t, std::vector<get_extent> >::iterator it = batches.begin();
+                it != batches.end(); ++it)
         {
-            block_location bl;
-            uint32_t block_length;
-            std::vector<server_id> servers;
-            //m_cl->prepare_read_op(m_file, rem, buf_offset, bl, block_length, this, servers);
-            size_t sz = WTF_CLIENT_HEADER_SIZE_REQ
-                + sizeof(uint64_t) // bl.bi (local block number) 
-                + sizeof(uint32_t); //block_length
-            std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
-            msg->pack_at(WTF_CLIENT_HEADER_SIZE_REQ) << bl.bi << block_length;
-
-            m_cl->perform_aggregation(servers, this, REQ_GET, msg, status);
+            if (!it->second.empty())
+            {
+                send_multiget(it->first, it->second, status);
+            }
         }
 
         pending_aggregation::handle_hyperdex_message(cl, reqid, rc, status, err);
@@ -178,6 +276,28 @@ pending_read :: handle_hyperdex_message(client* cl,
     return true;
 }
 
+void
+pending_read :: send_multiget(uint64_t si, const std::vector<get_extent>& exts,
+                              wtf_client_returncode* status)
+{
+    std::vector<server_id> servers(1, server_id(si));
+    size_t sz = WTF_CLIENT_HEADER_SIZE_REQ
+        + sizeof(uint32_t) // count
+        + exts.size() * (sizeof(uint64_t)   // local block number
+                       + sizeof(uint32_t)   // block offset
+                       + sizeof(uint32_t)); // length
+    std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+    e::buffer::packer pa = msg->pack_at(WTF_CLIENT_HEADER_SIZE_REQ);
+    pa = pa << static_cast<uint32_t>(exts.size());
+
+    for (size_t i = 0; i < exts.size(); ++i)
+    {
+        pa = pa << exts[i].bi << exts[i].offset << exts[i].len;
+    }
+
+    m_cl->perform_aggregation(servers, this, REQ_MULTIGET, msg, status);
+}
+
 void
 pending_read :: parse_metadata(const hyperdex_client_attribute* attrs, size_t attrs_sz)
 {
@@ -222,13 +342,3 @@ pending_read :: parse_metadata(const hyperdex_client_attribute* attrs, size_t at
         }
     }
 } 
-
-void 
-pending_read :: set_offset(const uint64_t si,
-                const uint64_t bi,
-                const size_t buf_offset,   //offset in client buffer
-                const size_t block_offset, //offset from start of block
-                const size_t len)         //how many bytes to copy
-{
-    m_offset_map[std::make_pair(si, bi)] = buffer_block_len(buf_offset, block_offset, len);
-}
@@ -70,17 +70,26 @@ class pending_read : public pending_aggregation
                                     e::error* error);
         virtual bool try_op();
 
-    public:
-        void set_offset(const uint64_t si, const uint64_t bi, const size_t buf_offset,
-                   const size_t block_offset, const size_t len);
-
     // noncopyable
     private:
         pending_read(const pending_read& other);
         pending_read& operator = (const pending_read& rhs);
 
+    private:
+        struct get_extent
+        {
+            get_extent(uint64_t b, uint32_t o, uint32_t l)
+                : bi(b), offset(o), len(l) {}
+            uint64_t bi;
+            uint32_t offset;
+            uint32_t len;
+        };
+
     private:
         void parse_metadata(const hyperdex_client_attribute* attrs, size_t attrs_sz);
+        void send_multiget(uint64_t si, const std::vector<get_extent>& exts,
+                           wtf_client_returncode* status);
+        bool handle_multiget(const server_id& si, e::unpacker up);
 
     private:
         struct buffer_block_len 
@@ -93,18 +102,20 @@ class pending_read : public pending_aggregation
                 : buf_offset(bu), block_offset(bl), len(l) {}
             ~buffer_block_len() throw () {}
             size_t buf_offset;   //offset in client buffer
-            size_t block_offset; //offset from start of block
+            size_t block_offset; //offset of the wanted bytes in the reply
             size_t len;         //how many bytes to copy
         };
 
-        typedef std::map<std::pair<uint64_t, uint64_t>, struct buffer_block_len> offset_map_t;
+        // keyed by ((server, block), offset in block)
+        typedef std::map<std::pair<std::pair<uint64_t, uint64_t>, uint64_t>,
+                         struct buffer_block_len> extent_map_t;
 
     private:
         client* m_cl;
         char* m_buf;
         size_t* m_buf_sz;
         size_t m_max_buf_sz;
-        offset_map_t m_offset_map;
+        extent_map_t m_extent_map;
         e::intrusive_ptr<file> m_file;
         std::string m_path;
         bool m_done;
@@ -25,6 +25,10 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+// STL
+#include <algorithm>
+#include <iterator>
+
 //hyperdex
 #include <hyperdex/client.hpp>
 
@@ -46,6 +50,7 @@ pending_truncate :: pending_truncate(client* cl, int64_t client_visible_id,
     , m_length(length)
     , m_done(false)
     , m_changeset()
+    , m_old_locations()
 {
     TRACE;
     set_status(WTF_CLIENT_SUCCESS);
@@ -98,6 +103,18 @@ pending_truncate :: handle_hyperdex_message(client* cl,
     {
         PENDING_ERROR(SERVERERROR) << "hyperdex returned " << rc;
     }
+    else
+    {
+        // Release whatever the truncated file no longer references.
+        std::set<block_location> current;
+        std::set<block_location> superseded;
+        m_file->block_locations(&current);
+        std::set_difference(m_old_locations.begin(), m_old_locations.end(),
+                            current.begin(), current.end(),
+                            std::inserter(superseded, superseded.begin()));
+        m_old_locations.clear();
+        m_cl->release_blocks(superseded, status);
+    }
 
     return true;
 }
@@ -189,6 +206,8 @@ pending_truncate :: do_op()
     std::vector<block_location> bl;
     uint64_t file_offset; 
 
+    m_old_locations.clear();
+    m_file->block_locations(&m_old_locations);
     m_file->truncate(m_length);
 
     if (bl[0] != block_location())
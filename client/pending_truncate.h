@@ -30,6 +30,7 @@
 
 // STL
 #include <map>
+#include <set>
 
 // WTF
 #include "client/pending_aggregation.h"
@@ -85,6 +86,7 @@ class pending_truncate : public pending_aggregation
         off_t m_length;
         bool m_done;
         changeset_t m_changeset;
+        std::set<block_location> m_old_locations;
 };
 
 }
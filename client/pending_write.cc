@@ -25,6 +25,10 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+// STL
+#include <algorithm>
+#include <iterator>
+
 //hyperdex
 #include <hyperdex/client.hpp>
 
@@ -56,6 +60,7 @@ pending_write :: pending_write(client* cl, uint64_t id, e::intrusive_ptr<file> f
     , m_old_blockmap(f->serialize_blockmap())
     , m_file(f)
     , m_changeset()
+    , m_old_locations()
     , m_done(false)
     , m_state(0)
     , m_next(NULL)
@@ -104,22 +109,42 @@ pending_write :: handle_wtf_failure(const server_id& si)
     TRACE;
     PENDING_ERROR(RECONFIGURE) << "reconfiguration affecting "
                                << si;
+
+    if (m_cl->m_chain_replication)
+    {
+        forget_chain();
+    }
+
     return pending_aggregation::handle_wtf_failure(si);
 }
 
 bool
 pending_write :: handle_wtf_message(client* cl,
                                     const server_id& si,
-                                    std::auto_ptr<e::buffer>,
+                                    std::auto_ptr<e::buffer> msg,
                                     e::unpacker up,
                                     wtf_client_returncode* status,
                                     e::error* err)
 {
+    uint8_t mt = 0;
+
+    if (msg.get())
+    {
+        msg->unpack_from(BUSYBEE_HEADER_SIZE) >> mt;
+    }
+
     if(m_deferred)
     std::cout << "Handling wtf message from deferred op at " << m_file_offset << std::endl;
     bool handled = pending_aggregation::handle_wtf_message(cl, si, std::auto_ptr<e::buffer>(), up, status, err);
     assert(handled);
 
+    if (mt == RESP_CHAIN_UPDATE)
+    {
+        *status = WTF_CLIENT_SUCCESS;
+        *err = e::error();
+        return handle_chain_reply(up);
+    }
+
     /* 
      * We take these messages until the last one is received, then request to update
      * the metadata from hyperdex.
@@ -167,6 +192,73 @@ pending_write :: handle_wtf_message(client* cl,
     return true;
 }
 
+// The tail of a replication chain reports every replica's block at once, as
+// does a replica that could not pass the request on.  Replicas that failed
+// are left out of the metadata.
+bool
+pending_write :: handle_chain_reply(e::unpacker up)
+{
+    forget_chain();
+    response_returncode rc;
+    uint64_t file_offset;
+    uint32_t num_replicas;
+    up = up >> rc >> file_offset >> num_replicas;
+    e::intrusive_ptr<block> bl;
+
+    for (uint32_t i = 0; !up.error() && i < num_replicas; ++i)
+    {
+        response_returncode replica_rc;
+        block_location loc;
+        uint64_t block_length;
+        up = up >> replica_rc >> loc >> block_length;
+
+        if (up.error() || replica_rc != RESPONSE_SUCCESS)
+        {
+            continue;
+        }
+
+        if (!bl.get())
+        {
+            bl = new block(block_length, file_offset, 0);
+            bl->set_length(block_length);
+            bl->set_offset(file_offset);
+            m_changeset[file_offset] = bl;
+        }
+
+        bl->add_replica(loc);
+    }
+
+    if (up.error() || !bl.get())
+    {
+        PENDING_ERROR(SERVERERROR) << "no replica could write the block at offset " << file_offset;
+        return true;
+    }
+
+    if (this->aggregation_done())
+    {
+        apply_metadata_update_locally();
+        send_metadata_update(); 
+    }
+
+    return true;
+}
+
+// One reply or one failure settles the whole chain; stop waiting on the
+// replicas that were registered only to notice a failure.
+void
+pending_write :: forget_chain()
+{
+    for (size_t i = 0; i < m_block_locations.size(); ++i)
+    {
+        server_id si(m_block_locations[i].si);
+
+        if (m_cl->forget(this, si))
+        {
+            pending_aggregation::handle_wtf_failure(si);
+        }
+    }
+}
+
 bool
 pending_write :: send_data()
 {
@@ -176,6 +268,43 @@ pending_write :: send_data()
 
     uint32_t num_replicas = m_block_locations.size();
 
+    if (m_cl->m_chain_replication)
+    {
+        // Each replica fills in its own result slot on the way down.
+        size_t sz = WTF_CLIENT_HEADER_SIZE_REQ
+            + sizeof(uint64_t) // m_token
+            + sizeof(uint32_t) // number of block locations
+            + num_replicas*block_location::pack_size()
+            + sizeof(uint64_t) // file_offset 
+            + num_replicas*(pack_size(RESPONSE_SUCCESS) // result slots
+                            + sizeof(uint64_t)
+                            + sizeof(uint64_t))
+            + m_data.size();     // user data 
+        std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+        e::buffer::packer pa = msg->pack_at(WTF_CLIENT_HEADER_SIZE_REQ);
+        pa = pa << m_cl->m_token << num_replicas;
+        std::vector<server_id> servers;
+
+        for (int i = 0; i < num_replicas; ++i)
+        {
+            pa = pa << m_block_locations[i];
+            servers.push_back(server_id(m_block_locations[i].si));
+        }
+
+        pa = pa << m_file_offset;
+
+        for (int i = 0; i < num_replicas; ++i)
+        {
+            pa = pa << RESPONSE_SERVER_ERROR << uint64_t(0) << uint64_t(0);
+        }
+
+        pa.copy(m_data);
+        wtf_client_returncode status;
+        m_cl->perform_chain(servers, this, REQ_CHAIN_UPDATE, msg, &status);
+        m_state = 1;
+        return true;
+    }
+
     size_t sz = WTF_CLIENT_HEADER_SIZE_REQ
         + sizeof(uint64_t) // m_token
         + sizeof(uint32_t) // number of block locations
@@ -300,11 +429,24 @@ pending_write :: handle_hyperdex_message(client* cl,
         
         if (rc != HYPERDEX_CLIENT_SUCCESS  || msg->status() != HYPERDEX_CLIENT_SUCCESS)
         {
+            // The blocks written by this attempt never made it into the
+            // metadata, so nobody else can be referencing them.
+            std::set<block_location> orphans;
+
+            for (changeset_t::iterator it = m_changeset.begin();
+                 it != m_changeset.end(); ++it)
+            {
+                std::vector<block_location> bl = it->second->blocks();
+                orphans.insert(bl.begin(), bl.end());
+            }
+
+            m_cl->release_blocks(orphans, status);
             m_retry = true;
             get_new_metadata();
         }
         else
         {
+            release_superseded_blocks(status);
             m_buffer_descriptor->remove_op();
             m_buffer_descriptor->print();
 
@@ -328,9 +470,25 @@ typedef struct hyperdex_client_attribute* attr_t;
 void
 pending_write :: apply_metadata_update_locally()
 {
+    m_old_locations.clear();
+    m_file->block_locations(&m_old_locations);
     m_file->apply_changeset(m_changeset);
 }
 
+// Release the blocks that the committed metadata no longer references.
+void
+pending_write :: release_superseded_blocks(wtf_client_returncode* status)
+{
+    std::set<block_location> current;
+    std::set<block_location> superseded;
+    m_file->block_locations(&current);
+    std::set_difference(m_old_locations.begin(), m_old_locations.end(),
+                        current.begin(), current.end(),
+                        std::inserter(superseded, superseded.begin()));
+    m_old_locations.clear();
+    m_cl->release_blocks(superseded, status);
+}
+
 void
 pending_write :: send_metadata_update()
 {
@@ -30,6 +30,7 @@
 
 // STL
 #include <map>
+#include <set>
 
 // WTF
 #include "client/pending_aggregation.h"
@@ -83,7 +84,10 @@ class pending_write : public pending_aggregation
     private:
         void send_metadata_update();
         void apply_metadata_update_locally();
+        void release_superseded_blocks(wtf_client_returncode* status);
         bool send_data();
+        bool handle_chain_reply(e::unpacker up);
+        void forget_chain();
         void prepare_write_op(e::intrusive_ptr<file> f, 
                               size_t& rem, 
                               std::vector<block_location>& bl,
@@ -111,6 +115,7 @@ class pending_write : public pending_aggregation
         std::string m_path;
         std::auto_ptr<e::buffer> m_old_blockmap;
         changeset_t m_changeset;
+        std::set<block_location> m_old_locations;
         bool m_done;
         int m_state;
         e::intrusive_ptr<pending_write> m_next;
@@ -339,6 +339,17 @@ interval_map :: length() const
     return it->first + it->second.length;
 }
 
+// Every block location referenced anywhere in the map.
+void
+interval_map :: block_locations(std::set<block_location>* locations) const
+{
+    for (std::map<uint64_t, slice>::const_iterator it = slice_map.begin();
+         it != slice_map.end(); ++it)
+    {
+        locations->insert(it->second.location.begin(), it->second.location.end());
+    }
+}
+
 uint64_t
 slice :: pack_size()
 {
@@ -2,6 +2,7 @@
 #define interval_map_h_
 #include <stdint.h>
 #include <map>
+#include <set>
 #include <vector>
 #include "common/block_location.h"
 #include <e/buffer.h>
@@ -86,6 +87,7 @@ class interval_map
                     wtf::slice& slc);
         void truncate(uint64_t length);
         uint64_t length() const;
+        void block_locations(std::set<block_location>* locations) const;
         std::vector<slice> get_slices
           (uint64_t request_address, uint64_t request_length);
         void clear();
@@ -39,8 +39,18 @@ wtf :: operator << (std::ostream& lhs, wtf_network_msgtype rhs)
     {
         STRINGIFY(REQ_GET);
         STRINGIFY(RESP_GET);
+        STRINGIFY(REQ_TRUNCATE);
+        STRINGIFY(RESP_TRUNCATE);
+        STRINGIFY(REQ_RELEASE);
+        STRINGIFY(REQ_REPAIR);
+        STRINGIFY(RESP_REPAIR);
         STRINGIFY(REQ_PUT);
         STRINGIFY(RESP_PUT);
+        STRINGIFY(REQ_GET_RANGE);
+        STRINGIFY(REQ_MULTIGET);
+        STRINGIFY(RESP_MULTIGET);
+        STRINGIFY(REQ_CHAIN_UPDATE);
+        STRINGIFY(RESP_CHAIN_UPDATE);
         STRINGIFY(REQ_UPDATE);
         STRINGIFY(RESP_UPDATE);
         STRINGIFY(PACKET_NOP);
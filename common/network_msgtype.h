@@ -40,9 +40,17 @@ enum wtf_network_msgtype
     RESP_GET = 9,
     REQ_TRUNCATE = 10,
     RESP_TRUNCATE = 11,
+    REQ_RELEASE = 12,
+    REQ_REPAIR = 14,
+    RESP_REPAIR = 15,
 
     REQ_PUT = 16,
     RESP_PUT = 17,
+    REQ_GET_RANGE = 18, /* answered with RESP_GET */
+    REQ_MULTIGET = 20,
+    RESP_MULTIGET = 21,
+    REQ_CHAIN_UPDATE = 22,
+    RESP_CHAIN_UPDATE = 23,
 
     REQ_UPDATE = 32,
     RESP_UPDATE = 33,
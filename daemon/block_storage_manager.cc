@@ -38,12 +38,31 @@
 #include <unistd.h>
 
 //C++
+#include <algorithm>
 #include <sstream>
+#include <tr1/functional>
 
 // WTF
 #include "daemon/block_storage_manager.h"
 #include "blockstore/blockmap.h"
 
+// How long the background thread sleeps between maintenance passes.
+#define BACKGROUND_INTERVAL_MS 1000
+
+// How many bytes the scrubber reads back per pass, which caps the share of
+// disk bandwidth it takes.
+#define SCRUB_BYTES_PER_PASS (32ULL * 1024ULL * 1024ULL)
+
+// A stream's readahead window starts here once two reads in a row land next to
+// each other in the log, and doubles with every further sequential read.
+#define PREFETCH_MIN_WINDOW (256ULL * 1024ULL)
+#define PREFETCH_MAX_WINDOW (8ULL * 1024ULL * 1024ULL)
+// How far past the end of the last read the next one may start and still
+// count as sequential, to step over record headers and padding.
+#define PREFETCH_SLACK (64ULL * 1024ULL)
+// Streams beyond twice this many make the least recently used ones go.
+#define PREFETCH_STREAMS 1024
+
 using wtf::block_storage_manager;
 using wtf::blockmap;
 
@@ -51,6 +70,11 @@ block_storage_manager::block_storage_manager()
     : m_prefix()
     , m_last_block_num()
     , m_blockmap()
+    , m_background()
+    , m_shutdown(0)
+    , m_streams_mtx()
+    , m_streams()
+    , m_stream_tick(0)
 {
 }
 
@@ -61,29 +85,57 @@ block_storage_manager::~block_storage_manager()
     void
 block_storage_manager::shutdown()
 {
+    __sync_fetch_and_add(&m_shutdown, 1);
+
+    if (m_background.get())
+    {
+        m_background->join();
+        m_background.reset();
+    }
+
+    m_blockmap.checkpoint();
 }
 
     void
 block_storage_manager::setup(uint64_t sid,
         const po6::pathname path,
-        const po6::pathname backing_path)
+        const std::vector<po6::pathname>& backing_paths,
+        bool sync,
+        size_t shards,
+        const std::string& backend,
+        const std::string& codec,
+        bool dedup,
+        bool preallocate)
 {
 
     m_prefix = sid;
     m_last_block_num = 0;
 
-    if (!m_blockmap.setup(path, backing_path))
+    if (!m_blockmap.setup(path, backing_paths, shards, backend, preallocate))
+    {
+        abort();
+    }
+
+    m_blockmap.set_sync(sync);
+    m_blockmap.set_dedup(dedup);
+
+    if (!m_blockmap.set_codec(codec))
     {
         abort();
     }
+
+    m_background.reset(new po6::threads::thread(
+                std::tr1::bind(&block_storage_manager::background, this)));
+    m_background->start();
 }
 
     ssize_t
 block_storage_manager::write_block(const e::slice& data,
         uint64_t& sid,
-        uint64_t& bid)
+        uint64_t& bid,
+        const blockmap::origin* o)
 {
-    return m_blockmap.write(data,bid);
+    return m_blockmap.write(data,bid, o);
 }
 
 ssize_t
@@ -91,10 +143,11 @@ block_storage_manager::update_block(const e::slice& data,
         uint32_t offset,
         uint64_t& sid,
         uint64_t& bid,
-        uint64_t& block_len)
+        uint64_t& block_len,
+        const blockmap::origin* o)
 {
 
-    return m_blockmap.update(data,offset,bid, block_len);
+    return m_blockmap.update(data,offset,bid, block_len, o);
 
 }
 
@@ -102,21 +155,199 @@ block_storage_manager::update_block(const e::slice& data,
 ssize_t
 block_storage_manager::read_block(uint64_t sid,
         uint64_t bid,
+        size_t offset,
         uint8_t* data, 
-        size_t data_sz)
+        size_t data_sz,
+        uint64_t stream)
+{
+    ssize_t ret = m_blockmap.read(bid, data, offset, data_sz);
+
+    if (ret > 0)
+    {
+        readahead(stream, bid);
+    }
+
+    return ret;
+}
+
+// Served by one vectored read, so the I/O for all the extents is issued in
+// log order rather than in the order asked for.
+ssize_t
+block_storage_manager::read_blocks(blockmap::extent* exts, size_t exts_sz,
+        uint64_t stream)
 {
-    return m_blockmap.read(bid, data, 0, data_sz);
+    ssize_t ret = m_blockmap.readv(exts, exts_sz);
+
+    if (ret > 0 && exts_sz > 0)
+    {
+        readahead(stream, exts[exts_sz - 1].bid);
+    }
+
+    return ret;
+}
+
+// Blocks written one after another sit next to each other in the log, so a
+// client scanning a file reads forward through it.  When a stream's read
+// starts where its last one ended, prefetch the log beyond it, growing the
+// window while the pattern holds and dropping it when it breaks.
+void
+block_storage_manager::readahead(uint64_t stream, uint64_t bid)
+{
+    uint64_t start;
+    uint64_t end;
+
+    if (stream == 0 || m_blockmap.disk_span(bid, &start, &end) < 0)
+    {
+        return;
+    }
+
+    uint64_t from = 0;
+    uint64_t to = 0;
+
+    {
+        po6::threads::mutex::hold hold(&m_streams_mtx);
+
+        if (m_streams.size() >= 2 * PREFETCH_STREAMS)
+        {
+            std::map<uint64_t, stream_state>::iterator it = m_streams.begin();
+
+            while (it != m_streams.end())
+            {
+                if (it->second.used + PREFETCH_STREAMS < m_stream_tick)
+                {
+                    m_streams.erase(it++);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        stream_state& st(m_streams[stream]);
+        st.used = ++m_stream_tick;
+
+        if (start >= st.next &&
+            start <= std::max<uint64_t>(st.ahead, st.next + PREFETCH_SLACK))
+        {
+            st.window = st.window == 0
+                      ? PREFETCH_MIN_WINDOW
+                      : std::min<uint64_t>(2 * st.window, PREFETCH_MAX_WINDOW);
+        }
+        else
+        {
+            st.window = 0;
+            st.ahead = end;
+        }
+
+        st.next = end;
+        from = std::max(end, st.ahead);
+        to = end + st.window;
+
+        if (to > from)
+        {
+            st.ahead = to;
+        }
+    }
+
+    if (to > from)
+    {
+        m_blockmap.prefetch(from, to - from);
+    }
 }
 
 ssize_t
 block_storage_manager::truncate_block(uint64_t sid,
         uint64_t& bid,
-        size_t len)
+        size_t len,
+        const blockmap::origin* o)
+{
+    return m_blockmap.truncate(bid, len, o);
+}
+
+ssize_t
+block_storage_manager::release_block(uint64_t sid,
+        uint64_t bid)
+{
+    return m_blockmap.release(bid);
+}
+
+ssize_t
+block_storage_manager::block_length(uint64_t bid)
+{
+    return m_blockmap.length(bid);
+}
+
+ssize_t
+block_storage_manager::quarantined_blocks(std::vector<uint64_t>* bids, size_t max)
+{
+    return m_blockmap.quarantined(bids, max);
+}
+
+ssize_t
+block_storage_manager::repair_block(uint64_t bid, const e::slice& data)
+{
+    return m_blockmap.repair(bid, data);
+}
+
+ssize_t
+block_storage_manager::set_block_origin(uint64_t bid, const e::slice& tag,
+                                        const e::slice& peers)
 {
-    return m_blockmap.truncate(bid, len);
+    return m_blockmap.set_origin(bid, tag, peers);
+}
+
+ssize_t
+block_storage_manager::block_origin(uint64_t bid, std::string* tag, std::string* peers)
+{
+    return m_blockmap.get_origin(bid, tag, peers);
+}
+
+ssize_t
+block_storage_manager::find_block(const e::slice& tag, uint64_t* bid)
+{
+    return m_blockmap.find_origin(tag, bid);
+}
+
+ssize_t
+block_storage_manager::flush()
+{
+    return m_blockmap.flush();
 }
 
 void
 block_storage_manager::stat()
 {
+    m_blockmap.stat();
+}
+
+// Space reclamation and other housekeeping for the block store runs here, off
+// the network threads.
+void
+block_storage_manager::background()
+{
+    LOG(INFO) << "block storage background thread started";
+
+    while (!__sync_fetch_and_add(&m_shutdown, 0))
+    {
+        // Sweep first so that the cleaner sees the space released blocks
+        // gave back.
+        while (m_blockmap.sweep() > 0 &&
+                !__sync_fetch_and_add(&m_shutdown, 0))
+            ;
+
+        m_blockmap.clean();
+        m_blockmap.defrag();
+        m_blockmap.scrub(SCRUB_BYTES_PER_PASS);
+        // Keeps the tail that recovery has to scan short.
+        m_blockmap.checkpoint();
+
+        for (size_t i = 0; i < BACKGROUND_INTERVAL_MS / 100 &&
+                !__sync_fetch_and_add(&m_shutdown, 0); ++i)
+        {
+            usleep(100 * 1000);
+        }
+    }
+
+    LOG(INFO) << "block storage background thread exiting";
 }
@@ -33,11 +33,16 @@
 #include <glog/raw_logging.h>
 
 // STL
+#include <map>
+#include <memory>
+#include <string>
 #include <vector>
 
 //po6
 #include <po6/io/fd.h>
 #include <po6/pathname.h>
+#include <po6/threads/mutex.h>
+#include <po6/threads/thread.h>
 
 // WTF
 #include "common/ids.h"
@@ -54,34 +59,79 @@ namespace wtf __attribute__ ((visibility("hidden")))
         public:
             void setup(uint64_t sid,
                        po6::pathname path,
-                       po6::pathname backing_path);
+                       const std::vector<po6::pathname>& backing_paths,
+                       bool sync,
+                       size_t shards,
+                       const std::string& backend,
+                       const std::string& codec,
+                       bool dedup,
+                       bool preallocate);
             void shutdown();
 
         public:
             ssize_t write_block(const e::slice& data,
                                  uint64_t& sid,
-                                 uint64_t& bid);
+                                 uint64_t& bid,
+                                 const blockmap::origin* o);
             ssize_t update_block(const e::slice& data,
                                  uint32_t offset,
                                  uint64_t& sid,
                                  uint64_t& bid,
-                                 uint64_t& block_len);
+                                 uint64_t& block_len,
+                                 const blockmap::origin* o);
             ssize_t read_block(uint64_t sid,
                                uint64_t bid,
-                               uint8_t* data, size_t len);
+                               size_t offset,
+                               uint8_t* data, size_t len,
+                               uint64_t stream);
+            ssize_t read_blocks(blockmap::extent* exts, size_t exts_sz,
+                                uint64_t stream);
             ssize_t truncate_block(uint64_t sid,
                                 uint64_t& bid,
-                                size_t len);
+                                size_t len,
+                                const blockmap::origin* o);
+            ssize_t release_block(uint64_t sid,
+                                  uint64_t bid);
+            ssize_t block_length(uint64_t bid);
+            ssize_t flush();
             void stat();
+
+        // integrity
+        public:
+            ssize_t quarantined_blocks(std::vector<uint64_t>* bids, size_t max);
+            ssize_t repair_block(uint64_t bid, const e::slice& data);
+            ssize_t set_block_origin(uint64_t bid, const e::slice& tag,
+                                     const e::slice& peers);
+            ssize_t block_origin(uint64_t bid, std::string* tag, std::string* peers);
+            ssize_t find_block(const e::slice& tag, uint64_t* bid);
         private:
             ssize_t splice(int fd_in, size_t offset_in, 
                            int fd_out, size_t offset_out, 
                            size_t len);
+            void background();
+
+        // Sequential readahead.  A stream is whatever issues a run of reads,
+        // for now a client connection; stream 0 never reads ahead.
+        private:
+            struct stream_state
+            {
+                stream_state() : next(0), ahead(0), window(0), used(0) {}
+                uint64_t next;
+                uint64_t ahead;
+                uint64_t window;
+                uint64_t used;
+            };
+            void readahead(uint64_t stream, uint64_t bid);
 
         private:
             uint64_t m_prefix;
             uint64_t m_last_block_num;
             blockmap m_blockmap;
+            std::auto_ptr<po6::threads::thread> m_background;
+            int m_shutdown;
+            po6::threads::mutex m_streams_mtx;
+            std::map<uint64_t, stream_state> m_streams;
+            uint64_t m_stream_tick;
     };
 }
 
@@ -40,6 +40,7 @@
 // POSIX
 #include <signal.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/statvfs.h>
 
 // STL
@@ -161,10 +162,19 @@ daemon :: daemon()
     , m_config()
     , m_gc()
     , m_gc_ts()
+    , m_repair_round(0)
+    , m_durability(DURABILITY_NONE)
+    , m_flush_mtx()
+    , m_flush_cond(&m_flush_mtx)
+    , m_acks()
+    , m_unflushed(0)
+    , m_flusher_stop(false)
+    , m_flusher()
 {
     TRACE;
     m_gc.register_thread(&m_gc_ts);
     trip_periodic(0, &daemon::periodic_stat);
+    trip_periodic(0, &daemon::periodic_repair);
 }
 
 static bool
@@ -182,14 +192,40 @@ int
 daemon :: run(bool daemonize,
               po6::pathname data,
               po6::pathname log,
-              po6::pathname backing_path,
+              const std::vector<po6::pathname>& backing_paths,
               bool set_bind_to,
               po6::net::location bind_to,
               bool set_coordinator,
               po6::net::hostname coordinator,
-              unsigned threads)
+              unsigned threads,
+              bool sync,
+              const char* backend,
+              const char* codec,
+              bool dedup,
+              const char* durability,
+              bool preallocate)
 {
     TRACE;
+    if (strcmp(durability, "none") == 0)
+    {
+        m_durability = DURABILITY_NONE;
+    }
+    else if (strcmp(durability, "periodic") == 0)
+    {
+        m_durability = DURABILITY_PERIODIC;
+    }
+    else if (strcmp(durability, "request") == 0)
+    {
+        m_durability = DURABILITY_REQUEST;
+    }
+    else
+    {
+        std::cerr << "unknown durability mode \"" << durability
+                  << "\"; use none, periodic or request" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+
     if (!install_signal_handler(SIGHUP, exit_on_signal))
     {
         std::cerr << "could not install SIGHUP handler; exiting" << std::endl;
@@ -287,7 +323,15 @@ daemon :: run(bool daemonize,
 
     m_busybee.reset(new busybee_mta(&m_gc, &m_busybee_mapper, bind_to, m_us.get(), threads));
     m_busybee->set_ignore_signals();
-    m_blockman.setup(m_us.get(), data, backing_path);
+    // One blockmap shard per network thread so that writers rarely share
+    // a bid allocator, append head or commit queue.
+    m_blockman.setup(m_us.get(), data, backing_paths, sync, threads, backend, codec, dedup, preallocate);
+
+    if (m_durability != DURABILITY_NONE)
+    {
+        m_flusher.reset(new po6::threads::thread(std::tr1::bind(&daemon::flusher, this)));
+        m_flusher->start();
+    }
 
     for (size_t i = 0; i < threads; ++i)
     {
@@ -311,6 +355,7 @@ daemon :: run(bool daemonize,
         {
             s_alarm = false;
             alarm(ALARM_INTERVAL);
+            run_periodic();
         }
 
         if (s_debug)
@@ -421,7 +466,10 @@ daemon :: run(bool daemonize,
     __sync_fetch_and_add(&s_interrupts, 2);
     //m_stat_collector.join();
 
-    m_blockman.shutdown();
+    // Stop taking requests and let the workers finish the ones they hold.
+    // The flusher then makes their writes durable and sends the last
+    // acknowledgments.  Only when nothing can write to the block manager
+    // anymore does it shut down and write its final checkpoint.
     m_busybee->shutdown();
 
     for (size_t i = 0; i < m_threads.size(); ++i)
@@ -429,6 +477,20 @@ daemon :: run(bool daemonize,
         m_threads[i]->join();
     }
 
+    if (m_flusher.get())
+    {
+        {
+            po6::threads::mutex::hold hold(&m_flush_mtx);
+            m_flusher_stop = true;
+            m_flush_cond.broadcast();
+        }
+
+        m_flusher->join();
+        m_flusher.reset();
+    }
+
+    m_blockman.shutdown();
+
     LOG(INFO) << "wtf-daemon will now terminate";
     return EXIT_SUCCESS;
 }
@@ -495,14 +557,32 @@ daemon :: loop(size_t thread)
             case REQ_GET:
                 process_get(conn, nonce, msg, up);
                 break;
+            case REQ_GET_RANGE:
+                process_get_range(conn, nonce, msg, up);
+                break;
+            case REQ_MULTIGET:
+                process_multiget(conn, nonce, msg, up);
+                break;
             case REQ_UPDATE:
                 LOG(INFO) << "RECVD UPDATE";
                 process_update(conn, nonce, msg, up);
                 break;
+            case REQ_CHAIN_UPDATE:
+                process_chain_update(conn, nonce, msg, up);
+                break;
             case REQ_TRUNCATE:
                 LOG(INFO) << "RECVD TRUNCATE";
                 process_truncate(conn, nonce, msg, up);
                 break;
+            case REQ_RELEASE:
+                process_release(conn, nonce, msg, up);
+                break;
+            case REQ_REPAIR:
+                process_repair(conn, nonce, msg, up);
+                break;
+            case RESP_REPAIR:
+                process_repair_reply(conn, nonce, msg, up);
+                break;
             default:
                 LOG(WARNING) << "unknown message type; here's some hex:  " << msg->hex();
                 break;
@@ -620,14 +700,151 @@ daemon :: process_get(const wtf::connection& conn,
                       e::unpacker up)
 {
     TRACE;
-    wtf::response_returncode rc;
     uint64_t bid;
     uint32_t len;
-    ssize_t ret;
 
     up = up >> bid >> len;
-    uint8_t* data = new uint8_t[len];
-    ret = m_blockman.read_block(m_us.get(), bid, data, len);
+    send_block(conn, nonce, bid, 0, len);
+}
+
+void
+daemon :: process_get_range(const wtf::connection& conn, 
+                            uint64_t nonce,
+                            std::auto_ptr<e::buffer> msg, 
+                            e::unpacker up)
+{
+    TRACE;
+    uint64_t bid;
+    uint32_t offset;
+    uint32_t len;
+
+    up = up >> bid >> offset >> len;
+
+    if (up.error())
+    {
+        LOG(WARNING) << "received corrupt \"" << REQ_GET_RANGE << "\" message";
+        return;
+    }
+
+    send_block(conn, nonce, bid, offset, len);
+}
+
+// A list of (bid, offset, len) extents, all on this server, answered with one
+// RESP_MULTIGET: the count, then each extent's (bid, offset, len) followed by
+// its bytes.  Extents are read straight into the response.  If any of them
+// cannot be read in full, the response carries an error and no extents.
+void
+daemon :: process_multiget(const wtf::connection& conn,
+                           uint64_t nonce,
+                           std::auto_ptr<e::buffer> msg,
+                           e::unpacker up)
+{
+    TRACE;
+    uint32_t count;
+    up = up >> count;
+
+    if (up.error() || count > m_s.MULTIGET_MAX_EXTENTS)
+    {
+        LOG(WARNING) << "received corrupt \"" << REQ_MULTIGET << "\" message";
+        return;
+    }
+
+    const size_t ext_hdr = sizeof(uint64_t) + /* bid */
+                           sizeof(uint32_t) + /* offset */
+                           sizeof(uint32_t);  /* len */
+    size_t hdr = COMMAND_HEADER_SIZE + sizeof(uint32_t); /* count */
+    size_t bytes = 0;
+    std::vector<blockmap::extent> exts(count);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint64_t bid;
+        uint32_t offset;
+        uint32_t len;
+        up = up >> bid >> offset >> len;
+        exts[i] = blockmap::extent(bid, offset, len, NULL);
+        bytes += len;
+    }
+
+    if (up.error())
+    {
+        LOG(WARNING) << "received corrupt \"" << REQ_MULTIGET << "\" message";
+        return;
+    }
+
+    wtf::response_returncode rc = RESPONSE_SUCCESS;
+
+    if (bytes > m_s.MULTIGET_MAX_BYTES)
+    {
+        LOG(WARNING) << "refusing a multi-get of " << bytes << " bytes";
+        rc = RESPONSE_SERVER_ERROR;
+        count = 0;
+        exts.clear();
+        bytes = 0;
+    }
+
+    std::auto_ptr<e::buffer> resp(e::buffer::create(hdr + count * ext_hdr + bytes));
+    size_t pos = hdr;
+
+    for (size_t i = 0; i < exts.size(); ++i)
+    {
+        exts[i].data = resp->data() + pos + ext_hdr;
+        pos += ext_hdr + exts[i].len;
+    }
+
+    if (!exts.empty() &&
+        m_blockman.read_blocks(&exts[0], exts.size(), conn.token) < 0)
+    {
+        rc = RESPONSE_SERVER_ERROR;
+    }
+
+    for (size_t i = 0; rc == RESPONSE_SUCCESS && i < exts.size(); ++i)
+    {
+        if (exts[i].got < exts[i].len)
+        {
+            LOG(WARNING) << "block manager returned " << exts[i].got
+                         << " which is less than expected length " << exts[i].len;
+            rc = RESPONSE_SERVER_ERROR;
+        }
+    }
+
+    if (rc != RESPONSE_SUCCESS)
+    {
+        count = 0;
+    }
+
+    resp->pack_at(BUSYBEE_HEADER_SIZE) << RESP_MULTIGET << nonce << rc << count;
+    pos = hdr;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        resp->pack_at(pos) << exts[i].bid
+                           << static_cast<uint32_t>(exts[i].offset)
+                           << static_cast<uint32_t>(exts[i].len);
+        pos += ext_hdr + exts[i].len;
+    }
+
+    resp->resize(pos);
+    send(conn, resp);
+}
+
+// Answer a GET with [offset, offset + len) of the block.
+void
+daemon :: send_block(const wtf::connection& conn,
+                     uint64_t nonce,
+                     uint64_t bid,
+                     uint32_t offset,
+                     uint32_t len)
+{
+    wtf::response_returncode rc;
+    ssize_t ret;
+
+    // The block is read straight into the response, after its header, so
+    // the only copy made is the one out of the log.
+    size_t hdr = COMMAND_HEADER_SIZE + 
+                 sizeof(uint64_t); /* bid */
+    std::auto_ptr<e::buffer> resp(e::buffer::create(hdr + len));
+    ret = m_blockman.read_block(m_us.get(), bid, offset, resp->data() + hdr, len, conn.token);
 
     if (ret < len)
     {
@@ -640,26 +857,13 @@ daemon :: process_get(const wtf::connection& conn,
         rc = RESPONSE_SUCCESS;
     }
 
-    size_t sz = COMMAND_HEADER_SIZE + 
-                sizeof(uint64_t) + /* bid */
-                len;
-
-    std::auto_ptr<e::buffer> resp(e::buffer::create(sz));
     e::buffer::packer pa = resp->pack_at(BUSYBEE_HEADER_SIZE);
     pa = pa << RESP_GET << nonce << rc << bid;
-
-    if (len > 0) 
-    {
-        pa = pa.copy(e::slice(data,len));
-        //LOG(INFO) << "GET(" << bid << "): " << e::slice(data,len).hex();
-    }
-
-    delete [] data;
+    resp->resize(hdr + len);
 
     send(conn, resp);
 }
 
-
 void
 daemon :: process_truncate(const wtf::connection& conn,
                             uint64_t nonce,
@@ -705,7 +909,9 @@ daemon :: process_truncate(const wtf::connection& conn,
     LOG(INFO) << "block_len = " << block_len;
 
     sid = m_us.get();
-    ret = m_blockman.truncate_block(sid, bid, block_len); 
+    blockmap::origin origin;
+    origin_of(sender, nonce, block_locations, &origin);
+    ret = m_blockman.truncate_block(sid, bid, block_len, &origin); 
 
     LOG(INFO) << "block_len = " << block_len << " (" << e::slice(&block_len, sizeof(block_len)).hex() << ")";
     LOG(INFO) << "TRUNCATE(" << bid << ") len " << block_len;
@@ -753,14 +959,39 @@ daemon :: process_truncate(const wtf::connection& conn,
             << bid << block_capacity << file_offset << block_len;
 
     //Send an ack back to the client that originated the first transfer.
-    wtf::connection c;
-    c.token = sender;
-    c.is_client = true;
-    if (!send(c, resp))
+    acknowledge(sender, resp, rc == wtf::RESPONSE_SUCCESS);
+
+}
+
+// The client sends this once the file metadata that stopped referencing these
+// blocks has committed.  There is no reply; a lost release only costs space.
+void
+daemon :: process_release(const wtf::connection& conn,
+                          uint64_t nonce,
+                          std::auto_ptr<e::buffer> msg,
+                          e::unpacker up)
+{
+    TRACE;
+    uint32_t num_blocks;
+    up = up >> num_blocks;
+
+    for (uint32_t i = 0; i < num_blocks && !up.error(); ++i)
     {
-        LOG(WARNING) << "Failed to send to client.";
+        uint64_t bid;
+        up = up >> bid;
+
+        if (up.error())
+        {
+            break;
+        }
+
+        m_blockman.release_block(m_us.get(), bid);
     }
 
+    if (up.error())
+    {
+        LOG(WARNING) << "received corrupt \"" << REQ_RELEASE << "\" message";
+    }
 }
 
 void
@@ -807,16 +1038,18 @@ daemon :: process_update(const wtf::connection& conn,
     LOG(INFO) << "file_offset= " << file_offset;
     e::slice data = up.as_slice();
     sid = m_us.get();
+    blockmap::origin origin;
+    origin_of(sender, nonce, block_locations, &origin);
 
     if (bid == UINT64_MAX)
     {
-        ret = m_blockman.write_block(data, sid, bid); 
+        ret = m_blockman.write_block(data, sid, bid, &origin); 
         block_len = ret; 
         LOG(INFO) << "block_len = " << block_len << " (" << e::slice(&block_len, sizeof(block_len)).hex() << ")";
     }
     else
     {
-        ret = m_blockman.update_block(data, block_offset, sid, bid, block_len); 
+        ret = m_blockman.update_block(data, block_offset, sid, bid, block_len, &origin); 
         LOG(INFO) << "block_len = " << block_len << " (" << e::slice(&block_len, sizeof(block_len)).hex() << ")";
     }
 
@@ -871,26 +1104,460 @@ daemon :: process_update(const wtf::connection& conn,
             << bid << file_offset << block_len;
 
     //Send an ack back to the client that originated the first transfer.
+    acknowledge(sender, resp, rc == wtf::RESPONSE_SUCCESS);
+}
+
+// The answer to a chain update: every replica's result slot, with the block
+// each one wrote.
+static std::auto_ptr<e::buffer>
+chain_response(uint64_t nonce,
+               wtf::response_returncode rc,
+               uint64_t file_offset,
+               const std::vector<wtf::block_location>& block_locations,
+               const std::vector<wtf::response_returncode>& rcs,
+               const std::vector<uint64_t>& bids,
+               const std::vector<uint64_t>& lens)
+{
+    uint32_t num_replicas = block_locations.size();
+    size_t sz = COMMAND_HEADER_SIZE + 
+                sizeof(uint64_t) + /* file_offset */
+                sizeof(uint32_t) + /* num_replicas */
+                num_replicas * (pack_size(wtf::RESPONSE_SUCCESS) +
+                                wtf::block_location::pack_size() +
+                                sizeof(uint64_t)); /* block_len */
+    std::auto_ptr<e::buffer> resp(e::buffer::create(sz));
+    e::buffer::packer pa = resp->pack_at(BUSYBEE_HEADER_SIZE);
+    pa = pa << wtf::RESP_CHAIN_UPDATE << nonce << rc << file_offset << num_replicas;
+
+    for (size_t i = 0; i < block_locations.size(); ++i)
+    {
+        pa = pa << rcs[i] << wtf::block_location(block_locations[i].si, bids[i]) << lens[i];
+    }
+
+    return resp;
+}
+
+// Chain replication.  The client sends the request to the first replica only.
+// After the block locations and file offset it carries one result slot per
+// replica, then the data.  Each replica applies the request, fills in its
+// slot and passes the same buffer on to the next replica, so every replica
+// sends the data once instead of the first sending it to all the others.
+// The last replica answers the client for all of them.  A replica that fails
+// still passes the request on so that the client hears about it; one that
+// cannot pass it on answers the client itself with the slots filled so far.
+// Replica i answers under nonce + i, so the client can tell who answered.
+void
+daemon :: process_chain_update(const wtf::connection& conn,
+                               uint64_t nonce,
+                               std::auto_ptr<e::buffer> msg,
+                               e::unpacker up)
+{
+    TRACE;
+    uint64_t sender;
+    uint32_t num_replicas;
+    uint64_t file_offset;
+    up = up >> sender >> num_replicas;
+
+    std::vector<block_location> block_locations;
+    size_t us = num_replicas;
+
+    for (uint32_t i = 0; !up.error() && i < num_replicas; ++i)
+    {
+        block_location bl;
+        up = up >> bl;
+
+        if (bl.si == m_us.get() && us == num_replicas)
+        {
+            us = i;
+        }
+
+        block_locations.push_back(bl);
+    }
+
+    up = up >> file_offset;
+    const size_t slot_sz = pack_size(wtf::RESPONSE_SUCCESS) +
+                           sizeof(uint64_t) + /* bid */
+                           sizeof(uint64_t);  /* block_len */
+    size_t slots = msg->size() - up.remain();
+    std::vector<response_returncode> rcs(block_locations.size());
+    std::vector<uint64_t> bids(block_locations.size());
+    std::vector<uint64_t> lens(block_locations.size());
+
+    for (size_t i = 0; !up.error() && i < block_locations.size(); ++i)
+    {
+        up = up >> rcs[i] >> bids[i] >> lens[i];
+    }
+
+    if (up.error() || us == num_replicas)
+    {
+        LOG(WARNING) << "received corrupt \"" << REQ_CHAIN_UPDATE << "\" message";
+        return;
+    }
+
+    e::slice data = up.as_slice();
+    uint64_t sid = m_us.get();
+    uint64_t bid = block_locations[us].bi;
+    uint64_t block_len = 0;
+    ssize_t ret;
+    blockmap::origin origin;
+    origin_of(sender, nonce, block_locations, &origin);
+
+    if (bid == UINT64_MAX)
+    {
+        ret = m_blockman.write_block(data, sid, bid, &origin); 
+        block_len = ret; 
+    }
+    else
+    {
+        ret = m_blockman.update_block(data, 0, sid, bid, block_len, &origin); 
+    }
+
+    response_returncode rc = wtf::RESPONSE_SUCCESS;
+
+    if (ret < static_cast<ssize_t>(data.size()))
+    {
+        rc = wtf::RESPONSE_SERVER_ERROR;
+    }
+
+    LOG(INFO) << "CHAIN UPDATE(" << bid << ") replica " << us << " of "
+              << num_replicas << ": " << rc;
+    rcs[us] = rc;
+    bids[us] = bid;
+    lens[us] = block_len;
+    msg->pack_at(slots + us * slot_sz) << rc << bid << block_len;
+
+    if (us + 1 < block_locations.size())
+    {
+        std::auto_ptr<e::buffer> failure(chain_response(nonce + us,
+                    wtf::RESPONSE_SERVER_ERROR, file_offset,
+                    block_locations, rcs, bids, lens));
+        pass_on(block_locations[us + 1].si, msg, sender, failure,
+                rc == wtf::RESPONSE_SUCCESS);
+        return;
+    }
+
+    for (size_t i = 0; i < rcs.size(); ++i)
+    {
+        if (rcs[i] != wtf::RESPONSE_SUCCESS)
+        {
+            rc = wtf::RESPONSE_SERVER_ERROR;
+        }
+    }
+
+    std::auto_ptr<e::buffer> resp(chain_response(nonce + us, rc, file_offset,
+                block_locations, rcs, bids, lens));
+    acknowledge(sender, resp, rcs[us] == wtf::RESPONSE_SUCCESS);
+}
+
+// Send msg to the client.  If the request wrote something and writes must be
+// durable before they are acknowledged, hand msg to the flusher instead.
+void
+daemon :: acknowledge(uint64_t to, std::auto_ptr<e::buffer> msg, bool wrote)
+{
+    enqueue(pending_ack(to, msg.release(), 0, NULL), wrote);
+}
+
+// Pass a chain update on to the next replica, as acknowledge does for the
+// client.  If that replica cannot be reached, send failure to the client.
+void
+daemon :: pass_on(uint64_t to, std::auto_ptr<e::buffer> msg,
+                  uint64_t sender, std::auto_ptr<e::buffer> failure,
+                  bool wrote)
+{
+    enqueue(pending_ack(to, msg.release(), sender, failure.release()), wrote);
+}
+
+void
+daemon :: enqueue(const pending_ack& ack, bool wrote)
+{
+    if (wrote && m_durability == DURABILITY_REQUEST)
+    {
+        po6::threads::mutex::hold hold(&m_flush_mtx);
+        m_acks.push_back(ack);
+        m_flush_cond.signal();
+        return;
+    }
+
+    if (wrote)
+    {
+        __sync_fetch_and_add(&m_unflushed, 1);
+    }
+
+    deliver(ack);
+}
+
+void
+daemon :: deliver(const pending_ack& ack)
+{
+    std::auto_ptr<e::buffer> msg(ack.msg);
+    std::auto_ptr<e::buffer> failure(ack.failure);
     wtf::connection c;
-    c.token = sender;
+    c.token = ack.to;
+    c.is_client = !failure.get();
+
+    if (send(c, msg))
+    {
+        return;
+    }
+
+    if (!failure.get())
+    {
+        LOG(WARNING) << "Failed to send to client.";
+        return;
+    }
+
+    LOG(WARNING) << "Failed to pass chain update on to replica " << ack.to
+                 << "; failing it back to the client.";
+    c.token = ack.sender;
     c.is_client = true;
-    if (!send(c, resp))
+
+    if (!send(c, failure))
     {
         LOG(WARNING) << "Failed to send to client.";
     }
 }
 
+// Every write behind a queued acknowledgment has already reached the log and
+// LevelDB, so one flush covers all of them no matter how many there are; the
+// more requests arrive while a flush is running, the bigger the next group.
+// A failed flush leaves it unknown what is on disk, and retrying cannot tell
+// (the kernel may already have dropped the dirty pages), so give up rather
+// than acknowledge anything.
+void
+daemon :: flusher()
+{
+    LOG(INFO) << "flusher thread started";
+    bool stop = false;
+
+    while (!stop)
+    {
+        std::vector<pending_ack> acks;
+
+        {
+            po6::threads::mutex::hold hold(&m_flush_mtx);
+
+            if (m_acks.empty() && !m_flusher_stop)
+            {
+                if (m_durability == DURABILITY_PERIODIC)
+                {
+                    m_flush_cond.wait(m_s.FLUSH_INTERVAL);
+                }
+                else
+                {
+                    m_flush_cond.wait();
+                }
+            }
+
+            stop = m_flusher_stop;
+            acks.swap(m_acks);
+        }
+
+        uint64_t unflushed = __sync_lock_test_and_set(&m_unflushed, 0);
+
+        if (acks.empty() && unflushed == 0 && !stop)
+        {
+            continue;
+        }
+
+        if (m_blockman.flush() < 0)
+        {
+            LOG(ERROR) << "could not flush writes to disk; cannot tell what is durable";
+            abort();
+        }
+
+        for (size_t i = 0; i < acks.size(); ++i)
+        {
+            deliver(acks[i]);
+        }
+    }
+
+    LOG(INFO) << "flusher thread stopped";
+}
+
 void
 daemon :: forward_message(std::vector<block_location>& block_locations, std::auto_ptr<e::buffer> msg)
 {
     TRACE;
-    for (int i = 0; i < block_locations.size(); ++i)
+    // BusyBee takes ownership of what it sends, so each target but the last
+    // needs a copy of its own; the last gets msg itself.  Every target gets
+    // the same bytes, so there is no per-destination header to rewrite.
+    for (size_t i = 0; i < block_locations.size(); ++i)
     {
         wtf::connection c;
         c.token = block_locations[i].si;
         c.is_client = false;
-        std::auto_ptr<e::buffer> msg_copy(msg->copy());
-        send(c, msg_copy);
+
+        if (i + 1 < block_locations.size())
+        {
+            std::auto_ptr<e::buffer> msg_copy(msg->copy());
+            send(c, msg_copy);
+        }
+        else
+        {
+            send(c, msg);
+        }
+    }
+}
+
+// Every replica applies the same client request, named by the client's
+// token and nonce, and so ends up with the same bytes under its own bid.
+// The block manager remembers the request and the other replicas, in the same
+// commit as the block's offset map, so that a copy can be found if this one
+// ever fails its checksum.
+void
+daemon :: origin_of(uint64_t sender, uint64_t nonce,
+                    const std::vector<block_location>& bl,
+                    blockmap::origin* o)
+{
+    uint8_t tag[2 * sizeof(uint64_t)];
+    e::pack64be(nonce, e::pack64be(sender, tag));
+    o->tag.assign(reinterpret_cast<const char*>(tag), sizeof(tag));
+    o->peers.clear();
+
+    for (size_t i = 0; i < bl.size(); ++i)
+    {
+        if (bl[i].si != m_us.get())
+        {
+            uint8_t peer[sizeof(uint64_t)];
+            e::pack64be(bl[i].si, peer);
+            o->peers.append(reinterpret_cast<const char*>(peer), sizeof(peer));
+        }
+    }
+}
+
+// Ask another replica for a good copy of each quarantined block.  The bid is
+// sent as the nonce so that the reply says which block it is for.  Each round
+// asks the next replica in turn, in case the last one did not have it.
+void
+daemon :: periodic_repair(uint64_t now)
+{
+    trip_periodic(now + m_s.REPAIR_INTERVAL, &daemon::periodic_repair);
+    std::vector<uint64_t> bids;
+
+    if (m_blockman.quarantined_blocks(&bids, m_s.REPAIR_BATCH) <= 0)
+    {
+        return;
+    }
+
+    ++m_repair_round;
+
+    for (size_t i = 0; i < bids.size(); ++i)
+    {
+        std::string tag;
+        std::string peers;
+        ssize_t len = m_blockman.block_length(bids[i]);
+
+        if (len < 0 ||
+            m_blockman.block_origin(bids[i], &tag, &peers) < 0 ||
+            peers.size() < sizeof(uint64_t))
+        {
+            LOG(WARNING) << "bid " << bids[i] << " is corrupt and there is "
+                         << "no other replica on record to repair it from";
+            continue;
+        }
+
+        size_t npeers = peers.size() / sizeof(uint64_t);
+        uint64_t peer;
+        e::unpack64be(reinterpret_cast<const uint8_t*>(peers.data()) +
+                      ((m_repair_round + i) % npeers) * sizeof(uint64_t), &peer);
+        size_t sz = BUSYBEE_HEADER_SIZE
+                  + pack_size(REQ_REPAIR)
+                  + sizeof(uint64_t) /* nonce */
+                  + sizeof(uint32_t) + tag.size()
+                  + sizeof(uint64_t); /* length */
+        std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << REQ_REPAIR << bids[i]
+            << e::slice(tag.data(), tag.size()) << static_cast<uint64_t>(len);
+        LOG(INFO) << "asking server " << peer << " for a copy of corrupt bid " << bids[i];
+        wtf::connection c;
+        c.token = peer;
+        c.is_client = false;
+        send(c, msg);
+    }
+}
+
+void
+daemon :: process_repair(const wtf::connection& conn,
+                         uint64_t nonce,
+                         std::auto_ptr<e::buffer> msg,
+                         e::unpacker up)
+{
+    TRACE;
+    e::slice tag;
+    uint64_t len;
+    up = up >> tag >> len;
+    wtf::response_returncode rc = RESPONSE_SUCCESS;
+    uint64_t bid = 0;
+    std::vector<uint8_t> data;
+
+    if (up.error())
+    {
+        LOG(WARNING) << "received corrupt \"" << REQ_REPAIR << "\" message";
+        return;
+    }
+
+    // len comes off the wire, so nothing is allocated until it matches the
+    // length of the block we hold.
+    ssize_t have = -1;
+
+    if (m_blockman.find_block(tag, &bid) >= 0)
+    {
+        have = m_blockman.block_length(bid);
+    }
+
+    if (have < 0 || static_cast<uint64_t>(have) != len)
+    {
+        rc = RESPONSE_SERVER_ERROR;
+    }
+    else if (len > 0)
+    {
+        data.resize(len);
+
+        if (m_blockman.read_block(m_us.get(), bid, 0, &data[0], len, 0) < have)
+        {
+            rc = RESPONSE_SERVER_ERROR;
+            data.clear();
+        }
+    }
+
+    size_t sz = COMMAND_HEADER_SIZE + data.size();
+    std::auto_ptr<e::buffer> resp(e::buffer::create(sz));
+    e::buffer::packer pa = resp->pack_at(BUSYBEE_HEADER_SIZE);
+    pa = pa << RESP_REPAIR << nonce << rc;
+
+    if (!data.empty())
+    {
+        pa = pa.copy(e::slice(&data[0], data.size()));
+    }
+
+    send(conn, resp);
+}
+
+void
+daemon :: process_repair_reply(const wtf::connection& conn,
+                               uint64_t nonce,
+                               std::auto_ptr<e::buffer> msg,
+                               e::unpacker up)
+{
+    TRACE;
+    wtf::response_returncode rc;
+    up = up >> rc;
+
+    if (up.error())
+    {
+        LOG(WARNING) << "received corrupt \"" << RESP_REPAIR << "\" message";
+        return;
+    }
+
+    if (rc != RESPONSE_SUCCESS)
+    {
+        LOG(WARNING) << "server " << conn.token << " has no good copy of bid " << nonce;
+        return;
+    }
+
+    if (m_blockman.repair_block(nonce, up.as_slice()) < 0)
+    {
+        LOG(ERROR) << "could not repair bid " << nonce << " with the copy from server " << conn.token;
     }
 }
 
@@ -959,9 +1626,18 @@ daemon :: periodic_nop(uint64_t)
 }
 
 void
-daemon :: periodic_stat(uint64_t)
+daemon :: periodic_stat(uint64_t now)
 {
+    trip_periodic(now + m_s.REPORT_INTERVAL, &daemon::periodic_stat);
     m_blockman.stat();
+
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+        LOG(INFO) << "daemon: minor_faults=" << ru.ru_minflt
+                  << " major_faults=" << ru.ru_majflt;
+    }
 }
 
 bool
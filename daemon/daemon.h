@@ -41,6 +41,8 @@
 #include <po6/net/hostname.h>
 #include <po6/net/ipaddr.h>
 #include <po6/pathname.h>
+#include <po6/threads/cond.h>
+#include <po6/threads/mutex.h>
 #include <po6/threads/thread.h>
 
 // BusyBee
@@ -68,12 +70,18 @@ class daemon
         int run(bool daemonize,
                 po6::pathname data,
                 po6::pathname log,
-                po6::pathname backing_data,
+                const std::vector<po6::pathname>& backing_paths,
                 bool set_bind_to,
                 po6::net::location bind_to,
                 bool set_coordinator,
                 po6::net::hostname coordinator,
-                unsigned threads);
+                unsigned threads,
+                bool sync,
+                const char* backend,
+                const char* codec,
+                bool dedup,
+                const char* durability,
+                bool preallocate);
 
     // Handle file operations
     private:
@@ -82,6 +90,19 @@ class daemon
                           uint64_t nonce,
                           std::auto_ptr<e::buffer> msg,
                           e::unpacker up);
+        void process_get_range(const wtf::connection& conn,
+                          uint64_t nonce,
+                          std::auto_ptr<e::buffer> msg,
+                          e::unpacker up);
+        void process_multiget(const wtf::connection& conn,
+                          uint64_t nonce,
+                          std::auto_ptr<e::buffer> msg,
+                          e::unpacker up);
+        void send_block(const wtf::connection& conn,
+                        uint64_t nonce,
+                        uint64_t bid,
+                        uint32_t offset,
+                        uint32_t len);
         void process_put(const wtf::connection& conn,
                           uint64_t nonce,
                           std::auto_ptr<e::buffer> msg,
@@ -90,13 +111,67 @@ class daemon
                           uint64_t nonce,
                           std::auto_ptr<e::buffer> msg,
                           e::unpacker up);
+        void process_chain_update(const wtf::connection& conn,
+                          uint64_t nonce,
+                          std::auto_ptr<e::buffer> msg,
+                          e::unpacker up);
         void process_truncate(const wtf::connection& conn,
                           uint64_t nonce,
                           std::auto_ptr<e::buffer> msg,
                           e::unpacker up);
+        void process_release(const wtf::connection& conn,
+                          uint64_t nonce,
+                          std::auto_ptr<e::buffer> msg,
+                          e::unpacker up);
          void forward_message(std::vector<block_location>& bl,
                           std::auto_ptr<e::buffer> msg);
 
+    // Repair blocks that failed their checksums from another replica
+    private:
+        void origin_of(uint64_t sender, uint64_t nonce,
+                       const std::vector<block_location>& bl,
+                       blockmap::origin* o);
+        void periodic_repair(uint64_t now);
+        void process_repair(const wtf::connection& conn,
+                            uint64_t nonce,
+                            std::auto_ptr<e::buffer> msg,
+                            e::unpacker up);
+        void process_repair_reply(const wtf::connection& conn,
+                                  uint64_t nonce,
+                                  std::auto_ptr<e::buffer> msg,
+                                  e::unpacker up);
+
+
+    // When writes are acknowledged relative to reaching disk.  With
+    // DURABILITY_NONE nothing is ever flushed explicitly; with
+    // DURABILITY_PERIODIC the flusher thread flushes every FLUSH_INTERVAL;
+    // with DURABILITY_REQUEST acknowledgments wait for the flusher, which
+    // covers every write queued behind one flush.
+    private:
+        enum durability_t
+        {
+            DURABILITY_NONE,
+            DURABILITY_PERIODIC,
+            DURABILITY_REQUEST
+        };
+        struct pending_ack
+        {
+            pending_ack(uint64_t t, e::buffer* m, uint64_t s, e::buffer* f)
+                : to(t), msg(m), sender(s), failure(f) {}
+            uint64_t to;
+            e::buffer* msg;
+            // Set when msg passes a request down a replication chain: what
+            // to send the client instead if the next replica is unreachable.
+            uint64_t sender;
+            e::buffer* failure;
+        };
+        void acknowledge(uint64_t to, std::auto_ptr<e::buffer> msg, bool wrote);
+        void pass_on(uint64_t to, std::auto_ptr<e::buffer> msg,
+                     uint64_t sender, std::auto_ptr<e::buffer> failure,
+                     bool wrote);
+        void enqueue(const pending_ack& ack, bool wrote);
+        void deliver(const pending_ack& ack);
+        void flusher();
 
     // Manage communication
     private:
@@ -143,6 +218,14 @@ class daemon
         configuration m_config;
         e::garbage_collector m_gc;
         e::garbage_collector::thread_state m_gc_ts;
+        uint64_t m_repair_round;
+        durability_t m_durability;
+        po6::threads::mutex m_flush_mtx;
+        po6::threads::cond m_flush_cond;
+        std::vector<pending_ack> m_acks;
+        uint64_t m_unflushed;
+        bool m_flusher_stop;
+        std::auto_ptr<po6::threads::thread> m_flusher;
 };
 
 } // namespace wtf __attribute__ ((visibility("hidden")))
@@ -25,6 +25,10 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+// STL
+#include <string>
+#include <vector>
+
 // Popt
 #include <popt.h>
 
@@ -56,6 +60,12 @@ static const char* _coordinator_host = "127.0.0.1";
 static unsigned long _coordinator_port = 1982;
 static bool _coordinator = false;
 static long _threads = 1;
+static bool _sync = false;
+static const char* _backend = "mmap";
+static const char* _compression = "none";
+static bool _dedup = false;
+static const char* _durability = "none";
+static bool _preallocate = false;
 
 extern "C"
 {
@@ -67,8 +77,8 @@ static struct poptOption popts[] = {
     {"foreground", 'f', POPT_ARG_NONE, NULL, 'f',
      "run wtf in the foreground", 0},
     {"data", 'M', POPT_ARG_STRING, &_metadata, 'M',
-     "store persistent state in this directory (default: ./metadata)",
-     "dir"},
+     "store blocks in these comma-separated backing files (default: ./metadata)",
+     "file[,file...]"},
     {"data", 'D', POPT_ARG_STRING, &_data, 'D',
      "store persistent state in this directory (default: ./data)",
      "dir"},
@@ -90,6 +100,23 @@ static struct poptOption popts[] = {
     {"threads", 't', POPT_ARG_LONG, &_threads, 't',
      "the number of threads which will handle network traffic (default: 1)",
      "N"},
+    {"sync", 's', POPT_ARG_NONE, NULL, 's',
+     "sync offset maps to disk before acknowledging writes", 0},
+    {"backend", 'b', POPT_ARG_STRING, &_backend, 'b',
+     "block store I/O backend: mmap or uring (default: mmap)",
+     "name"},
+    {"compression", 'z', POPT_ARG_STRING, &_compression, 'z',
+     "compress blocks as they are stored: none or snappy (default: none)",
+     "codec"},
+    {"dedup", 'u', POPT_ARG_NONE, NULL, 'u',
+     "store identical blocks only once", 0},
+    {"durability", 'y', POPT_ARG_STRING, &_durability, 'y',
+     "flush writes to disk never, periodically, or before acknowledging each "
+     "request: none, periodic or request (default: none)",
+     "mode"},
+    {"preallocate", 'a', POPT_ARG_NONE, NULL, 'a',
+     "allocate the backing files up front and prefault the log as it is "
+     "appended to", 0},
     POPT_TABLEEND
 };
 
@@ -171,6 +198,21 @@ main(int argc, const char* argv[])
                 break;
             case 't':
                 break;
+            case 's':
+                _sync = true;
+                break;
+            case 'b':
+                break;
+            case 'z':
+                break;
+            case 'u':
+                _dedup = true;
+                break;
+            case 'y':
+                break;
+            case 'a':
+                _preallocate = true;
+                break;
             case POPT_ERROR_NOARG:
             case POPT_ERROR_BADOPT:
             case POPT_ERROR_BADNUMBER:
@@ -205,11 +247,33 @@ main(int argc, const char* argv[])
 
         po6::pathname data(_data);
         po6::pathname log(_log ? _log : _data);
-        po6::pathname metadata(_metadata);
+        std::vector<po6::pathname> metadata;
+        std::string paths(_metadata);
+        size_t start = 0;
+
+        while (start <= paths.size())
+        {
+            size_t end = paths.find(',', start);
+            end = end == std::string::npos ? paths.size() : end;
+
+            if (end > start)
+            {
+                metadata.push_back(po6::pathname(paths.substr(start, end - start).c_str()));
+            }
+
+            start = end + 1;
+        }
+
+        if (metadata.empty())
+        {
+            std::cerr << "specify at least one backing file with -M" << std::endl;
+            return EXIT_FAILURE;
+        }
+
         po6::net::location bind_to(_listen_ip, _listen_port);
         po6::net::hostname coord(_coordinator_host, _coordinator_port);
 
-        return d.run(_daemonize, data, log, metadata, _listen, bind_to, _coordinator, coord, _threads);
+        return d.run(_daemonize, data, log, metadata, _listen, bind_to, _coordinator, coord, _threads, _sync, _backend, _compression, _dedup, _durability, _preallocate);
     }
     catch (po6::error& e)
     {
@@ -55,6 +55,12 @@ class settings
         uint64_t TRANSFER_WINDOW;
         uint64_t CONNECTION_RETRY;
         uint64_t PERIODIC_SIZE_WARNING;
+        uint64_t REPAIR_INTERVAL;
+        uint64_t REPAIR_BATCH;
+        uint64_t FLUSH_INTERVAL;
+        // bounds on a single multi-get
+        uint64_t MULTIGET_MAX_EXTENTS;
+        uint64_t MULTIGET_MAX_BYTES;
 };
 
 inline
@@ -69,6 +75,11 @@ settings :: settings()
     , TRANSFER_WINDOW(512)
     , CONNECTION_RETRY(50 * MILLIS)
     , PERIODIC_SIZE_WARNING(16)
+    , REPAIR_INTERVAL(10 * SECONDS)
+    , REPAIR_BATCH(16)
+    , FLUSH_INTERVAL(200 * MILLIS)
+    , MULTIGET_MAX_EXTENTS(1024)
+    , MULTIGET_MAX_BYTES(64ULL * 1024ULL * 1024ULL)
 {
 }
 
@@ -149,6 +149,10 @@ extern "C"
             size_t* data_sz, 
             wtf_client_returncode* status);
 
+    /* Have writes travel down a chain of replicas rather than be sent to
+     * all of them by the first. */
+    void wtf_client_set_chain_replication(struct wtf_client* m_cl, int enable);
+
     const char* wtf_client_error_message(struct wtf_client* m_cl);
     const char* wtf_client_error_location(struct wtf_client* m_cl);
 
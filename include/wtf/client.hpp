@@ -110,6 +110,10 @@ class Client
                      size_t *data_sz,
                      wtf_client_returncode* status)
             { return wtf_client_read_sync(m_cl, fd, data, data_sz, status); }
+    public:
+        void set_chain_replication(bool enable)
+            { wtf_client_set_chain_replication(m_cl, enable ? 1 : 0); }
+
     public:
         std::string error_message()
             { return wtf_client_error_message(m_cl); }
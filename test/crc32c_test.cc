@@ -0,0 +1,192 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// C
+#include <stdlib.h>
+#include <string.h>
+
+// STL
+#include <iostream>
+
+// The software and hardware paths are internal to crc32c.cc; include it to
+// test each of them on its own.
+#include "blockstore/crc32c.cc"
+
+#define TEST_SUCCESS() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[32mOK\x1b[0m]\n"; \
+        return 0; \
+    } while (0)
+
+#define TEST_FAIL() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[31mFAIL\x1b[0m]\n" \
+                  << "location: " << __FILE__ << ":" << __LINE__<< "\n"; \
+        return -1; \
+    } while (0)
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            TEST_FAIL(); \
+        } \
+    } while (0)
+
+static uint32_t
+software(const uint8_t* p, size_t len)
+{
+    return ~crc32c_software(~0U, p, len);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static bool
+hardware(const uint8_t* p, size_t len, uint32_t* crc)
+{
+    if (!s_crc.hardware)
+    {
+        return false;
+    }
+
+    *crc = ~crc32c_hardware(~0U, p, len);
+    return true;
+}
+#else
+static bool
+hardware(const uint8_t*, size_t, uint32_t*)
+{
+    return false;
+}
+#endif
+
+// Every path, and the public entry point, must give the expected CRC.
+static bool
+matches(const uint8_t* p, size_t len, uint32_t expected)
+{
+    uint32_t hw;
+
+    if (hardware(p, len, &hw) && hw != expected)
+    {
+        return false;
+    }
+
+    return software(p, len) == expected &&
+           wtf::crc32c(reinterpret_cast<const char*>(p), len) == expected;
+}
+
+// The examples in RFC 3720, section B.4.
+int rfc3720()
+{
+    uint8_t buf[48];
+
+    memset(buf, 0, 32);
+    CHECK(matches(buf, 32, 0x8a9136aaU));
+
+    memset(buf, 0xff, 32);
+    CHECK(matches(buf, 32, 0x62a8ab43U));
+
+    for (size_t i = 0; i < 32; ++i)
+    {
+        buf[i] = i;
+    }
+
+    CHECK(matches(buf, 32, 0x46dd794eU));
+
+    for (size_t i = 0; i < 32; ++i)
+    {
+        buf[i] = 31 - i;
+    }
+
+    CHECK(matches(buf, 32, 0x113fdb5cU));
+
+    // An iSCSI read command PDU.
+    const uint8_t pdu[48] = {
+        0x01, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00,
+        0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x18,
+        0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    CHECK(matches(pdu, sizeof(pdu), 0xd9963a56U));
+
+    // The usual check value.
+    CHECK(matches(reinterpret_cast<const uint8_t*>("123456789"), 9, 0xe3069283U));
+    CHECK(matches(buf, 0, 0));
+    TEST_SUCCESS();
+}
+
+// Software and hardware agree at every alignment and length, which covers
+// the eight-byte loops and their tails.
+int software_hardware()
+{
+    uint8_t buf[4096 + 8];
+    srand(3720);
+
+    for (size_t i = 0; i < sizeof(buf); ++i)
+    {
+        buf[i] = rand();
+    }
+
+    for (size_t start = 0; start < 8; ++start)
+    {
+        for (size_t len = 0; len + start <= sizeof(buf); len += len < 64 ? 1 : 509)
+        {
+            uint32_t hw;
+            uint32_t sw = software(buf + start, len);
+            CHECK(!hardware(buf + start, len, &hw) || hw == sw);
+            CHECK(wtf::crc32c(reinterpret_cast<const char*>(buf + start), len) == sw);
+        }
+    }
+
+    TEST_SUCCESS();
+}
+
+// Extending a CRC over the bytes that follow gives the CRC of the whole.
+int extend()
+{
+    const char data[] = "The quick brown fox jumps over the lazy dog";
+    const size_t len = sizeof(data) - 1;
+    uint32_t whole = wtf::crc32c(data, len);
+
+    for (size_t split = 0; split <= len; ++split)
+    {
+        uint32_t crc = wtf::crc32c(data, split);
+        CHECK(wtf::crc32c_extend(crc, data + split, len - split) == whole);
+    }
+
+    TEST_SUCCESS();
+}
+
+int main()
+{
+    int failed = 0;
+    failed += rfc3720() < 0;
+    failed += software_hardware() < 0;
+    failed += extend() < 0;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,262 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// C
+#include <stdlib.h>
+#include <string.h>
+
+// STL
+#include <iostream>
+#include <string>
+#include <vector>
+
+// e
+#include <e/slice.h>
+
+// WTF
+#include "blockstore/device.h"
+#include "blockstore/disk.h"
+
+using wtf::device;
+using wtf::disk;
+
+#define TEST_SUCCESS() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[32mOK\x1b[0m]\n"; \
+        return 0; \
+    } while (0)
+
+#define TEST_FAIL() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[31mFAIL\x1b[0m]\n" \
+                  << "location: " << __FILE__ << ":" << __LINE__<< "\n"; \
+        return -1; \
+    } while (0)
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            TEST_FAIL(); \
+        } \
+    } while (0)
+
+#define SEGMENT_SIZE (64 * 1024)
+#define SEGMENTS 16
+
+// Survives the disk built on top of it, as a file would survive a crash.
+class memory_device : public device
+{
+    public:
+        memory_device(size_t size) : m_data(size, '\0') {}
+        virtual ~memory_device() throw () {}
+
+    public:
+        virtual bool open(const std::string&, size_t, bool) { return true; }
+        virtual size_t alignment() const { return 1; }
+        virtual ssize_t read(size_t offset, size_t len, char* data)
+        {
+            if (offset + len > m_data.size())
+            {
+                return -1;
+            }
+
+            memmove(data, &m_data[offset], len);
+            return len;
+        }
+        virtual ssize_t write(size_t offset, const char* data, size_t len)
+        {
+            if (offset + len > m_data.size())
+            {
+                return -1;
+            }
+
+            memmove(&m_data[offset], data, len);
+            return len;
+        }
+        virtual bool sync() { return true; }
+        virtual void preallocate(size_t) {}
+
+    private:
+        std::vector<char> m_data;
+};
+
+struct record
+{
+    record(const std::string& d, size_t o) : data(d), offset(o) {}
+    std::string data;
+    size_t offset;
+};
+
+static disk*
+open_disk(memory_device* dev)
+{
+    std::vector<device*> devices(1, dev);
+    std::vector<size_t> lengths(1, SEGMENT_SIZE * SEGMENTS);
+    return new disk(devices, lengths, SEGMENT_SIZE, 1);
+}
+
+static bool
+append(disk* d, std::vector<record>* records, size_t n, size_t sz)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        std::string data(sz, static_cast<char>('a' + records->size() % 26));
+        size_t offset;
+
+        if (d->write(e::slice(data), offset) != static_cast<ssize_t>(sz))
+        {
+            return false;
+        }
+
+        d->add_live(offset, sz);
+        records->push_back(record(data, offset));
+    }
+
+    return true;
+}
+
+static bool
+intact(disk* d, const std::vector<record>& records)
+{
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        std::string data(records[i].data.size(), '\0');
+
+        if (d->read(records[i].offset, data.size(), &data[0]) != static_cast<ssize_t>(data.size()) ||
+            data != records[i].data)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+disjoint(const std::vector<record>& records, const record& r)
+{
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        if (r.offset < records[i].offset + records[i].data.size() &&
+            records[i].offset < r.offset + r.data.size())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Restoring a save taken after every write gives back the same segment
+// table, and new appends go past what is already there.
+int restore_saved()
+{
+    memory_device dev(SEGMENT_SIZE * SEGMENTS);
+    std::vector<record> records;
+    std::string saved;
+
+    disk* before = open_disk(&dev);
+    CHECK(append(before, &records, 8, 1000));
+    size_t segment = before->segment_of(records[0].offset);
+    int64_t live = before->live_bytes(segment);
+    size_t free_segments = before->free_segments();
+    before->save(&saved);
+    delete before;
+
+    disk* after = open_disk(&dev);
+    CHECK(after->restore(e::slice(saved)));
+    CHECK(after->live_bytes(segment) == live);
+    CHECK(after->free_segments() == free_segments);
+    std::vector<record> more;
+    CHECK(append(after, &more, 1, 1000));
+    CHECK(disjoint(records, more[0]));
+    CHECK(intact(after, records));
+    CHECK(intact(after, more));
+    delete after;
+    TEST_SUCCESS();
+}
+
+// Writes that follow the last save, including ones in segments activated
+// since, are found in the log itself and never overwritten.
+int restore_past_save()
+{
+    memory_device dev(SEGMENT_SIZE * SEGMENTS);
+    std::vector<record> records;
+    std::string saved;
+
+    disk* before = open_disk(&dev);
+    CHECK(append(before, &records, 1, 20000));
+    before->save(&saved);
+    CHECK(append(before, &records, 6, 20000));
+    CHECK(before->segment_of(records.front().offset) !=
+          before->segment_of(records.back().offset));
+    delete before;
+
+    disk* after = open_disk(&dev);
+    CHECK(after->restore(e::slice(saved)));
+    std::vector<record> more;
+    CHECK(append(after, &more, 4, 20000));
+
+    for (size_t i = 0; i < more.size(); ++i)
+    {
+        CHECK(disjoint(records, more[i]));
+    }
+
+    CHECK(intact(after, records));
+    CHECK(intact(after, more));
+    delete after;
+    TEST_SUCCESS();
+}
+
+// A save that is cut short is refused rather than half applied.
+int restore_corrupt()
+{
+    memory_device dev(SEGMENT_SIZE * SEGMENTS);
+    std::vector<record> records;
+    std::string saved;
+
+    disk* before = open_disk(&dev);
+    CHECK(append(before, &records, 1, 1000));
+    before->save(&saved);
+    delete before;
+
+    disk* after = open_disk(&dev);
+    CHECK(!after->restore(e::slice(saved.data(), saved.size() - 1)));
+    CHECK(!after->restore(e::slice(saved.data(), 4)));
+    delete after;
+    TEST_SUCCESS();
+}
+
+int main()
+{
+    int failed = 0;
+    failed += restore_saved() < 0;
+    failed += restore_past_save() < 0;
+    failed += restore_corrupt() < 0;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
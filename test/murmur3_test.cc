@@ -0,0 +1,113 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// C
+#include <stdlib.h>
+#include <string.h>
+
+// STL
+#include <iostream>
+
+// WTF
+#include "blockstore/murmur3.h"
+
+#define TEST_SUCCESS() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[32mOK\x1b[0m]\n"; \
+        return 0; \
+    } while (0)
+
+#define TEST_FAIL() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[31mFAIL\x1b[0m]\n" \
+                  << "location: " << __FILE__ << ":" << __LINE__<< "\n"; \
+        return -1; \
+    } while (0)
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            TEST_FAIL(); \
+        } \
+    } while (0)
+
+static bool
+hashes_to(const char* data, size_t len, uint32_t seed, uint64_t h1, uint64_t h2)
+{
+    uint64_t out1;
+    uint64_t out2;
+    wtf::murmur3_128(data, len, seed, &out1, &out2);
+    return out1 == h1 && out2 == h2;
+}
+
+// Published MurmurHash3_x64_128 values.
+int reference()
+{
+    CHECK(hashes_to("", 0, 0, 0, 0));
+    CHECK(hashes_to("hello", 5, 0, 0xcbd8a7b341bd9b02ULL, 0x5b1e906a48ae1d19ULL));
+    const char* fox = "The quick brown fox jumps over the lazy dog";
+    CHECK(hashes_to(fox, strlen(fox), 0, 0xe34bbc7bbc071b6cULL, 0x7a433ca9c49a9347ULL));
+    TEST_SUCCESS();
+}
+
+// SMHasher's verification code: hash the empty key, {0}, {0, 1}, ... up to
+// {0, ... 254} with seeds 256 down to 1, then hash the results.  This reaches
+// every tail length.
+int smhasher()
+{
+    uint8_t key[256];
+    uint8_t hashes[256 * 16];
+
+    for (size_t i = 0; i < 256; ++i)
+    {
+        uint64_t h1;
+        uint64_t h2;
+        key[i] = i;
+        wtf::murmur3_128(reinterpret_cast<const char*>(key), i, 256 - i, &h1, &h2);
+
+        for (size_t b = 0; b < 8; ++b)
+        {
+            hashes[i * 16 + b] = h1 >> (8 * b);
+            hashes[i * 16 + 8 + b] = h2 >> (8 * b);
+        }
+    }
+
+    uint64_t h1;
+    uint64_t h2;
+    wtf::murmur3_128(reinterpret_cast<const char*>(hashes), sizeof(hashes), 0, &h1, &h2);
+    CHECK(static_cast<uint32_t>(h1) == 0x6384ba69U);
+    TEST_SUCCESS();
+}
+
+int main()
+{
+    int failed = 0;
+    failed += reference() < 0;
+    failed += smhasher() < 0;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,327 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// C
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+
+// STL
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// WTF
+#include "blockstore/blockmap.h"
+
+using wtf::blockmap;
+
+#define TEST_SUCCESS() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[32mOK\x1b[0m]\n"; \
+        return 0; \
+    } while (0)
+
+#define TEST_FAIL() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[31mFAIL\x1b[0m]\n" \
+                  << "location: " << __FILE__ << ":" << __LINE__<< "\n"; \
+        return -1; \
+    } while (0)
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            TEST_FAIL(); \
+        } \
+    } while (0)
+
+static std::string s_dir;
+static blockmap* s_bm;
+
+static std::string
+pattern(size_t len, char seed)
+{
+    std::string s(len, '\0');
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        s[i] = seed + i % 251;
+    }
+
+    return s;
+}
+
+// Whether readv fills every extent with the bytes that the model says are
+// at [offset, offset + len) of its block.
+static bool
+reads_back(std::vector<blockmap::extent>* exts,
+           const std::vector<const std::string*>& models)
+{
+    std::vector<std::string> bufs(exts->size());
+    ssize_t expect = 0;
+
+    for (size_t i = 0; i < exts->size(); ++i)
+    {
+        blockmap::extent& x((*exts)[i]);
+        bufs[i].assign(x.len, '\xff');
+        x.data = reinterpret_cast<uint8_t*>(&bufs[i][0]);
+        expect += std::min(x.len, models[i]->size() - x.offset);
+    }
+
+    if (s_bm->readv(&(*exts)[0], exts->size()) != expect)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < exts->size(); ++i)
+    {
+        const blockmap::extent& x((*exts)[i]);
+        std::string want(models[i]->substr(x.offset, x.len));
+
+        if (x.got != want.size() || bufs[i].compare(0, x.got, want) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A block with a hole in the middle reads back as zeros there, whether an
+// extent starts in data, in the hole, or spans both.
+int holes()
+{
+    uint64_t bid;
+    uint64_t block_len;
+    std::string head(pattern(4096, 'a'));
+    std::string tail(pattern(100, 'A'));
+    CHECK(s_bm->write(e::slice(head), bid) == 4096);
+    CHECK(s_bm->update(e::slice(tail), 8192, bid, block_len) == 100);
+    CHECK(block_len == 8292);
+
+    std::string model(head + std::string(8192 - 4096, '\0') + tail);
+    std::vector<blockmap::extent> exts;
+    exts.push_back(blockmap::extent(bid, 0, model.size(), NULL));
+    exts.push_back(blockmap::extent(bid, 4000, 200, NULL));
+    exts.push_back(blockmap::extent(bid, 5000, 100, NULL));
+    exts.push_back(blockmap::extent(bid, 8000, 250, NULL));
+    exts.push_back(blockmap::extent(bid, 8200, 1000, NULL));
+    std::vector<const std::string*> models(exts.size(), &model);
+    CHECK(reads_back(&exts, models));
+    TEST_SUCCESS();
+}
+
+// Extents of blocks written back to back land next to each other in the log
+// and are read as one merged range, in whatever order they are asked for.
+int merged()
+{
+    std::vector<std::string> models;
+    std::vector<uint64_t> bids;
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        uint64_t bid;
+        models.push_back(pattern(1000 + i * 300, 'a' + i));
+        CHECK(s_bm->write(e::slice(models.back()), bid) ==
+              static_cast<ssize_t>(models.back().size()));
+        bids.push_back(bid);
+    }
+
+    std::vector<blockmap::extent> exts;
+    std::vector<const std::string*> want;
+    exts.push_back(blockmap::extent(bids[3], 10, 500, NULL));
+    want.push_back(&models[3]);
+    exts.push_back(blockmap::extent(bids[0], 0, models[0].size(), NULL));
+    want.push_back(&models[0]);
+    exts.push_back(blockmap::extent(bids[2], 600, 100, NULL));
+    want.push_back(&models[2]);
+    exts.push_back(blockmap::extent(bids[0], 100, 50, NULL));
+    want.push_back(&models[0]);
+    exts.push_back(blockmap::extent(bids[1], 1200, 4096, NULL));
+    want.push_back(&models[1]);
+    CHECK(reads_back(&exts, want));
+    TEST_SUCCESS();
+}
+
+// An extent that starts past the end of its block gets nothing, without
+// failing the extents next to it.
+int past_end()
+{
+    uint64_t bid;
+    std::string data(pattern(100, 'z'));
+    CHECK(s_bm->write(e::slice(data), bid) == 100);
+
+    uint8_t buf[3][16];
+    blockmap::extent exts[3];
+    exts[0] = blockmap::extent(bid, 0, sizeof(buf[0]), buf[0]);
+    exts[1] = blockmap::extent(bid, 100, sizeof(buf[1]), buf[1]);
+    exts[2] = blockmap::extent(bid, 90, sizeof(buf[2]), buf[2]);
+    CHECK(s_bm->readv(exts, 3) == 16 + 10);
+    CHECK(exts[0].got == 16 && memcmp(buf[0], data.data(), 16) == 0);
+    CHECK(exts[1].got == 0);
+    CHECK(exts[2].got == 10 && memcmp(buf[2], data.data() + 90, 10) == 0);
+    TEST_SUCCESS();
+}
+
+// A block truncated into a hole keeps its length, and the gap after its last
+// slice reads back as zeros.
+int tail_hole()
+{
+    uint64_t bid;
+    uint64_t block_len;
+    std::string head(pattern(4096, 't'));
+    std::string tail(pattern(100, 'T'));
+    CHECK(s_bm->write(e::slice(head), bid) == 4096);
+    CHECK(s_bm->update(e::slice(tail), 8192, bid, block_len) == 100);
+    CHECK(s_bm->truncate(bid, 6000) == 6000);
+    CHECK(s_bm->length(bid) == 6000);
+
+    std::string model(head + std::string(6000 - 4096, '\0'));
+    std::vector<blockmap::extent> exts;
+    exts.push_back(blockmap::extent(bid, 0, 8192, NULL));
+    exts.push_back(blockmap::extent(bid, 4000, 1000, NULL));
+    exts.push_back(blockmap::extent(bid, 5000, 4000, NULL));
+    std::vector<const std::string*> models(exts.size(), &model);
+    CHECK(reads_back(&exts, models));
+    TEST_SUCCESS();
+}
+
+// A block of several CRC chunks reads back whether an extent sits inside one
+// chunk, straddles two, or covers the whole block, before and after an update
+// cuts its record into pieces.
+int chunked()
+{
+    const size_t chunk = wtf::vblock::slice::CRC_CHUNK;
+    uint64_t bid;
+    uint64_t block_len;
+    std::string model(pattern(4 * chunk + 1000, 'c'));
+    CHECK(s_bm->write(e::slice(model), bid) ==
+          static_cast<ssize_t>(model.size()));
+
+    std::vector<blockmap::extent> exts;
+    exts.push_back(blockmap::extent(bid, 0, model.size(), NULL));
+    exts.push_back(blockmap::extent(bid, 10, 100, NULL));
+    exts.push_back(blockmap::extent(bid, chunk - 50, 100, NULL));
+    exts.push_back(blockmap::extent(bid, 2 * chunk, chunk, NULL));
+    exts.push_back(blockmap::extent(bid, 4 * chunk + 500, 1000, NULL));
+    std::vector<const std::string*> models(exts.size(), &model);
+    CHECK(reads_back(&exts, models));
+
+    std::string patch(pattern(3000, 'P'));
+    CHECK(s_bm->update(e::slice(patch), chunk - 1000, bid, block_len) == 3000);
+    model.replace(chunk - 1000, patch.size(), patch);
+
+    for (size_t i = 0; i < exts.size(); ++i)
+    {
+        exts[i].bid = bid;
+    }
+
+    CHECK(reads_back(&exts, models));
+    TEST_SUCCESS();
+}
+
+// A corrupt chunk fails the reads that touch it and no others, including on
+// the pieces an update cut from the record.
+int chunk_corrupt()
+{
+    const size_t chunk = wtf::vblock::slice::CRC_CHUNK;
+    uint64_t bid;
+    uint64_t block_len;
+    std::string model(pattern(3 * chunk, 'k'));
+    CHECK(s_bm->write(e::slice(model), bid) ==
+          static_cast<ssize_t>(model.size()));
+    uint64_t start;
+    uint64_t end;
+    CHECK(s_bm->disk_span(bid, &start, &end) == 0);
+    std::string patch(pattern(100, 'Q'));
+    CHECK(s_bm->update(e::slice(patch), chunk + 500, bid, block_len) == 100);
+
+    std::string path(s_dir + "/data");
+    int fd = open(path.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    char junk = '\x5a' ^ model[2 * chunk + 10];
+    ssize_t wrote = pwrite(fd, &junk, 1, start + 2 * chunk + 10);
+    close(fd);
+    CHECK(wrote == 1);
+
+    uint8_t buf[100];
+    blockmap::extent x(bid, 10, sizeof(buf), buf);
+    CHECK(s_bm->readv(&x, 1) == static_cast<ssize_t>(sizeof(buf)));
+    CHECK(memcmp(buf, model.data() + 10, sizeof(buf)) == 0);
+    x = blockmap::extent(bid, chunk + 1000, sizeof(buf), buf);
+    CHECK(s_bm->readv(&x, 1) == static_cast<ssize_t>(sizeof(buf)));
+    CHECK(memcmp(buf, model.data() + chunk + 1000, sizeof(buf)) == 0);
+    x = blockmap::extent(bid, 2 * chunk, sizeof(buf), buf);
+    CHECK(s_bm->readv(&x, 1) < 0);
+    TEST_SUCCESS();
+}
+
+int main()
+{
+    char tmpl[] = "/tmp/wtf-readv-test-XXXXXX";
+
+    if (!mkdtemp(tmpl))
+    {
+        std::cerr << "could not create a scratch directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    s_dir = tmpl;
+    std::vector<po6::pathname> backing;
+    backing.push_back(po6::pathname((s_dir + "/data").c_str()));
+    s_bm = new blockmap();
+
+    if (!s_bm->setup(po6::pathname((s_dir + "/metadata").c_str()),
+                     backing, 1, "mmap", false))
+    {
+        std::cerr << "could not set up a blockmap in " << s_dir << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    failed += holes() < 0;
+    failed += merged() < 0;
+    failed += past_end() < 0;
+    failed += tail_hole() < 0;
+    failed += chunked() < 0;
+    failed += chunk_corrupt() < 0;
+    delete s_bm;
+    std::string rm("rm -rf " + s_dir);
+
+    if (system(rm.c_str()) != 0)
+    {
+        std::cerr << "could not remove " << s_dir << std::endl;
+    }
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,348 @@
+// Copyright (c) 2013, Sean Ogden
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of WTF nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// C
+#include <stdlib.h>
+#include <string.h>
+
+// STL
+#include <iostream>
+
+// e
+#include <e/endian.h>
+
+// WTF
+#include "blockstore/vblock.h"
+
+using wtf::vblock;
+
+#define TEST_SUCCESS() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[32mOK\x1b[0m]\n"; \
+        return 0; \
+    } while (0)
+
+#define TEST_FAIL() \
+    do { \
+        std::cout << "Test " << __func__ << ":  [\x1b[31mFAIL\x1b[0m]\n" \
+                  << "location: " << __FILE__ << ":" << __LINE__<< "\n"; \
+        return -1; \
+    } while (0)
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            TEST_FAIL(); \
+        } \
+    } while (0)
+
+#define CHECK_SLICE(VB, INDEX, OFFSET, LEN, DISK_OFFSET) \
+    do { \
+        if (VB.slices()[INDEX].offset() != OFFSET \
+            || VB.slices()[INDEX].length() != LEN \
+            || VB.slices()[INDEX].disk_offset() != DISK_OFFSET) \
+        { \
+            std::cout << "dump: " << VB << std::endl; \
+            TEST_FAIL(); \
+        } \
+    } while (0)
+
+// Writing into the middle of a slice splits it around the new one.
+int update_middle()
+{
+    vblock vb;
+    vb.update(0, 100, 1000, 0);
+    vb.update(20, 10, 5000, 1);
+    CHECK(vb.size() == 3);
+    CHECK_SLICE(vb, 0, 0, 20, 1000);
+    CHECK_SLICE(vb, 1, 20, 10, 5000);
+    CHECK_SLICE(vb, 2, 30, 70, 1030);
+    CHECK(vb.slices()[1].device() == 1);
+    CHECK(vb.length() == 100);
+    TEST_SUCCESS();
+}
+
+// A write over several slices replaces those it covers and trims the ends.
+int update_across()
+{
+    vblock vb;
+    vb.update(0, 10, 100, 0);
+    vb.update(10, 10, 200, 0);
+    vb.update(20, 10, 300, 0);
+    vb.update(5, 20, 900, 0);
+    CHECK(vb.size() == 3);
+    CHECK_SLICE(vb, 0, 0, 5, 100);
+    CHECK_SLICE(vb, 1, 5, 20, 900);
+    CHECK_SLICE(vb, 2, 25, 5, 305);
+    TEST_SUCCESS();
+}
+
+// Holes between slices stay holes; a write past the end extends the block.
+int update_holes()
+{
+    vblock vb;
+    vb.update(20, 10, 200, 0);
+    vb.update(0, 10, 100, 0);
+    vb.update(5, 10, 500, 0);
+    vb.update(40, 5, 400, 0);
+    vb.update(0, 0, 999, 0);
+    CHECK(vb.size() == 4);
+    CHECK_SLICE(vb, 0, 0, 5, 100);
+    CHECK_SLICE(vb, 1, 5, 10, 500);
+    CHECK_SLICE(vb, 2, 20, 10, 200);
+    CHECK_SLICE(vb, 3, 40, 5, 400);
+    CHECK(vb.length() == 45);
+    TEST_SUCCESS();
+}
+
+// Cutting a legacy plain slice, one with no stored length, moves its disk
+// offset and drops the CRC unless the cut is the whole slice.
+int cut_plain()
+{
+    vblock::slice s(100, 50, 4000, 2);
+    s.set_crc(0xdeadbeef);
+
+    vblock::slice whole(s.cut(100, 50));
+    CHECK(whole == s);
+
+    vblock::slice part(s.cut(110, 20));
+    CHECK(part.offset() == 110);
+    CHECK(part.length() == 20);
+    CHECK(part.disk_offset() == 4010);
+    CHECK(part.device() == 2);
+    CHECK(!part.checksummed());
+    TEST_SUCCESS();
+}
+
+// Cutting a compressed slice moves only the skip into the record, so the
+// pieces keep the record's CRC.
+int cut_compressed()
+{
+    vblock::slice s(100, 50, 4000, 0);
+    s.set_compression(1, 30, 0);
+    s.set_crc(0xdeadbeef);
+
+    vblock::slice part(s.cut(110, 20));
+    CHECK(part.offset() == 110);
+    CHECK(part.length() == 20);
+    CHECK(part.disk_offset() == 4000);
+    CHECK(part.skip() == 10);
+    CHECK(part.stored_length() == 30);
+    CHECK(part.checksummed() && part.crc() == 0xdeadbeef);
+    TEST_SUCCESS();
+}
+
+// Cutting a chunked plain slice moves only the skip, so the pieces keep the
+// CRC of the record and of its chunk table.
+int cut_chunked()
+{
+    const size_t chunk = vblock::slice::CRC_CHUNK;
+    const size_t len = 3 * chunk + 7;
+    vblock::slice s(0, len, 4000, 0);
+    s.set_compression(0, vblock::slice::chunked_length(len), 0);
+    s.set_crc(0xdeadbeef);
+    CHECK(s.chunked());
+    CHECK(s.disk_length() == len + 4 * 4);
+    CHECK(s.record_length() == len);
+
+    vblock::slice part(s.cut(chunk + 10, 20));
+    CHECK(part.offset() == chunk + 10);
+    CHECK(part.length() == 20);
+    CHECK(part.disk_offset() == 4000);
+    CHECK(part.skip() == chunk + 10);
+    CHECK(part.record_length() == len);
+    CHECK(part.checksummed() && part.crc() == 0xdeadbeef);
+    TEST_SUCCESS();
+}
+
+// A record of one chunk carries no table; longer ones carry a CRC per chunk.
+int chunked_length()
+{
+    const size_t chunk = vblock::slice::CRC_CHUNK;
+    CHECK(vblock::slice::chunked_length(1) == 1);
+    CHECK(vblock::slice::chunked_length(chunk) == chunk);
+    CHECK(vblock::slice::chunked_length(chunk + 1) == chunk + 1 + 8);
+    CHECK(vblock::slice::chunked_length(2 * chunk) == 2 * chunk + 8);
+    CHECK(vblock::slice::chunked_length(2 * chunk + 1) == 2 * chunk + 1 + 12);
+    TEST_SUCCESS();
+}
+
+// Shrinking drops the slices past the new end and trims the one it falls in.
+int set_len()
+{
+    vblock vb;
+    vb.update(0, 10, 100, 0);
+    vb.update(10, 10, 200, 0);
+    vb.update(30, 10, 300, 0);
+
+    vb.set_len(50);
+    CHECK(vb.size() == 3);
+
+    vb.set_len(25);
+    CHECK(vb.size() == 2);
+    CHECK_SLICE(vb, 1, 10, 10, 200);
+
+    vb.set_len(15);
+    CHECK(vb.size() == 2);
+    CHECK_SLICE(vb, 1, 10, 5, 200);
+
+    vb.set_len(10);
+    CHECK(vb.size() == 1);
+    CHECK_SLICE(vb, 0, 0, 10, 100);
+
+    vb.set_len(0);
+    CHECK(vb.size() == 0);
+    CHECK(vb.length() == 0);
+    TEST_SUCCESS();
+}
+
+// Padding ends the block with one empty slice, moved rather than added to
+// when the block is padded again.
+int pad()
+{
+    vblock vb;
+    vb.update(0, 10, 100, 0);
+    vb.pad(5);
+    CHECK(vb.size() == 1);
+    CHECK(vb.length() == 10);
+
+    vb.pad(30);
+    CHECK(vb.size() == 2);
+    CHECK(vb.length() == 30);
+    CHECK_SLICE(vb, 1, 30, 0, 0);
+
+    vb.pad(40);
+    CHECK(vb.size() == 2);
+    CHECK_SLICE(vb, 1, 40, 0, 0);
+
+    vb.set_len(20);
+    CHECK(vb.size() == 1);
+    CHECK(vb.length() == 10);
+    TEST_SUCCESS();
+}
+
+static void
+pack_entry(uint8_t* ptr, uint64_t offset, uint64_t length, uint64_t disk_offset)
+{
+    ptr = e::pack64be(offset, ptr);
+    ptr = e::pack64be(length, ptr);
+    ptr = e::pack64be(disk_offset, ptr);
+}
+
+// Maps written before the header start with a 64-bit count and hold
+// base-width entries on device 0.
+int parse_header_legacy()
+{
+    const size_t width = vblock::slice::BASE_PACK_SIZE;
+    uint8_t map[sizeof(uint64_t) + 2 * width];
+    e::pack64be(2, map);
+    pack_entry(map + sizeof(uint64_t), 0, 10, 100);
+    pack_entry(map + sizeof(uint64_t) + width, 10, 5, 200);
+
+    size_t header;
+    size_t w;
+    size_t count;
+    CHECK(vblock::parse_header(map, sizeof(map), &header, &w, &count));
+    CHECK(header == sizeof(uint64_t));
+    CHECK(w == width);
+    CHECK(count == 2);
+
+    // A count the buffer cannot hold is refused.
+    CHECK(!vblock::parse_header(map, sizeof(map) - 1, &header, &w, &count));
+
+    wtf::vblock_view view;
+    CHECK(view.parse(map, sizeof(map)));
+    CHECK(view.size() == 2);
+    CHECK(view.slice_at(1) == vblock::slice(10, 5, 200, 0));
+    CHECK(view.find(12) == 1);
+    CHECK(view.length() == 15);
+    TEST_SUCCESS();
+}
+
+// Version 1 maps give the entry width in the header; a reader skips the
+// fields it does not know about.
+int parse_header_v1()
+{
+    const size_t width = vblock::slice::pack_size() + 8;
+    uint8_t map[vblock::HEADER_SIZE + 2 * width];
+    memset(map, 0, sizeof(map));
+    map[0] = vblock::FORMAT_VERSION;
+    map[1] = width;
+    e::pack32be(2, map + 4);
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        uint8_t* entry = map + vblock::HEADER_SIZE + i * width;
+        pack_entry(entry, i * 10, 10, 100 * (i + 1));
+        e::pack32be(vblock::slice::CHECKSUMMED | 3, entry + vblock::slice::BASE_PACK_SIZE);
+        e::pack32be(0xcafe, entry + vblock::slice::BASE_PACK_SIZE + 4);
+    }
+
+    size_t header;
+    size_t w;
+    size_t count;
+    CHECK(vblock::parse_header(map, sizeof(map), &header, &w, &count));
+    CHECK(header == vblock::HEADER_SIZE);
+    CHECK(w == width);
+    CHECK(count == 2);
+
+    wtf::vblock_view view;
+    CHECK(view.parse(map, sizeof(map)));
+    vblock::slice s(view.slice_at(1));
+    CHECK(s.offset() == 10 && s.length() == 10 && s.disk_offset() == 200);
+    CHECK(s.device() == 3);
+    CHECK(s.checksummed() && s.crc() == 0xcafe);
+    CHECK(!s.compressed());
+
+    // Unknown versions and entries too narrow for the base fields are
+    // refused.
+    map[0] = vblock::FORMAT_VERSION + 1;
+    CHECK(!vblock::parse_header(map, sizeof(map), &header, &w, &count));
+    map[0] = vblock::FORMAT_VERSION;
+    map[1] = vblock::slice::BASE_PACK_SIZE - 1;
+    CHECK(!vblock::parse_header(map, sizeof(map), &header, &w, &count));
+    CHECK(!vblock::parse_header(map, vblock::HEADER_SIZE - 1, &header, &w, &count));
+    TEST_SUCCESS();
+}
+
+int main()
+{
+    int failed = 0;
+    failed += update_middle() < 0;
+    failed += update_across() < 0;
+    failed += update_holes() < 0;
+    failed += cut_plain() < 0;
+    failed += cut_compressed() < 0;
+    failed += cut_chunked() < 0;
+    failed += chunked_length() < 0;
+    failed += set_len() < 0;
+    failed += pad() < 0;
+    failed += parse_header_legacy() < 0;
+    failed += parse_header_v1() < 0;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}